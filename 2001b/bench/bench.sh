@@ -0,0 +1,146 @@
+#!/bin/sh
+# End-to-end filebot benchmark
+#
+# For every combination of num_workers, interval_ms, durability and
+# sched_policy, starts
+# filebot on an empty spool, generates the workload with emailbot-gen, waits
+# until all applications are published and reports throughput and the detect
+# to published latency (arrival->publish from filebot-trace: the earliest of
+# the file ctime, the inotify event and the enqueue, up to the report, which
+# waits for the sync with durability = batch).
+#
+# usage: bench/bench.sh [-n APPS] [-m FILES] [-s SIZE[:MAX]] [-r APPS_PER_S]
+#                       [-w "WORKERS..."] [-i "INTERVALS_MS..."]
+#                       [-d "none batch strict"] [-p "readdir fifo sjf"]
+#                       [-l flat|dir] [-b EVERY:SIZE] [-t TIMEOUT_S]
+#                       [-c "KEY = VALUE"]...
+#
+# -c adds a line to filebot.conf, e.g. -c "io_rate_mb = 20".
+
+set -u
+
+NAPPS=1000
+NFILES=4
+SIZE=16384
+RATE=0
+WORKERS="1 2 4 8"
+INTERVALS="10 100"
+DURABILITY="none"
+LAYOUT=flat
+POLICY="readdir"
+BIG=""
+TIMEOUT=300
+EXTRA=""
+
+while getopts "n:m:s:r:w:i:d:p:l:b:t:c:" opt; do
+	case $opt in
+	n) NAPPS=$OPTARG ;;
+	m) NFILES=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	r) RATE=$OPTARG ;;
+	w) WORKERS=$OPTARG ;;
+	i) INTERVALS=$OPTARG ;;
+	d) DURABILITY=$OPTARG ;;
+	p) POLICY=$OPTARG ;;
+	l) LAYOUT=$OPTARG ;;
+	b) BIG=$OPTARG ;;
+	t) TIMEOUT=$OPTARG ;;
+	c) EXTRA="$EXTRA$OPTARG
+" ;;
+	*) echo "usage: $0 [-n APPS] [-m FILES] [-s SIZE[:MAX]] [-r APPS_PER_S]" \
+		"[-w \"WORKERS...\"] [-i \"INTERVALS_MS...\"]" \
+		"[-d \"none batch strict\"] [-p \"readdir fifo sjf\"] [-l flat|dir]" \
+		"[-b EVERY:SIZE] [-t TIMEOUT_S] [-c \"KEY = VALUE\"]..." >&2
+	   exit 1 ;;
+	esac
+done
+
+BIN=$(cd "$(dirname "$0")/.." && pwd)
+for exe in filebot filebot-trace emailbot-gen; do
+	if [ ! -x "$BIN/$exe" ]; then
+		echo "bench: $BIN/$exe not built, run make bench" >&2
+		exit 1
+	fi
+done
+
+now_ms() {
+	date +%s%3N
+}
+
+# one 96 byte completion.log record per published application
+published() {
+	echo $(( $(stat -c %s "$1/completion.log" 2>/dev/null || echo 0) / 96 ))
+}
+
+# run_one WORKERS INTERVAL_MS DURABILITY POLICY
+run_one() {
+	dir=$(mktemp -d "${TMPDIR:-/tmp}/filebot-bench.XXXXXX")
+	mkdir "$dir/in" "$dir/out"
+	cat > "$dir/filebot.conf" <<-EOF
+	input_dir = $dir/in
+	output_dir = $dir/out
+	num_workers = $1
+	interval_ms = $2
+	durability = $3
+	sched_policy = $4
+	input_layout = $LAYOUT
+	stats_shm = /filebot-bench-$$
+	trace_dir = $dir/trace
+	trace_events = $((NAPPS * 6 + 1024))
+	EOF
+	printf "%s" "$EXTRA" >> "$dir/filebot.conf"
+
+	(cd "$dir" && exec "$BIN/filebot" filebot.conf) > "$dir/filebot.log" 2>&1 &
+	pid=$!
+	sleep 0.2
+
+	start=$(now_ms)
+	gen=$("$BIN/emailbot-gen" -o "$dir/in" -n "$NAPPS" -m "$NFILES" \
+		-s "$SIZE" -r "$RATE" $([ "$LAYOUT" = dir ] && echo -d) \
+		${BIG:+-b "$BIG"})
+	bytes=$(echo "$gen" | sed -n 's/.* files, \([0-9]*\) bytes.*/\1/p')
+
+	deadline=$((start + TIMEOUT * 1000))
+	while [ "$(published "$dir/out")" -lt "$NAPPS" ]; do
+		if ! kill -0 $pid 2>/dev/null || [ "$(now_ms)" -gt "$deadline" ]; then
+			printf "%7s %11s %10s %7s   FAILED (%s of %s published), see %s\n" \
+				"$1" "$2" "$3" "$4" "$(published "$dir/out")" "$NAPPS" "$dir"
+			kill -INT $pid 2>/dev/null
+			wait $pid 2>/dev/null
+			return 1
+		fi
+		sleep 0.05
+	done
+	end=$(now_ms)
+
+	kill -INT $pid
+	wait $pid 2>/dev/null
+
+	lat=$("$BIN/filebot-trace" -o "$dir/trace.json" "$dir"/trace/*.bin \
+		| awk '$1 == "arrival->publish" { print $3, $4 }')
+	set -- "$1" "$2" "$3" "$4" $lat
+	awk -v w="$1" -v i="$2" -v d="$3" -v p="$4" -v n="$NAPPS" -v b="$bytes" \
+		-v ms=$((end - start)) -v p50="${5:--}" -v p99="${6:--}" 'BEGIN {
+		s = ms / 1000.0
+		printf "%7d %11d %10s %7s %10.1f %10.2f %12s %12s\n", w, i, d, p, n / s,
+			b / s / 1e6, p50 == "-" ? "-" : sprintf("%.2f", p50 / 1000),
+			p99 == "-" ? "-" : sprintf("%.2f", p99 / 1000)
+	}'
+	rm -rf "$dir"
+}
+
+echo "$NAPPS applications x $NFILES files, size $SIZE, rate ${RATE:-0} apl/s (0: burst)," \
+	"$LAYOUT input"
+printf "%7s %11s %10s %7s %10s %10s %12s %12s\n" "workers" "interval_ms" \
+	"durability" "policy" "apl/s" "MB/s" "p50 (ms)" "p99 (ms)"
+status=0
+for w in $WORKERS; do
+	for i in $INTERVALS; do
+		for d in $DURABILITY; do
+			for p in $POLICY; do
+				run_one "$w" "$i" "$d" "$p" || status=1
+			done
+		done
+	done
+done
+exit $status
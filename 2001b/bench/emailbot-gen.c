@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/**
+ * emailbot-gen: synthetic Applications Email Bot
+ *
+ * Writes N applications of M files each into the input directory of
+ * filebot, at a fixed arrival rate. Like the real bot, all files of one
+ * application share the "<jobapl>-" prefix:
+ *
+ *   <jobapl>-email.txt
+ *   <jobapl>-attachment-<k>.pdf	(M - 2 of them, SIZE bytes each)
+ *   <jobapl>-candidate-data.txt	(job reference on the first line)
+ *
+ * The candidate data is written last, in a staging directory next to the
+ * input directory, and then linked into it: scan_dir() treats it as the
+ * marker of a complete application, so it must never be seen half written.
+ *
+ * With -b EVERY:SIZE, the first attachment of every EVERY-th application
+ * is SIZE bytes, a few large applications among small ones.
+ *
+ * With -d (filebot input_layout = dir) each application is written to its
+ * own directory in the staging directory and renamed in as <jobapl>/.
+ *
+ * With -u PERCENT, every attachment has content of its own, except PERCENT
+ * of them which are one of DUP_POOL CVs sent again, for filebot dedup.
+ * Without it, attachments of one size are all the same.
+ */
+
+#define CHUNK 65536
+#define DUP_POOL 16
+
+static void usage(const char* prog) {
+	die("Usage: %s -o INPUT_DIR [-n APPS] [-m FILES] [-s SIZE[:MAX]] "
+			"[-r APPS_PER_S] [-j JOBREF[,JOBREF...]] [-f FIRST_JOBAPL] [-b EVERY:SIZE] [-d] "
+			"[-u PERCENT]", prog);
+}
+
+static void write_file(const char* path, const char* data, size_t len, size_t size) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		die("open %s:", path);
+	}
+	if (len > 0 && write(fd, data, len) != (ssize_t)len) {
+		die("write %s:", path);
+	}
+
+	static char chunk[CHUNK];
+	if (chunk[0] == '\0') {
+		memset(chunk, 'x', sizeof(chunk));
+	}
+	for (size_t left = size > len ? size - len : 0; left > 0; ) {
+		size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+		if (write(fd, chunk, n) != (ssize_t)n) {
+			die("write %s:", path);
+		}
+		left -= n;
+	}
+	close(fd);
+}
+
+/* add ns nanoseconds to an absolute CLOCK_MONOTONIC deadline */
+static void timespec_add(struct timespec* ts, uint64_t ns) {
+	ts->tv_nsec += ns % 1000000000ULL;
+	ts->tv_sec += ns / 1000000000ULL + ts->tv_nsec / 1000000000L;
+	ts->tv_nsec %= 1000000000L;
+}
+
+int main(int argc, char** argv) {
+	const char* input_dir = NULL;
+	char jobrefs_arg[512] = "IBM-000123";
+	long napps = 100;
+	long nfiles = 4;
+	long size_min = 4096, size_max = 4096;
+	double rate = 0; /* 0: as fast as possible */
+	long first = 1;
+	int per_dir = 0;
+	long big_every = 0, big_size = 0;
+	int dup_percent = -1;	/* -1: no content of their own */
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:n:m:s:r:j:f:b:du:")) != -1) {
+		switch (opt) {
+		case 'o': input_dir = optarg; break;
+		case 'n': napps = atol(optarg); break;
+		case 'm': nfiles = atol(optarg); break;
+		case 's':
+			if (sscanf(optarg, "%ld:%ld", &size_min, &size_max) != 2) {
+				size_max = size_min;
+			}
+			break;
+		case 'r': rate = atof(optarg); break;
+		case 'j': snprintf(jobrefs_arg, sizeof(jobrefs_arg), "%s", optarg); break;
+		case 'f': first = atol(optarg); break;
+		case 'b':
+			if (sscanf(optarg, "%ld:%ld", &big_every, &big_size) != 2) {
+				usage(argv[0]);
+			}
+			break;
+		case 'd': per_dir = 1; break;
+		case 'u': dup_percent = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (input_dir == NULL || napps < 1 || nfiles < 2 || first < 1
+			|| size_min < 0 || size_max < size_min || rate < 0
+			|| big_every < 0 || big_size < 0 || dup_percent > 100) {
+		usage(argv[0]);
+	}
+
+	/* comma separated job references, applications are assigned round robin */
+	char* jobrefs[64];
+	int njobrefs = 0;
+	for (char* tok = strtok(jobrefs_arg, ","); tok != NULL && njobrefs < 64;
+			tok = strtok(NULL, ",")) {
+		jobrefs[njobrefs++] = tok;
+	}
+	if (njobrefs == 0) {
+		usage(argv[0]);
+	}
+
+	char staging[1024];
+	snprintf(staging, sizeof(staging), "%s/../.emailbot-gen.%d", input_dir, getpid());
+	if (mkdir_if_need(input_dir) == -1 || mkdir_if_need(staging) == -1) {
+		die("cannot create %s", staging);
+	}
+
+	srand(first);
+	uint64_t total_bytes = 0;
+	uint64_t period_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	uint64_t start = now_ns();
+
+	char path[2048], tmp[2048], text[512], app_dir[1100];
+	for (long a = first; a < first + napps; a++) {
+		if (period_ns > 0) {
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+			timespec_add(&next, period_ns);
+		}
+		const char* jobref = jobrefs[(a - first) % njobrefs];
+
+		/* files go to dir: input_dir, or the application directory being staged */
+		const char* dir = input_dir;
+		if (per_dir) {
+			snprintf(app_dir, sizeof(app_dir), "%s/%ld", staging, a);
+			if (mkdir_if_need(app_dir) == -1) {
+				die("cannot create %s", app_dir);
+			}
+			dir = app_dir;
+		}
+
+		int len = snprintf(text, sizeof(text), "From: <candidate%ld@email.com>\n"
+				"Subject: Application for %s\n\nPlease find my CV attached.\n",
+				a, jobref);
+		snprintf(path, sizeof(path), "%s/%ld-email.txt", dir, a);
+		write_file(path, text, len, len);
+		total_bytes += len;
+
+		for (long k = 1; k <= nfiles - 2; k++) {
+			long size = size_min;
+			if (size_max > size_min) {
+				size += rand() % (size_max - size_min + 1);
+			}
+			if (k == 1 && big_every > 0 && (a - first) % big_every == big_every - 1) {
+				size = big_size;
+			}
+			/* a CV of the pool always has the same size */
+			len = 0;
+			if (dup_percent >= 0 && rand() % 100 < dup_percent) {
+				long cv = rand() % DUP_POOL;
+				size = size_min + cv * 7919 % (size_max - size_min + 1);
+				len = snprintf(text, sizeof(text), "%%PDF cv %ld\n", cv);
+			} else if (dup_percent >= 0) {
+				len = snprintf(text, sizeof(text), "%%PDF %ld-%ld\n", a, k);
+			}
+			snprintf(path, sizeof(path), "%s/%ld-attachment-%ld.pdf", dir, a, k);
+			write_file(path, text, len, size);
+			total_bytes += size;
+		}
+
+		len = snprintf(text, sizeof(text), "%s\ncandidate%ld@email.com\n"
+				"Candidate %ld\n9%08ld\n", jobref, a, a, a);
+		total_bytes += len;
+		if (per_dir) {
+			snprintf(path, sizeof(path), "%s/%ld-candidate-data.txt", app_dir, a);
+			write_file(path, text, len, len);
+			snprintf(path, sizeof(path), "%s/%ld", input_dir, a);
+			if (rename(app_dir, path) == -1) {
+				die("rename %s:", path);
+			}
+			continue;
+		}
+		snprintf(tmp, sizeof(tmp), "%s/%ld-candidate-data.txt", staging, a);
+		snprintf(path, sizeof(path), "%s/%ld-candidate-data.txt", input_dir, a);
+		write_file(tmp, text, len, len);
+		if (link(tmp, path) == -1) {
+			die("link %s:", path);
+		}
+		unlink(tmp);
+	}
+
+	rmdir(staging);
+
+	double elapsed = (now_ns() - start) / 1e9;
+	printf("generated %ld applications, %ld files, %lu bytes in %.3fs\n",
+			napps, napps * nfiles, total_bytes, elapsed);
+	return 0;
+}
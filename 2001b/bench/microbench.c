@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/**
+ * util-microbench: microbenchmarks for the util.c primitives
+ *
+ * util-microbench [-r REPETITIONS] [-w WARMUP_REPETITIONS] [-t MIN_TIME_MS] [FILTER]
+ *
+ * Every benchmark is calibrated so that one repetition lasts at least
+ * MIN_TIME_MS, then run WARMUP times untimed and REPETITIONS times timed.
+ * The JSON on stdout lists the benchmarks always in the same order with
+ * min/median/max of ns/op and cycles/op, so that two runs can be diffed.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles(void) { return __rdtsc(); }
+#else
+static inline uint64_t cycles(void) { return 0; }
+#endif
+
+#define MAX_REPS 1000
+
+/* keeps results alive so the compiler cannot drop the measured calls */
+static volatile uintptr_t sink;
+
+typedef struct {
+	const char* name;
+	void (*setup)(void);
+	void (*run)(long iters);
+	void (*teardown)(void);
+} st_bench;
+
+static char scratch[1024];
+static Vec* vec;
+static char* items[1024];
+
+static void vec_setup(void) {
+	for (size_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+		items[i] = scratch + i;
+	}
+}
+
+static void bench_vec_push_pop(long iters) {
+	Vec* v = vec_create(16);
+	for (long i = 0; i < iters; i++) {
+		vec_push(v, items[i & 1023]);
+		if ((i & 1023) == 1023) {
+			while (v->size > 0) {
+				sink += (uintptr_t)vec_pop(v);
+			}
+		}
+	}
+	vec_destroy(v);
+}
+
+/* FIFO use by parent_process(): push at the tail, remove at the head */
+static void vec_fifo_setup(size_t depth) {
+	vec_setup();
+	vec = vec_create(16);
+	for (size_t i = 0; i < depth; i++) {
+		vec_push(vec, items[i & 1023]);
+	}
+}
+
+static void vec_fifo_setup_16(void) { vec_fifo_setup(16); }
+static void vec_fifo_setup_1024(void) { vec_fifo_setup(1024); }
+static void vec_fifo_setup_65536(void) { vec_fifo_setup(65536); }
+
+static void vec_fifo_teardown(void) {
+	vec_destroy(vec);
+}
+
+static void bench_vec_fifo(long iters) {
+	for (long i = 0; i < iters; i++) {
+		vec_push(vec, items[i & 1023]);
+		sink += (uintptr_t)vec_remove(vec, 0);
+	}
+}
+
+static void bench_vec_create_grow(long iters) {
+	for (long i = 0; i < iters; i++) {
+		Vec* v = vec_create(1);
+		for (int k = 0; k < 10; k++) {
+			vec_grow(v);
+		}
+		sink += v->capacity;
+		vec_destroy(v);
+	}
+}
+
+static void bench_matches_regex_prefix(long iters) {
+	for (long i = 0; i < iters; i++) {
+		sink += matches_regex("1234-candidate-data.txt", "^1234-");
+	}
+}
+
+static void bench_matches_regex_suffix(long iters) {
+	for (long i = 0; i < iters; i++) {
+		sink += matches_regex("1234-attachment-1.pdf", "-candidate-data.txt");
+	}
+}
+
+static void bench_get_jobapl_from_filename(long iters) {
+	static const char* names[] = {
+		"1-email.txt", "42-cv.txt", "1236969-candidate-data.txt", "x-bad.txt"
+	};
+	for (long i = 0; i < iters; i++) {
+		sink += get_jobapl_from_filename(names[i & 3]);
+	}
+}
+
+static char bench_dir[64];
+static char ca_data[128];
+
+static void fs_setup(void) {
+	snprintf(bench_dir, sizeof(bench_dir), "/tmp/microbench.%d", getpid());
+	mkdir_if_need(bench_dir);
+	snprintf(ca_data, sizeof(ca_data), "%s/1-candidate-data.txt", bench_dir);
+	FILE* fp = fopen(ca_data, "w");
+	if (fp == NULL) {
+		die("fopen %s:", ca_data);
+	}
+	fputs("IBM-000123\njohndoe@email.com\nJohn Doe\n961234567\n", fp);
+	fclose(fp);
+}
+
+static void fs_teardown(void) {
+	unlink(ca_data);
+	rmdir(bench_dir);
+}
+
+static void bench_dir_exists(long iters) {
+	for (long i = 0; i < iters; i++) {
+		sink += dir_exists(bench_dir);
+	}
+}
+
+/* the common case in copy_all_files(): the directory is already there */
+static void bench_mkdir_if_need_exists(long iters) {
+	for (long i = 0; i < iters; i++) {
+		sink += mkdir_if_need(bench_dir);
+	}
+}
+
+static void bench_mkdir_if_need_create(long iters) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/new", bench_dir);
+	for (long i = 0; i < iters; i++) {
+		sink += mkdir_if_need(path);
+		rmdir(path);
+	}
+}
+
+static void bench_get_jobref_from_ca_data(long iters) {
+	char jobref[32];
+	for (long i = 0; i < iters; i++) {
+		sink += get_jobref_from_ca_data(jobref, sizeof(jobref), ca_data);
+	}
+}
+
+static const st_bench benches[] = {
+	{ "vec_push_pop",		vec_setup, bench_vec_push_pop,		NULL },
+	{ "vec_fifo_depth_16",		vec_fifo_setup_16, bench_vec_fifo,	vec_fifo_teardown },
+	{ "vec_fifo_depth_1024",	vec_fifo_setup_1024, bench_vec_fifo,	vec_fifo_teardown },
+	{ "vec_fifo_depth_65536",	vec_fifo_setup_65536, bench_vec_fifo,	vec_fifo_teardown },
+	{ "vec_create_grow_x10",	NULL, bench_vec_create_grow,		NULL },
+	{ "matches_regex_prefix",	NULL, bench_matches_regex_prefix,	NULL },
+	{ "matches_regex_suffix",	NULL, bench_matches_regex_suffix,	NULL },
+	{ "get_jobapl_from_filename",	NULL, bench_get_jobapl_from_filename,	NULL },
+	{ "dir_exists",			fs_setup, bench_dir_exists,		fs_teardown },
+	{ "mkdir_if_need_exists",	fs_setup, bench_mkdir_if_need_exists,	fs_teardown },
+	{ "mkdir_if_need_create",	fs_setup, bench_mkdir_if_need_create,	fs_teardown },
+	{ "get_jobref_from_ca_data",	fs_setup, bench_get_jobref_from_ca_data, fs_teardown },
+};
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int cmp_double(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* double the iterations until one run takes at least min_ns */
+static long calibrate(const st_bench* b, uint64_t min_ns) {
+	long iters = 1;
+	for (;;) {
+		uint64_t start = now_ns();
+		b->run(iters);
+		uint64_t elapsed = now_ns() - start;
+		if (elapsed >= min_ns || iters >= (1L << 40)) {
+			return iters;
+		}
+		/* jump close to the target, but never more than 100x at once */
+		long next = elapsed > 0 ? (long)(iters * 1.2 * min_ns / elapsed) : iters * 100;
+		iters = next > iters * 100 ? iters * 100 : (next > iters ? next : iters * 2);
+	}
+}
+
+int main(int argc, char** argv) {
+	int reps = 10;
+	int warmup = 2;
+	int min_ms = 50;
+	const char* filter = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "r:w:t:")) != -1) {
+		switch (opt) {
+		case 'r': reps = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 't': min_ms = atoi(optarg); break;
+		default:
+			die("Usage: %s [-r REPETITIONS] [-w WARMUP] [-t MIN_TIME_MS] [FILTER]",
+					argv[0]);
+		}
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+	if (reps < 1 || reps > MAX_REPS || warmup < 0 || min_ms < 1) {
+		die("%s: invalid arguments", argv[0]);
+	}
+
+	double ns[MAX_REPS], cyc[MAX_REPS];
+	int first = 1;
+
+	printf("{\n  \"repetitions\": %d,\n  \"warmup\": %d,\n  \"min_time_ms\": %d,\n"
+			"  \"benchmarks\": [", reps, warmup, min_ms);
+	for (size_t k = 0; k < NBENCHES; k++) {
+		const st_bench* b = &benches[k];
+		if (filter != NULL && strstr(b->name, filter) == NULL) {
+			continue;
+		}
+
+		if (b->setup != NULL) {
+			b->setup();
+		}
+		long iters = calibrate(b, (uint64_t)min_ms * 1000000);
+		for (int r = 0; r < warmup; r++) {
+			b->run(iters);
+		}
+		for (int r = 0; r < reps; r++) {
+			uint64_t c0 = cycles();
+			uint64_t t0 = now_ns();
+			b->run(iters);
+			uint64_t t1 = now_ns();
+			uint64_t c1 = cycles();
+			ns[r] = (double)(t1 - t0) / iters;
+			cyc[r] = (double)(c1 - c0) / iters;
+		}
+		if (b->teardown != NULL) {
+			b->teardown();
+		}
+
+		qsort(ns, reps, sizeof(double), cmp_double);
+		qsort(cyc, reps, sizeof(double), cmp_double);
+		printf("%s\n    {\"name\": \"%s\", \"iterations\": %ld, "
+				"\"ns_per_op\": {\"min\": %.3f, \"median\": %.3f, \"max\": %.3f}, "
+				"\"cycles_per_op\": {\"min\": %.1f, \"median\": %.1f, \"max\": %.1f}}",
+				first ? "" : ",", b->name, iters,
+				ns[0], ns[reps/2], ns[reps-1], cyc[0], cyc[reps/2], cyc[reps-1]);
+		fflush(stdout);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# PGO training run: drives an instrumented filebot with a representative
+# spool, then shuts it down with SIGINT so that every process (monitor,
+# parent and workers) exits normally and writes its profile.
+#
+# usage: bench/pgo-train.sh FILEBOT
+
+set -eu
+
+FILEBOT=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+BIN=$(cd "$(dirname "$0")/.." && pwd)
+NAPPS=0
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/filebot-pgo.XXXXXX")
+pid=
+trap '[ -n "$pid" ] && kill -INT $pid 2>/dev/null; wait; rm -rf "$dir"' EXIT
+mkdir "$dir/in" "$dir/out"
+cat > "$dir/filebot.conf" <<-EOF
+input_dir = $dir/in
+output_dir = $dir/out
+num_workers = 4
+interval_ms = 10
+stats_shm = /filebot-pgo-$$
+EOF
+
+(cd "$dir" && exec "$FILEBOT" filebot.conf) > "$dir/filebot.log" 2>&1 &
+pid=$!
+sleep 0.2
+
+# small text-only applications, typical attachments, a few large ones,
+# spread over several job references
+gen() {
+	n=$1
+	shift
+	"$BIN/emailbot-gen" -o "$dir/in" -f $((NAPPS + 1)) -n "$n" "$@"
+	NAPPS=$((NAPPS + n))
+}
+gen 2000 -m 2 -j IBM-000123,ACME-000001
+gen 2000 -m 5 -s 1024:65536 -r 2000 -j IBM-000123,ACME-000001,ISEP-000042
+gen 50 -m 3 -s 1048576:4194304 -j IBM-000124
+
+tries=0
+while [ $(( $(stat -c %s "$dir/out/completion.log" 2>/dev/null || echo 0) / 96 )) -lt $NAPPS ]; do
+	tries=$((tries + 1))
+	if [ $tries -gt 1200 ] || ! kill -0 $pid 2>/dev/null; then
+		echo "pgo-train: filebot did not publish all $NAPPS applications" >&2
+		exit 1
+	fi
+	sleep 0.05
+done
+
+kill -INT $pid
+wait $pid || true
+pid=
+echo "pgo-train: $NAPPS applications published"
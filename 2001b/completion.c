@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "completion.h"
+
+_Static_assert(sizeof(st_completion) == 96, "st_completion is an on-disk format");
+
+/**
+ * Open or create the log. A record cut short by a crash is dropped, the
+ * next sequence number follows the last complete record.
+ */
+st_completion_log* completion_log_open(const char* path, int shared) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd == -1) {
+		perror("completion_log_open: open");
+		return NULL;
+	}
+	if (shared && flock(fd, LOCK_EX) == -1) {
+		perror("completion_log_open: flock");
+		close(fd);
+		return NULL;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		perror("completion_log_open: fstat");
+		close(fd);
+		return NULL;
+	}
+	off_t whole = sb.st_size - sb.st_size % sizeof(st_completion);
+	if (whole != sb.st_size && ftruncate(fd, whole) == -1) {
+		perror("completion_log_open: ftruncate");
+		close(fd);
+		return NULL;
+	}
+	if (shared) {
+		flock(fd, LOCK_UN);
+	}
+
+	st_completion_log* log = (st_completion_log*)malloc(sizeof(st_completion_log));
+	if (log == NULL) {
+		perror("completion_log_open: malloc");
+		close(fd);
+		return NULL;
+	}
+	log->fd = fd;
+	log->shared = shared;
+	log->next_seq = whole / sizeof(st_completion) + 1;
+	return log;
+}
+
+/* one write() per record: O_APPEND keeps records whole and in order */
+int completion_log_append(st_completion_log* log, const char* jobref, int jobapl,
+		const st_manifest* m) {
+	if (log == NULL) {
+		return 0;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	st_completion rec = {0};
+	rec.seq = log->next_seq;
+	rec.published_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec.bytes = m->bytes;
+	rec.jobapl = jobapl;
+	rec.nfiles = m->nfiles;
+	snprintf(rec.jobref, sizeof(rec.jobref), "%s", jobref);
+
+	if (log->shared) {
+		struct stat sb;
+		if (flock(log->fd, LOCK_EX) == -1 || fstat(log->fd, &sb) == -1) {
+			perror("completion_log_append: flock");
+			return -1;
+		}
+		log->next_seq = sb.st_size / sizeof(st_completion) + 1;
+		rec.seq = log->next_seq;
+	}
+	int ret = write_full(log->fd, &rec, sizeof(rec));
+	if (log->shared) {
+		flock(log->fd, LOCK_UN);
+	}
+	if (ret == -1) {
+		perror("completion_log_append: write");
+		return -1;
+	}
+	log->next_seq++;
+	return 0;
+}
+
+void completion_log_close(st_completion_log* log) {
+	if (log != NULL) {
+		close(log->fd);
+		free(log);
+	}
+}
+
+int completion_read(int fd, uint64_t seq, st_completion* rec) {
+	off_t off = (off_t)(seq - 1) * sizeof(st_completion);
+	ssize_t n;
+	do {
+		n = pread(fd, rec, sizeof(*rec), off);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		return -1;
+	}
+	if ((size_t)n < sizeof(*rec) || rec->seq != seq) {
+		return 0;
+	}
+	rec->jobref[sizeof(rec->jobref) - 1] = '\0';
+	return 1;
+}
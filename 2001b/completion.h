@@ -0,0 +1,48 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+#define COMPLETION_FILE "completion.log"
+#define COMPLETION_JOBREF_MAX 64
+
+/**
+ * Completion log: one fixed size record per published application,
+ * appended by the parent right after the worker ack. Record n (from 1)
+ * lives at offset (n - 1) * sizeof(st_completion), so a consumer resumes
+ * from the last sequence number it imported and never walks output_dir.
+ *
+ * A record whose seq does not match its position is not complete yet:
+ * read it again after the next change of the file.
+ *
+ * Several filebot instances sharing a spool share the log too: opened
+ * `shared`, a writer appends under flock() and numbers its record from the
+ * size of the file rather than from its own count.
+ */
+typedef struct {
+	uint64_t seq;
+	uint64_t published_ns;	/* CLOCK_REALTIME */
+	uint64_t bytes;
+	int32_t jobapl;
+	uint32_t nfiles;
+	char jobref[COMPLETION_JOBREF_MAX];
+} st_completion;
+
+/* writer, owned by the parent */
+typedef struct {
+	int fd;
+	int shared;
+	uint64_t next_seq;
+} st_completion_log;
+
+st_completion_log* completion_log_open(const char* path, int shared);
+int completion_log_append(st_completion_log* log, const char* jobref, int jobapl,
+		const st_manifest* m);
+void completion_log_close(st_completion_log* log);
+
+/* reader: 1 if record seq was read, 0 if it is not there yet, -1 on error */
+int completion_read(int fd, uint64_t seq, st_completion* rec);
+
+#endif /* !COMPLETION_H */
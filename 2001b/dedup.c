@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "log.h"
+#include "util.h"
+
+#define DEDUP_CHUNK 65536	/* a whole number of 32 byte stripes */
+
+/* set before fork(), the same in every worker */
+static st_dedup dd = { .mode = DEDUP_NONE };
+static unsigned char chunk[2][DEDUP_CHUNK];
+
+/**
+ * XXH64: four independent 64 bit lanes over 32 byte stripes, so the
+ * multiplies of one stripe overlap in the pipeline and the loop runs at
+ * memory speed. Not meant to resist collisions, see st_dedup.
+ */
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+	uint64_t v[4];
+	uint64_t total;
+	uint64_t seed;
+} st_hash;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t lane(uint64_t acc, uint64_t in) {
+	return rotl(acc + in * P2, 31) * P1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t v) {
+	return (acc ^ lane(0, v)) * P1 + P4;
+}
+
+static void hash_init(st_hash* h, uint64_t seed) {
+	h->v[0] = seed + P1 + P2;
+	h->v[1] = seed + P2;
+	h->v[2] = seed;
+	h->v[3] = seed - P1;
+	h->total = 0;
+	h->seed = seed;
+}
+
+/* len a multiple of 32 */
+static void hash_stripes(st_hash* h, const unsigned char* p, size_t len) {
+	uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+	for (const unsigned char* end = p + len; p < end; p += 32) {
+		v0 = lane(v0, read64(p));
+		v1 = lane(v1, read64(p + 8));
+		v2 = lane(v2, read64(p + 16));
+		v3 = lane(v3, read64(p + 24));
+	}
+	h->v[0] = v0;
+	h->v[1] = v1;
+	h->v[2] = v2;
+	h->v[3] = v3;
+	h->total += len;
+}
+
+/* the last len < 32 bytes */
+static uint64_t hash_final(const st_hash* h, const unsigned char* p, size_t len) {
+	uint64_t total = h->total + len;
+	uint64_t acc;
+	if (h->total > 0) {
+		acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			acc = merge(acc, h->v[i]);
+		}
+	} else {
+		acc = h->seed + P5;
+	}
+	acc += total;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		acc = rotl(acc ^ lane(0, read64(p)), 27) * P1 + P4;
+	}
+	if (len >= 4) {
+		acc = rotl(acc ^ (uint64_t)read32(p) * P1, 23) * P2 + P3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; p++, len--) {
+		acc = rotl(acc ^ *p * P5, 11) * P1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= P2;
+	acc ^= acc >> 29;
+	acc *= P3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+/* up to count bytes, fewer only at the end of the file */
+static ssize_t read_chunk(int fd, unsigned char* buf, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = read(fd, buf + done, count - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* XXH64 with seed 0 of the rest of fd, read in DEDUP_CHUNK pieces */
+int dedup_hash_fd(int fd, uint64_t* hash) {
+	st_hash h;
+	hash_init(&h, 0);
+	for (;;) {
+		ssize_t n = read_chunk(fd, chunk[0], DEDUP_CHUNK);
+		if (n == -1) {
+			return -1;
+		}
+		size_t stripes = n & ~(size_t)31;
+		hash_stripes(&h, chunk[0], stripes);
+		if (n < DEDUP_CHUNK) {
+			*hash = hash_final(&h, chunk[0] + stripes, n - stripes);
+			return 0;
+		}
+	}
+}
+
+/* 1 if a and b hold the same bytes */
+static int same_content(int a, int b) {
+	if (lseek(a, 0, SEEK_SET) == -1 || lseek(b, 0, SEEK_SET) == -1) {
+		return 0;
+	}
+	for (;;) {
+		ssize_t n = read_chunk(a, chunk[0], DEDUP_CHUNK);
+		ssize_t m = read_chunk(b, chunk[1], DEDUP_CHUNK);
+		if (n == -1 || n != m || memcmp(chunk[0], chunk[1], n) != 0) {
+			return 0;
+		}
+		if (n < DEDUP_CHUNK) {
+			return 1;
+		}
+	}
+}
+
+void dedup_init(int mode, const char* dir, uint64_t min_bytes) {
+	dd.mode = mode;
+	dd.min_bytes = min_bytes;
+	snprintf(dd.dir, sizeof(dd.dir), "%s", dir);
+}
+
+/* name a clone of entry, or a link with dedup = hardlink */
+static int dedup_copy(const char* entry, int efd, int dirfd, const char* tmp, mode_t mode) {
+	if (dd.mode == DEDUP_HARDLINK) {
+		return linkat(AT_FDCWD, entry, dirfd, tmp, 0);
+	}
+
+	int fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (fd == -1) {
+		return -1;
+	}
+	if (ioctl(fd, FICLONE, efd) == -1 || fchmod(fd, mode) == -1) {
+		int err = errno;
+		close(fd);
+		unlinkat(dirfd, tmp, 0);
+		errno = err;
+		return -1;
+	}
+	return close(fd);
+}
+
+/**
+ * Replace the file name of dirfd by a link, or a clone, of the indexed file
+ * with the same content; a file that is not indexed yet becomes the entry
+ * of its content. Returns 1 if the file was replaced, 0 if not, -1 on an
+ * error: the file is then left as it was.
+ */
+int dedup_file(int dirfd, const char* name) {
+	if (dd.mode == DEDUP_NONE) {
+		return 0;
+	}
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		log_perror("dedup_file: open");
+		return -1;
+	}
+	struct stat sb;
+	uint64_t hash;
+	/* several links: the entry itself, or a file already replaced */
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_nlink > 1
+			|| (uint64_t)sb.st_size < dd.min_bytes) {
+		close(fd);
+		return 0;
+	}
+	if (dedup_hash_fd(fd, &hash) == -1) {
+		log_perror("dedup_file: read");
+		close(fd);
+		return -1;
+	}
+
+	char shard[sizeof(dd.dir) + 4];
+	char entry[sizeof(shard) + 48];
+	snprintf(shard, sizeof(shard), "%s/%02x", dd.dir, (unsigned)(hash >> 56));
+	snprintf(entry, sizeof(entry), "%s/%016lx-%lu", shard, hash, (uint64_t)sb.st_size);
+	int linked = linkat(dirfd, name, AT_FDCWD, entry, 0);
+	if (linked == -1 && errno == ENOENT && mkdir_if_need(shard) == 0) {
+		linked = linkat(dirfd, name, AT_FDCWD, entry, 0);
+	}
+	if (linked == 0 || errno != EEXIST) {
+		/* the first with this content, or the file cannot be indexed */
+		if (linked == -1) {
+			log_perror("dedup_file: link");
+		}
+		close(fd);
+		return linked;
+	}
+
+	int ret = 0;
+	int efd = open(entry, O_RDONLY | O_CLOEXEC);
+	struct stat eb;
+	if (efd == -1 || fstat(efd, &eb) == -1) {
+		/* the entry was pruned meanwhile */
+		ret = 0;
+	} else if (eb.st_size != sb.st_size || !same_content(fd, efd)) {
+		log_msg(LL_DEBUG, "dedup_file: %s: same hash as %s, other content", name, entry);
+	} else {
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), ".dedup-%d", getpid());
+		if (dedup_copy(entry, efd, dirfd, tmp, sb.st_mode & 07777) == -1) {
+			if (dd.mode == DEDUP_HARDLINK && errno == EMLINK) {
+				/* the entry has all the links it may: this copy takes over */
+				char next[sizeof(entry) + 16];
+				snprintf(next, sizeof(next), "%s.%d", entry, getpid());
+				if (linkat(dirfd, name, AT_FDCWD, next, 0) == 0 && rename(next, entry) == -1) {
+					unlink(next);
+				}
+			} else if (dd.mode == DEDUP_REFLINK && (errno == EOPNOTSUPP
+					|| errno == EXDEV || errno == EINVAL)) {
+				log_msg(LL_WARN, "dedup_file: %s does not support reflinks, "
+						"dedup disabled", dd.dir);
+				dd.mode = DEDUP_NONE;
+			} else {
+				log_perror("dedup_file: link");
+				ret = -1;
+			}
+		} else if (renameat(dirfd, tmp, dirfd, name) == -1) {
+			log_perror("dedup_file: rename");
+			unlinkat(dirfd, tmp, 0);
+			ret = -1;
+		} else {
+			ret = 1;
+		}
+	}
+	if (efd != -1) {
+		close(efd);
+	}
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#define DEDUP_DIR ".dedup"	/* in output_dir */
+#define DEDUP_MIN_KB_DEFAULT 16
+
+/* what a file whose content was published before becomes */
+enum dedup_mode {
+	DEDUP_NONE = 0,
+	DEDUP_HARDLINK,		/* another name of the first copy */
+	DEDUP_REFLINK,		/* a copy-on-write clone of it, FICLONE */
+};
+
+/**
+ * Content index of the published files: <dir>/<xx>/<hash>-<size>, a hard
+ * link to the first file published with that content, xx the first byte
+ * of the hash. Being a name in the output filesystem, it is shared by the
+ * workers and by instances on the same output_dir, and outlives restarts.
+ * A file is linked to an entry only if their bytes are equal: the hash is
+ * not trusted against a crafted attachment.
+ */
+typedef struct {
+	int mode;		/* enum dedup_mode */
+	uint64_t min_bytes;	/* smaller files are left alone */
+	char dir[1024];
+} st_dedup;
+
+void dedup_init(int mode, const char* dir, uint64_t min_bytes);
+int dedup_file(int dirfd, const char* name);
+int dedup_hash_fd(int fd, uint64_t* hash);
+
+#endif /* !DEDUP_H */
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "index.h"
+#include "util.h"
+
+/**
+ * filebot-index: query the binary report index
+ *
+ * filebot-index INDEX			job references and their application count
+ * filebot-index INDEX JOBREF		applications of JOBREF and their files
+ * filebot-index INDEX JOBREF JOBAPL	one application
+ */
+
+static void print_app(const st_index* ix, const char* jobref, const st_index_app* app) {
+	char rel[512];
+	app_relpath(rel, sizeof(rel), jobref, app->jobapl, (int)ix->hdr->fanout);
+	printf("%s (%u files, %lu bytes)\n", rel, app->nfiles, app->bytes);
+	for (uint32_t f = app->first_file; f < app->first_file + app->nfiles; f++) {
+		printf("    %s %lu\n", index_str(ix, ix->files[f].name), ix->files[f].size);
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 4) {
+		die("Usage: %s INDEX [JOBREF [JOBAPL]]", argv[0]);
+	}
+
+	st_index* ix = index_open(argv[1]);
+	if (ix == NULL) {
+		die("%s: %s: not a filebot report index", argv[0], argv[1]);
+	}
+
+	if (argc == 2) {
+		for (uint32_t j = 0; j < ix->hdr->njobrefs; j++) {
+			const st_index_jobref* jr = &ix->jobrefs[j];
+			uint64_t bytes = 0;
+			for (uint32_t a = jr->first_app; a < jr->first_app + jr->napps; a++) {
+				bytes += ix->apps[a].bytes;
+			}
+			printf("%s %u applications %lu bytes\n", index_str(ix, jr->name),
+					jr->napps, bytes);
+		}
+		index_close(ix);
+		return 0;
+	}
+
+	const st_index_jobref* jr = index_find(ix, argv[2]);
+	if (jr == NULL) {
+		index_close(ix);
+		die("%s: %s: job reference not found", argv[0], argv[2]);
+	}
+
+	if (argc == 3) {
+		for (uint32_t a = jr->first_app; a < jr->first_app + jr->napps; a++) {
+			print_app(ix, argv[2], &ix->apps[a]);
+		}
+	} else {
+		const st_index_app* app = index_find_app(ix, jr, atoi(argv[3]));
+		if (app == NULL) {
+			index_close(ix);
+			die("%s: %s/Application_%s: not found", argv[0], argv[2], argv[3]);
+		}
+		print_app(ix, argv[2], app);
+	}
+
+	index_close(ix);
+	return 0;
+}
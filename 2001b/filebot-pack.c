@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "util.h"
+
+/**
+ * filebot-pack: read the pack files of output_format = pack
+ *
+ * filebot-pack PACK			applications and their files
+ * filebot-pack PACK JOBAPL...		only these
+ * filebot-pack -x [-C DIR] PACK [JOBAPL...]
+ *					extract as DIR/JOBREF/Application_N
+ * filebot-pack -c PACK JOBAPL NAME	write one file to stdout
+ *
+ * An application delivered again is in the pack once per delivery, each
+ * listed with its time. Extraction writes them oldest first, as filebot
+ * merges them with output_format = dir: the last copy of a file wins.
+ * The data is written from the mapping, it is never copied in between.
+ */
+
+#define USAGE "Usage: %s [-x [-C DIR] | -c] PACK [JOBAPL...]"
+
+static int selected(int jobapl, char** jobapls, int n) {
+	for (int i = 0; i < n; i++) {
+		if (atoi(jobapls[i]) == jobapl) {
+			return 1;
+		}
+	}
+	return n == 0;
+}
+
+static void print_app(const st_pack* p, const char* jobref, const st_pack_footer* app) {
+	char when[32];
+	time_t t = app->published_ns / 1000000000;
+	struct tm tm;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+	printf("%s/Application_%d (%u files, %lu bytes) %s\n", jobref, app->jobapl,
+			app->nfiles, app->bytes, when);
+	const st_pack_entry* e = pack_entries(p, app);
+	for (uint32_t i = 0; i < app->nfiles; i++) {
+		printf("    %s %lu\n", pack_name(p, app, &e[i]), e[i].size);
+	}
+}
+
+/* a name from the pack must not leave the application directory */
+static int safe_name(const char* name) {
+	return name[0] != '\0' && strchr(name, '/') == NULL
+			&& strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static int extract_app(const st_pack* p, const char* dir, const char* jobref,
+		const st_pack_footer* app) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, jobref);
+	if (mkdir_if_need(path) == -1) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s/Application_%d", dir, jobref, app->jobapl);
+	if (mkdir_if_need(path) == -1) {
+		return -1;
+	}
+	int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1) {
+		perror("extract: open");
+		return -1;
+	}
+
+	int ret = 0;
+	const st_pack_entry* e = pack_entries(p, app);
+	for (uint32_t i = 0; i < app->nfiles; i++) {
+		const char* name = pack_name(p, app, &e[i]);
+		if (!safe_name(name)) {
+			fprintf(stderr, "extract: %s/Application_%d: '%s' skipped\n",
+					jobref, app->jobapl, name);
+			continue;
+		}
+		int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1 || write_full(fd, pack_data(p, &e[i]), e[i].size) == -1) {
+			perror("extract: write");
+			ret = -1;
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	close(dirfd);
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	int extract = 0;
+	int cat = 0;
+	const char* dir = ".";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "xcC:")) != -1) {
+		switch (opt) {
+		case 'x':
+			extract = 1;
+			break;
+		case 'c':
+			cat = 1;
+			break;
+		case 'C':
+			dir = optarg;
+			break;
+		default:
+			die(USAGE, argv[0]);
+		}
+	}
+	if (optind >= argc || (extract && cat) || (cat && argc - optind != 3)) {
+		die(USAGE, argv[0]);
+	}
+	const char* path = argv[optind];
+	char** jobapls = argv + optind + 1;
+	int n = argc - optind - 1;
+
+	st_pack* p = pack_open(path);
+	if (p == NULL) {
+		die("%s: %s: not a filebot pack", argv[0], path);
+	}
+
+	/* output_dir/JOBREF.pack */
+	char jobref[256];
+	char base[4096];
+	snprintf(base, sizeof(base), "%s", path);
+	snprintf(jobref, sizeof(jobref), "%s", basename(base));
+	char* suffix = strstr(jobref, PACK_SUFFIX);
+	if (suffix != NULL && suffix[strlen(PACK_SUFFIX)] == '\0') {
+		*suffix = '\0';
+	}
+
+	int ret = 0;
+	if (cat) {
+		/* the last copy of the file */
+		int jobapl = atoi(jobapls[0]);
+		for (size_t a = p->napps; a > 0 && ret == 0; a--) {
+			const st_pack_footer* app = p->apps[a - 1];
+			const st_pack_entry* e = pack_entries(p, app);
+			for (uint32_t i = 0; app->jobapl == jobapl && i < app->nfiles; i++) {
+				if (strcmp(pack_name(p, app, &e[i]), jobapls[1]) == 0) {
+					ret = write_full(STDOUT_FILENO, pack_data(p, &e[i]), e[i].size)
+							== -1 ? -1 : 1;
+					break;
+				}
+			}
+		}
+		if (ret == 0) {
+			pack_close(p);
+			die("%s: %s/Application_%s/%s: not found", argv[0], jobref,
+					jobapls[0], jobapls[1]);
+		}
+		pack_close(p);
+		return ret == 1 ? 0 : 1;
+	}
+
+	if (extract && mkdir_if_need(dir) == -1) {
+		pack_close(p);
+		die("%s: %s: cannot create", argv[0], dir);
+	}
+
+	int found = 0;
+	for (size_t a = 0; a < p->napps; a++) {
+		const st_pack_footer* app = p->apps[a];
+		if (!selected(app->jobapl, jobapls, n)) {
+			continue;
+		}
+		found++;
+		if (!extract) {
+			print_app(p, jobref, app);
+		} else if (extract_app(p, dir, jobref, app) == -1) {
+			ret = 1;
+		}
+	}
+	pack_close(p);
+	if (n > 0 && found == 0) {
+		die("%s: %s: no such application", argv[0], path);
+	}
+	return ret;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "util.h"
+
+/**
+ * filebot-stat: live view of the filebot statistics segment
+ *
+ * Maps the segment read-only and prints per-worker rates every interval,
+ * the daemon is never stopped or signalled.
+ */
+
+static double per_s(uint64_t delta, uint64_t dt_ns) {
+	return dt_ns == 0 ? 0.0 : (double)delta * 1e9 / (double)dt_ns;
+}
+
+static void print_snapshot(const st_stats* st, int n, const st_worker_stats* prev,
+		const st_worker_stats* cur, uint64_t dt_ns) {
+	const st_parent_stats* p = &st->parent;
+
+	printf("filebot pid %d, up %.1fs | queue %lu | in-flight %lu | "
+			"enqueued %lu | intake %.2f apl/s | overflows %lu\n",
+			st->pid, (now_ns() - st->start_ns) / 1e9,
+			STAT_GET(p->queue_depth), STAT_GET(p->in_flight),
+			STAT_GET(p->apps_enqueued),
+			STAT_GET(p->intake_rate_milli) / 1000.0,
+			STAT_GET(p->inotify_overflows));
+	printf("%6s %10s %10s %10s %8s %8s %8s %8s %6s %6s %6s %8s\n", "worker", "apl/s",
+			"files/s", "MB/s", "apls", "fail", "retry", "skip", "busy%", "thr%", "repl",
+			"dedupMB");
+
+	uint64_t apps = 0, files = 0, bytes = 0;
+	for (int i = 0; i < n; i++) {
+		uint64_t busy = cur[i].busy_ns - prev[i].busy_ns;
+		uint64_t throttled = cur[i].throttled_ns - prev[i].throttled_ns;
+		printf("%6d %10.2f %10.2f %10.2f %8lu %8lu %8lu %8lu %5.1f%% %5.1f%% %6lu %8.1f\n", i,
+				per_s(cur[i].apps_moved - prev[i].apps_moved, dt_ns),
+				per_s(cur[i].files_moved - prev[i].files_moved, dt_ns),
+				per_s(cur[i].bytes_moved - prev[i].bytes_moved, dt_ns) / 1e6,
+				cur[i].apps_moved, cur[i].failures, cur[i].retries, cur[i].skipped,
+				dt_ns == 0 ? 0.0 : 100.0 * busy / dt_ns,
+				dt_ns == 0 ? 0.0 : 100.0 * throttled / dt_ns, cur[i].replaced,
+				cur[i].dedup_bytes / 1e6);
+		apps += cur[i].apps_moved - prev[i].apps_moved;
+		files += cur[i].files_moved - prev[i].files_moved;
+		bytes += cur[i].bytes_moved - prev[i].bytes_moved;
+	}
+	printf("%6s %10.2f %10.2f %10.2f\n\n", "total", per_s(apps, dt_ns),
+			per_s(files, dt_ns), per_s(bytes, dt_ns) / 1e6);
+	fflush(stdout);
+}
+
+/**
+ * every slot, so that a worker added by a reload has its delta from the
+ * last sample; returns the number of workers running now
+ */
+static int snapshot(const st_stats* st, st_worker_stats* out) {
+	for (int i = 0; i < st->max_workers; i++) {
+		const st_worker_stats* w = &st->workers[i];
+		out[i].apps_moved = STAT_GET(w->apps_moved);
+		out[i].files_moved = STAT_GET(w->files_moved);
+		out[i].bytes_moved = STAT_GET(w->bytes_moved);
+		out[i].failures = STAT_GET(w->failures);
+		out[i].retries = STAT_GET(w->retries);
+		out[i].skipped = STAT_GET(w->skipped);
+		out[i].busy_ns = STAT_GET(w->busy_ns);
+		out[i].throttled_ns = STAT_GET(w->throttled_ns);
+		out[i].replaced = STAT_GET(w->replaced);
+		out[i].dedup_files = STAT_GET(w->dedup_files);
+		out[i].dedup_bytes = STAT_GET(w->dedup_bytes);
+	}
+	return STAT_GET(st->num_workers);
+}
+
+int main(int argc, char** argv) {
+	const char* name = STATS_SHM_DEFAULT;
+	int interval_ms = 1000;
+	int count = 0; /* 0: run until interrupted */
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			die("Usage: %s [-i INTERVAL_MS] [-n COUNT] [SHM_NAME]", argv[0]);
+		}
+	}
+	if (optind < argc) {
+		name = argv[optind];
+	}
+	if (interval_ms <= 0) {
+		die("%s: interval must be > 0", argv[0]);
+	}
+
+	st_stats* st = stats_open(name);
+	if (st == NULL) {
+		die("%s: cannot open statistics segment %s (is filebot running?)",
+				argv[0], name);
+	}
+
+	size_t size = st->max_workers * sizeof(st_worker_stats);
+	st_worker_stats* prev = aligned_alloc(CACHE_LINE, size);
+	st_worker_stats* cur = aligned_alloc(CACHE_LINE, size);
+	if (prev == NULL || cur == NULL) {
+		die("aligned_alloc:");
+	}
+
+	/* first sample is a delta since the daemon started */
+	memset(prev, 0, size);
+	uint64_t t_prev = st->start_ns;
+	for (int n = 0; count == 0 || n < count; n++) {
+		if (n > 0) {
+			usleep(interval_ms * 1000);
+		}
+		uint64_t t_cur = now_ns();
+		int nworkers = snapshot(st, cur);
+		print_snapshot(st, nworkers, prev, cur, t_cur - t_prev);
+
+		st_worker_stats* tmp = prev;
+		prev = cur;
+		cur = tmp;
+		t_prev = t_cur;
+	}
+
+	free(prev);
+	free(cur);
+	stats_close(st);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "completion.h"
+#include "util.h"
+
+/**
+ * filebot-tail: print the completion log from a sequence number
+ *
+ * One line per published application:
+ *
+ * SEQ PUBLISHED_NS JOBREF/Application_N NFILES BYTES
+ *
+ * The path is relative to output_dir; give -F the output_fanout of filebot
+ * to get JOBREF/00/17/Application_1700, or -p with output_format = pack to
+ * get JOBREF.pack:Application_1700.
+ *
+ * With -f it keeps following the log, woken by inotify when filebot
+ * appends, so an importer resumes with -s LAST_SEQ+1 and never scans
+ * output_dir.
+ */
+
+int main(int argc, char** argv) {
+	uint64_t seq = 1;
+	int follow = 0;
+	int fanout = 0;
+	int pack = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "fF:ps:")) != -1) {
+		switch (opt) {
+		case 'f':
+			follow = 1;
+			break;
+		case 'F':
+			fanout = atoi(optarg);
+			break;
+		case 'p':
+			pack = 1;
+			break;
+		case 's':
+			seq = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			die("Usage: %s [-f] [-F FANOUT | -p] [-s SEQ] LOG", argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		die("Usage: %s [-f] [-F FANOUT | -p] [-s SEQ] LOG", argv[0]);
+	}
+	if (fanout < 0 || fanout > OUTPUT_FANOUT_MAX) {
+		die("%s: fanout must be 0 to %d", argv[0], OUTPUT_FANOUT_MAX);
+	}
+	if (pack && fanout != 0) {
+		die("%s: packs have no fanout", argv[0]);
+	}
+	if (pack) {
+		fanout = OUTPUT_FANOUT_PACK;
+	}
+	if (seq == 0) {
+		die("%s: sequence numbers start at 1", argv[0]);
+	}
+	const char* path = argv[optind];
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		die("%s: open %s:", argv[0], path);
+	}
+
+	int in_fd = -1;
+	if (follow) {
+		/* watch before the first read, so no append is missed in between */
+		in_fd = inotify_init();
+		if (in_fd == -1 || inotify_add_watch(in_fd, path, IN_MODIFY) == -1) {
+			die("%s: inotify:", argv[0]);
+		}
+	}
+
+	st_completion rec;
+	char events[4096];
+	char rel[512];
+	for (;;) {
+		int ret;
+		while ((ret = completion_read(fd, seq, &rec)) == 1) {
+			app_relpath(rel, sizeof(rel), rec.jobref, rec.jobapl, fanout);
+			printf("%lu %lu %s %u %lu\n", rec.seq, rec.published_ns, rel,
+					rec.nfiles, rec.bytes);
+			seq++;
+		}
+		if (ret == -1) {
+			die("%s: read %s:", argv[0], path);
+		}
+		if (!follow) {
+			break;
+		}
+		fflush(stdout);
+
+		if (read(in_fd, events, sizeof(events)) == -1 && errno != EINTR) {
+			die("%s: inotify read:", argv[0]);
+		}
+	}
+
+	close(fd);
+	return 0;
+}
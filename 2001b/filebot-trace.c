@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+/**
+ * filebot-trace: offline converter for the per-process trace buffers
+ *
+ * filebot-trace [-o trace.json] TRACEFILE...
+ *
+ * Writes a Chrome trace (chrome://tracing, ui.perfetto.dev) and prints the
+ * latency of every pipeline stage, per application, with p50/p99.
+ */
+
+/* earliest of land, detect and enqueue: the monitor may read an event late */
+#define ARRIVAL -1
+
+/* pipeline stages measured between two trace points of one application */
+static const struct {
+	const char* name;
+	int from;
+	int to;
+} intervals[] = {
+	{ "land->detect",	TR_LAND,	TR_DETECT },
+	{ "detect->enqueue",	TR_DETECT,	TR_ENQUEUE },
+	{ "enqueue->dispatch",	TR_ENQUEUE,	TR_DISPATCH },
+	{ "dispatch->move",	TR_DISPATCH,	TR_MOVE_START },
+	{ "move",		TR_MOVE_START,	TR_MOVE_END },
+	{ "move->ack",		TR_MOVE_END,	TR_ACK },
+	{ "detect->ack",	TR_DETECT,	TR_ACK },
+	{ "land->ack",		TR_LAND,	TR_ACK },
+	{ "arrival->ack",	ARRIVAL,	TR_ACK },
+	{ "ack->publish",	TR_ACK,		TR_PUBLISH },
+	{ "arrival->publish",	ARRIVAL,	TR_PUBLISH },
+};
+#define NINTERVALS (sizeof(intervals) / sizeof(intervals[0]))
+
+/* timestamps of one application, 0 if the trace point was not seen */
+typedef struct {
+	int jobapl;
+	char jobref[TRACE_JOBREF_MAX];	/* as in the events, not null terminated if full */
+	uint64_t ts[TR_NSTAGES];
+} st_app;
+
+typedef struct {
+	st_app* slots;
+	size_t capacity;
+	size_t size;
+} st_apps;
+
+/* FNV-1a of the job reference, mixed with the application number */
+static size_t app_hash(const char* jobref, int jobapl) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < TRACE_JOBREF_MAX && jobref[i] != '\0'; i++) {
+		h = (h ^ (unsigned char)jobref[i]) * 1099511628211ULL;
+	}
+	return (size_t)((h ^ (uint64_t)jobapl) * 2654435761u);
+}
+
+/* applications are keyed by job reference and number */
+static st_app* apps_get(st_apps* apps, const char* jobref, int jobapl) {
+	if (apps->size * 2 >= apps->capacity) {
+		st_apps grown = { NULL, apps->capacity ? apps->capacity * 2 : 1024, 0 };
+		grown.slots = calloc(grown.capacity, sizeof(st_app));
+		if (grown.slots == NULL) {
+			die("calloc:");
+		}
+		for (size_t i = 0; i < apps->capacity; i++) {
+			if (apps->slots[i].jobapl != 0) {
+				*apps_get(&grown, apps->slots[i].jobref, apps->slots[i].jobapl)
+						= apps->slots[i];
+			}
+		}
+		free(apps->slots);
+		*apps = grown;
+	}
+
+	size_t mask = apps->capacity - 1;
+	size_t i = app_hash(jobref, jobapl) & mask;
+	while (apps->slots[i].jobapl != 0 && (apps->slots[i].jobapl != jobapl
+			|| strncmp(apps->slots[i].jobref, jobref, TRACE_JOBREF_MAX) != 0)) {
+		i = (i + 1) & mask;
+	}
+	if (apps->slots[i].jobapl == 0) {
+		apps->slots[i].jobapl = jobapl;
+		memcpy(apps->slots[i].jobref, jobref, TRACE_JOBREF_MAX);
+		apps->size++;
+	}
+	return &apps->slots[i];
+}
+
+/**
+ * Keep the first arrival of an application but the last attempt to
+ * move it, so that a retried job reports the attempt that succeeded.
+ */
+static void apps_record(st_apps* apps, const st_trace_event* ev) {
+	if (ev->jobapl <= 0) {
+		return;
+	}
+	st_app* app = apps_get(apps, ev->jobref, ev->jobapl);
+	uint64_t* ts = &app->ts[ev->stage];
+	if (ev->stage >= TR_DISPATCH || *ts == 0) {
+		*ts = ev->ts_ns;
+	}
+}
+
+static uint64_t app_ts(const st_app* app, int stage) {
+	if (stage != ARRIVAL) {
+		return app->ts[stage];
+	}
+	uint64_t ts = 0;
+	int stages[] = { TR_LAND, TR_DETECT, TR_ENQUEUE };
+	for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+		uint64_t t = app->ts[stages[i]];
+		if (t != 0 && (ts == 0 || t < ts)) {
+			ts = t;
+		}
+	}
+	return ts;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t* sorted, size_t n, double p) {
+	size_t i = (size_t)(p * (n - 1) + 0.5);
+	return sorted[i] / 1e3;
+}
+
+static void print_latencies(const st_apps* apps) {
+	uint64_t* values = malloc(apps->size * sizeof(uint64_t));
+	if (values == NULL && apps->size > 0) {
+		die("malloc:");
+	}
+
+	printf("%-18s %8s %12s %12s %12s\n", "stage", "count", "p50 (us)",
+			"p99 (us)", "max (us)");
+	for (size_t k = 0; k < NINTERVALS; k++) {
+		size_t n = 0;
+		for (size_t i = 0; i < apps->capacity; i++) {
+			const st_app* app = &apps->slots[i];
+			uint64_t from = app_ts(app, intervals[k].from);
+			uint64_t to = app_ts(app, intervals[k].to);
+			if (app->jobapl != 0 && from != 0 && to >= from) {
+				values[n++] = to - from;
+			}
+		}
+		if (n == 0) {
+			printf("%-18s %8d %12s %12s %12s\n", intervals[k].name, 0,
+					"-", "-", "-");
+			continue;
+		}
+		qsort(values, n, sizeof(uint64_t), cmp_u64);
+		printf("%-18s %8zu %12.1f %12.1f %12.1f\n", intervals[k].name, n,
+				percentile_us(values, n, 0.50), percentile_us(values, n, 0.99),
+				values[n-1] / 1e3);
+
+		/* log2 histogram, one row per power of two microseconds */
+		size_t b = 0;
+		while (b < n) {
+			uint64_t us = values[b] / 1000;
+			int bucket = 0;
+			while ((1ULL << bucket) <= us) {
+				bucket++;
+			}
+			size_t count = 0;
+			while (b < n && values[b] / 1000 < (1ULL << bucket)) {
+				count++;
+				b++;
+			}
+			printf("    < %-10llu us %8zu  ", 1ULL << bucket, count);
+			for (size_t c = 0; c < (count * 40 + n - 1) / n; c++) {
+				putchar('#');
+			}
+			putchar('\n');
+		}
+	}
+
+	free(values);
+}
+
+/* a JSON string: the job reference comes from the spool, it may hold anything */
+static void json_str(FILE* out, const char* s, size_t max) {
+	putc('"', out);
+	for (size_t i = 0; i < max && s[i] != '\0'; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			putc(c, out);
+		}
+	}
+	putc('"', out);
+}
+
+static void json_jobref(FILE* out, const st_trace_event* ev) {
+	/* jobref is not null terminated when it fills the field */
+	json_str(out, ev->jobref, sizeof(ev->jobref));
+}
+
+/* emit the events of one process, begin/end pairs become complete events */
+static void write_chrome_events(FILE* out, const st_trace* tr, int* first) {
+	uint64_t head = tr->head;
+	uint64_t start = head > tr->capacity ? head - tr->capacity : 0;
+	uint64_t scan_begin = 0, move_begin = 0;
+
+	fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"%s %d\"}}", *first ? "" : ",\n",
+			tr->pid, tr->role, tr->pid);
+	*first = 0;
+
+	for (uint64_t n = start; n < head; n++) {
+		const st_trace_event* ev = &tr->events[n % tr->capacity];
+		double ts = ev->ts_ns / 1e3;
+
+		switch (ev->stage) {
+		case TR_SCAN_BEGIN:
+			scan_begin = ev->ts_ns;
+			continue;
+		case TR_MOVE_START:
+			move_begin = ev->ts_ns;
+			continue;
+		case TR_SCAN_END:
+			if (scan_begin != 0) {
+				fprintf(out, ",\n{\"name\":\"scan_dir\",\"ph\":\"X\",\"pid\":%d,"
+						"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", tr->pid, tr->pid,
+						scan_begin / 1e3, (ev->ts_ns - scan_begin) / 1e3);
+			}
+			scan_begin = 0;
+			continue;
+		case TR_MOVE_END:
+			if (move_begin != 0) {
+				fprintf(out, ",\n{\"name\":\"copy_all_files\",\"ph\":\"X\","
+						"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+						"\"args\":{\"jobref\":", tr->pid, tr->pid,
+						move_begin / 1e3, (ev->ts_ns - move_begin) / 1e3);
+				json_jobref(out, ev);
+				fprintf(out, ",\"jobapl\":%d,\"failed\":%d}}", ev->jobapl,
+						ev->flags);
+			}
+			move_begin = 0;
+			continue;
+		}
+
+		if (ev->stage >= TR_NSTAGES) {
+			continue;
+		}
+		fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,"
+				"\"tid\":%d,\"ts\":%.3f,\"args\":{\"jobref\":",
+				trace_stage_names[ev->stage], tr->pid, tr->pid, ts);
+		json_jobref(out, ev);
+		fprintf(out, ",\"jobapl\":%d}}", ev->jobapl);
+	}
+}
+
+/* one async slice per application, from its arrival to the ack */
+static void write_chrome_apps(FILE* out, const st_apps* apps) {
+	for (size_t i = 0; i < apps->capacity; i++) {
+		const st_app* app = &apps->slots[i];
+		uint64_t begin = app_ts(app, ARRIVAL);
+		if (app->jobapl == 0 || begin == 0 || app->ts[TR_ACK] < begin) {
+			continue;
+		}
+		/* the slot tells apart the same number under two job references */
+		for (int ph = 0; ph < 2; ph++) {
+			fprintf(out, ",\n{\"name\":\"Application_%d\",\"cat\":\"application\","
+					"\"ph\":\"%c\",\"id\":%zu,\"pid\":0,\"tid\":0,\"ts\":%.3f,"
+					"\"args\":{\"jobref\":", app->jobapl, ph == 0 ? 'b' : 'e', i,
+					(ph == 0 ? begin : app->ts[TR_ACK]) / 1e3);
+			json_str(out, app->jobref, sizeof(app->jobref));
+			fprintf(out, "}}");
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* json_path = "trace.json";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			json_path = optarg;
+			break;
+		default:
+			die("Usage: %s [-o TRACE_JSON] TRACEFILE...", argv[0]);
+		}
+	}
+	if (optind >= argc) {
+		die("Usage: %s [-o TRACE_JSON] TRACEFILE...", argv[0]);
+	}
+
+	FILE* out = fopen(json_path, "w");
+	if (out == NULL) {
+		die("fopen %s:", json_path);
+	}
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	st_apps apps = { NULL, 0, 0 };
+	int first = 1;
+	for (int i = optind; i < argc; i++) {
+		size_t size;
+		st_trace* tr = trace_map(argv[i], &size);
+		if (tr == NULL) {
+			fprintf(stderr, "%s: %s: not a filebot trace file\n", argv[0], argv[i]);
+			continue;
+		}
+
+		uint64_t head = tr->head;
+		if (head > tr->capacity) {
+			fprintf(stderr, "%s: %s: ring buffer wrapped, %lu oldest events lost\n",
+					argv[0], argv[i], head - tr->capacity);
+		}
+		uint64_t start = head > tr->capacity ? head - tr->capacity : 0;
+		for (uint64_t n = start; n < head; n++) {
+			const st_trace_event* ev = &tr->events[n % tr->capacity];
+			if (ev->stage < TR_NSTAGES) {
+				apps_record(&apps, ev);
+			}
+		}
+
+		write_chrome_events(out, tr, &first);
+		munmap(tr, size);
+	}
+
+	write_chrome_apps(out, &apps);
+	fprintf(out, "\n]}\n");
+	fclose(out);
+
+	printf("%zu applications, chrome trace written to %s\n\n", apps.size, json_path);
+	print_latencies(&apps);
+
+	free(apps.slots);
+	return 0;
+}
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <linux/limits.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -7,27 +9,121 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "dedup.h"
+#include "pack.h"
+#include "lease.h"
+#include "log.h"
+#include "prio.h"
+#include "ratelimit.h"
+#include "report.h"
+#include "sched.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 #define BUFMAX 512
+#define INOTIFY_BUFSIZE (256 * 1024)
+
+/* values read from the configuration file */
+typedef struct {
+	char input_dirs[INPUT_DIRS_MAX][BUFMAX];	/* the spool roots */
+	int num_input_dirs;
+	int input_recursive;	/* also the subdirectories of the roots */
+	int input_monitor;	/* enum input_monitor */
+	int poll_max_ms;	/* input_monitor = poll: longest interval */
+	char output_dir[BUFMAX];
+	int num_workers;
+	int max_workers;	/* num_workers may grow to this on a reload */
+	int interval_ms;
+	char stats_shm[NAME_MAX];
+	char trace_dir[BUFMAX];	/* empty: tracing disabled */
+	int trace_events;	/* ring buffer capacity per process */
+	int report_index_ms;	/* 0: no binary report index */
+	int durability;		/* enum durability */
+	int durability_batch_apps;
+	int durability_batch_ms;
+	int input_layout;	/* enum input_layout */
+	int output_fanout;	/* levels between jobref and Application_N */
+	int output_format;	/* enum output_format */
+	int sched_policy;	/* enum sched_policy */
+	double sched_aging;	/* MB/s, SCHED_SJF */
+	char fair_share[BUFMAX];	/* weights per jobref prefix, "IBM:4,*:1" */
+	st_rates io;		/* limits of the workers, 0: unlimited */
+	char instance[128];	/* empty: the only filebot on the spool */
+	char lease_dir[BUFMAX + sizeof(LEASE_DIR)];
+	int lease_ttl_ms;
+	int worker_stall_ms;	/* watchdog: longest silence of a busy worker, 0: none */
+	int job_timeout_ms;	/* watchdog: longest job, 0: none */
+	st_prio prio[ROLES];	/* CPU and I/O footprint of each process role */
+	char log_file[BUFMAX];	/* empty: stdout */
+	int log_level;		/* enum log_level */
+	int log_max_mb;		/* log_file is rotated past this size, 0: never */
+	int log_keep;		/* rotated files kept */
+	int log_ring;		/* messages the processes may be ahead of the drain */
+	int dedup;		/* enum dedup_mode */
+	int dedup_min_kb;	/* smaller files are not looked at */
+	char dedup_dir[BUFMAX + sizeof(DEDUP_DIR)];	/* output_dir/DEDUP_DIR */
+} st_config;
+
+static const char* const durability_names[] = { "none", "batch", "strict" };
+static const char* const sched_names[] = { "readdir", "fifo", "sjf" };
+static const char* const monitor_names[] = { "auto", "inotify", "poll" };
+static const char* const dedup_names[] = { "none", "hardlink", "reflink" };
+static const char* const format_names[] = { "dir", "pack" };
 
 volatile sig_atomic_t terminate = 0;
 volatile sig_atomic_t distfiles = 0;
+volatile sig_atomic_t reload = 0;
+
+/* read again on SIGHUP */
+static const char* config_file = NULL;
+
+/* writes what every process logs, stopped last by the parent */
+static pid_t pid_drain = 0;
+
+/* shared memory statistics, mapped before fork() */
+st_stats* stats = NULL;
+
+/* the worker's heartbeat in the statistics segment, NULL in the parent */
+static uint64_t* heartbeat = NULL;
+
+/* pids of workers the watchdog killed, reaped once they are gone */
+static pid_t* lost = NULL;
+static size_t nlost = 0;
+static size_t lost_capacity = 0;
+
+/* a worker making progress: the watchdog leaves it alone */
+static void worker_beat(void) {
+	if (heartbeat != NULL) {
+		STAT_SET(*heartbeat, now_ns());
+	}
+}
 
 void handle_signal(const int signo) {
 	/* if new files are detected, a signal should be sent to the parent process */
 	if (signo == SIGUSR1) {
-		write(STDOUT_FILENO,"New files detected\n", 19);
 		distfiles = 1;
 	}
 	/* to terminate the application, the parent process must handle the SIGINT signal */
 	if (signo == SIGINT) {
-		write(STDOUT_FILENO,"Received SIGINT, terminating...\n",32);
 		terminate = 1;
 	}
+	/* cleanup() asks the children to exit with SIGTERM */
+	if (signo == SIGTERM) {
+		terminate = 1;
+	}
+	/* the parent reloads the configuration, then has the monitor do it */
+	if (signo == SIGHUP) {
+		reload = 1;
+	}
 }
 
 void sigaction_setup(struct sigaction* act) {
@@ -41,319 +137,1894 @@ void sigaction_setup(struct sigaction* act) {
 	sigdelset(&act->sa_mask, SIGUSR1);
 	sigdelset(&act->sa_mask, SIGINT);
 
+	/* the pipe of a worker that died fails with EPIPE, the worker is replaced */
+	struct sigaction ign = *act;
+	ign.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ign, NULL);
+
 	act->sa_handler = handle_signal;
 	act->sa_flags = SA_RESTART;
 	/* register signal handlers */
 	sigaction(SIGUSR1, act, NULL);
 	sigaction(SIGINT, act, NULL);
+	sigaction(SIGHUP, act, NULL);
+
+	/* no SA_RESTART: a process blocked in read() must see terminate */
+	struct sigaction term = *act;
+	term.sa_flags = 0;
+	sigaction(SIGTERM, &term, NULL);
 }
 
-void read_config_file(const char *filename, char* input_dir, char* output_dir,
-					int* num_workers, int* interval_ms) {
+static int config_error(FILE* file, const char* fmt, ...) {
+	va_list ap;
+
+	if (file != NULL) {
+		fclose(file);
+	}
+	char msg[BUFMAX];
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	log_msg(LL_ERROR, "Error in configuration file: %s", msg);
+	return -1;
+}
+
+/**
+ * Read and check the configuration into cfg. Returns -1, with the error
+ * printed, if the file cannot be read or has an error: fatal at start, on
+ * a reload the running configuration stays.
+ */
+int read_config_file(const char *filename, st_config* cfg) {
 	FILE* file = fopen(filename, "r");
 	if (file == NULL) {
-		die("Error opening file %s:", filename);
-		/* all exit(1) after die is just to suppress warning */
-		exit(1);
+		log_msg(LL_ERROR, "Error opening file %s: %s", filename, strerror(errno));
+		return -1;
 	}
 
 	char line[256];
 	char key[128];
 	char value[128];
 
+	/* optional values */
+	cfg->trace_events = TRACE_EVENTS_DEFAULT;
+	cfg->report_index_ms = REPORT_INDEX_MS_DEFAULT;
+	cfg->durability = -1;
+	cfg->sched_policy = -1;
+	cfg->sched_aging = SCHED_AGING_DEFAULT;
+	cfg->durability_batch_apps = DURABILITY_BATCH_APPS_DEFAULT;
+	cfg->durability_batch_ms = DURABILITY_BATCH_MS_DEFAULT;
+	cfg->io.burst_ms = RATE_BURST_MS_DEFAULT;
+	cfg->lease_ttl_ms = LEASE_TTL_MS_DEFAULT;
+	cfg->worker_stall_ms = WORKER_STALL_MS_DEFAULT;
+	cfg->job_timeout_ms = JOB_TIMEOUT_MS_DEFAULT;
+	prio_init(cfg->prio);
+	cfg->input_monitor = -1;
+	cfg->poll_max_ms = POLL_MAX_MS_DEFAULT;
+	cfg->log_level = LL_INFO;
+	cfg->log_keep = LOG_KEEP_DEFAULT;
+	cfg->log_ring = LOG_RING_DEFAULT;
+	cfg->dedup = -1;
+	cfg->output_format = -1;
+	cfg->dedup_min_kb = DEDUP_MIN_KB_DEFAULT;
+
 	while (fgets(line, sizeof(line), file) != NULL) {
 		if (sscanf(line, "%s = %s", key, value) == 2) {
 			if (strcmp(key, "input_dir") == 0) {
-				strcpy(input_dir, value);
+				/* given once per spool root */
+				if (cfg->num_input_dirs == INPUT_DIRS_MAX) {
+					return config_error(file, "more than %d input_dir",
+							INPUT_DIRS_MAX);
+				}
+				strcpy(cfg->input_dirs[cfg->num_input_dirs++], value);
+			} else if (strcmp(key, "input_recursive") == 0) {
+				cfg->input_recursive = atoi(value);
+			} else if (strcmp(key, "input_monitor") == 0) {
+				for (int i = 0; i < 3; i++) {
+					if (strcmp(value, monitor_names[i]) == 0) {
+						cfg->input_monitor = i;
+					}
+				}
+				if (cfg->input_monitor == -1) {
+					return config_error(file, "input_monitor must be "
+							"auto, inotify or poll");
+				}
+			} else if (strcmp(key, "poll_max_ms") == 0) {
+				cfg->poll_max_ms = atoi(value);
 			} else if (strcmp(key, "output_dir") == 0) {
-				strcpy(output_dir, value);
+				strcpy(cfg->output_dir, value);
 			} else if (strcmp(key, "num_workers") == 0) {
-				*num_workers = atoi(value);
+				cfg->num_workers = atoi(value);
+			} else if (strcmp(key, "max_workers") == 0) {
+				cfg->max_workers = atoi(value);
 			} else if (strcmp(key, "interval_ms") == 0) {
-				*interval_ms = atoi(value);
+				cfg->interval_ms = atoi(value);
+			} else if (strcmp(key, "stats_shm") == 0) {
+				strcpy(cfg->stats_shm, value);
+			} else if (strcmp(key, "trace_dir") == 0) {
+				strcpy(cfg->trace_dir, value);
+			} else if (strcmp(key, "trace_events") == 0) {
+				cfg->trace_events = atoi(value);
+			} else if (strcmp(key, "report_index_ms") == 0) {
+				cfg->report_index_ms = atoi(value);
+			} else if (strcmp(key, "durability") == 0) {
+				for (int i = DURABILITY_NONE; i <= DURABILITY_STRICT; i++) {
+					if (strcmp(value, durability_names[i]) == 0) {
+						cfg->durability = i;
+					}
+				}
+				if (cfg->durability == -1) {
+					return config_error(file, "durability must be "
+							"none, batch or strict");
+				}
+			} else if (strcmp(key, "input_layout") == 0) {
+				if (strcmp(value, "flat") == 0) {
+					cfg->input_layout = INPUT_LAYOUT_FLAT;
+				} else if (strcmp(value, "dir") == 0) {
+					cfg->input_layout = INPUT_LAYOUT_DIR;
+				} else {
+					return config_error(file, "input_layout must be flat or dir");
+				}
+			} else if (strcmp(key, "sched_policy") == 0) {
+				for (int i = SCHED_READDIR; i <= SCHED_SJF; i++) {
+					if (strcmp(value, sched_names[i]) == 0) {
+						cfg->sched_policy = i;
+					}
+				}
+				if (cfg->sched_policy == -1) {
+					return config_error(file, "sched_policy must be "
+							"readdir, fifo or sjf");
+				}
+			} else if (strcmp(key, "fair_share") == 0) {
+				strcpy(cfg->fair_share, value);
+			} else if (strcmp(key, "sched_aging") == 0) {
+				cfg->sched_aging = atof(value);
+			} else if (strcmp(key, "output_fanout") == 0) {
+				cfg->output_fanout = atoi(value);
+			} else if (strcmp(key, "durability_batch_apps") == 0) {
+				cfg->durability_batch_apps = atoi(value);
+			} else if (strcmp(key, "durability_batch_ms") == 0) {
+				cfg->durability_batch_ms = atoi(value);
+			} else if (strcmp(key, "io_rate_mb") == 0) {
+				cfg->io.bytes = atof(value) * 1e6;
+			} else if (strcmp(key, "io_rate_ops") == 0) {
+				cfg->io.ops = atof(value);
+			} else if (strcmp(key, "io_worker_rate_mb") == 0) {
+				cfg->io.worker_bytes = atof(value) * 1e6;
+			} else if (strcmp(key, "io_worker_rate_ops") == 0) {
+				cfg->io.worker_ops = atof(value);
+			} else if (strcmp(key, "io_burst_ms") == 0) {
+				cfg->io.burst_ms = atoi(value);
+			} else if (strcmp(key, "io_latency_ms") == 0) {
+				cfg->io.latency_ms = atoi(value);
+			} else if (strcmp(key, "instance") == 0) {
+				strcpy(cfg->instance, value);
+			} else if (strcmp(key, "lease_dir") == 0) {
+				strcpy(cfg->lease_dir, value);
+			} else if (strcmp(key, "lease_ttl_ms") == 0) {
+				cfg->lease_ttl_ms = atoi(value);
+			} else if (strcmp(key, "worker_stall_ms") == 0) {
+				cfg->worker_stall_ms = atoi(value);
+			} else if (strcmp(key, "job_timeout_ms") == 0) {
+				cfg->job_timeout_ms = atoi(value);
+			} else if (strcmp(key, "log_file") == 0) {
+				strcpy(cfg->log_file, value);
+			} else if (strcmp(key, "log_level") == 0) {
+				cfg->log_level = log_level_parse(value);
+				if (cfg->log_level == -1) {
+					return config_error(file, "log_level must be "
+							"error, warn, info or debug");
+				}
+			} else if (strcmp(key, "log_max_mb") == 0) {
+				cfg->log_max_mb = atoi(value);
+			} else if (strcmp(key, "log_keep") == 0) {
+				cfg->log_keep = atoi(value);
+			} else if (strcmp(key, "log_ring") == 0) {
+				cfg->log_ring = atoi(value);
+			} else if (strcmp(key, "dedup") == 0) {
+				for (int i = DEDUP_NONE; i <= DEDUP_REFLINK; i++) {
+					if (strcmp(value, dedup_names[i]) == 0) {
+						cfg->dedup = i;
+					}
+				}
+				if (cfg->dedup == -1) {
+					return config_error(file, "dedup must be "
+							"none, hardlink or reflink");
+				}
+			} else if (strcmp(key, "dedup_min_kb") == 0) {
+				cfg->dedup_min_kb = atoi(value);
+			} else if (strcmp(key, "output_format") == 0) {
+				for (int i = OUTPUT_FORMAT_DIR; i <= OUTPUT_FORMAT_PACK; i++) {
+					if (strcmp(value, format_names[i]) == 0) {
+						cfg->output_format = i;
+					}
+				}
+				if (cfg->output_format == -1) {
+					return config_error(file, "output_format must be dir or pack");
+				}
 			} else {
-				die("Error in configuration file: %s is not a valid option", key);
+				int handled = prio_config(cfg->prio, key, value);
+				if (handled == -1) {
+					return config_error(file, "%s = %s is not valid", key, value);
+				} else if (handled == 0) {
+					return config_error(file, "%s is not a valid option", key);
+				}
 			}
 		}
 	}
+	fclose(file);
+
 	/* invalid values */
-	if (input_dir == NULL) {
-		die("Error in configuration file: input_dir is null");
-		exit(1);
+	if (cfg->num_input_dirs == 0) {
+		return config_error(NULL, "input_dir is null");
 	}
-	if (output_dir == NULL) {
-		die("Error in configuration file: output_dir is null");
-		exit(1);
+	if (cfg->input_recursive != 0 && cfg->input_recursive != 1) {
+		return config_error(NULL, "input_recursive must be 0 or 1");
+	}
+	if (cfg->output_dir[0] == '\0') {
+		return config_error(NULL, "output_dir is null");
+	}
+	if (cfg->num_workers <= 0) {
+		return config_error(NULL, "num_workers must be > 0");
+	}
+	if (cfg->max_workers == 0) {
+		cfg->max_workers = cfg->num_workers > WORKERS_MAX_DEFAULT
+				? cfg->num_workers : WORKERS_MAX_DEFAULT;
+	}
+	if (cfg->max_workers < cfg->num_workers) {
+		return config_error(NULL, "max_workers must be >= num_workers");
+	}
+	if (cfg->interval_ms <= 0) {
+		return config_error(NULL, "interval_ms must be > 0");
+	}
+	if (cfg->poll_max_ms < cfg->interval_ms) {
+		return config_error(NULL, "poll_max_ms must be >= interval_ms");
+	}
+	if (cfg->input_monitor == -1) {
+		cfg->input_monitor = INPUT_MONITOR_AUTO;
+	}
+	if (cfg->worker_stall_ms < 0) {
+		return config_error(NULL, "worker_stall_ms must be >= 0");
+	}
+	if (cfg->job_timeout_ms < 0) {
+		return config_error(NULL, "job_timeout_ms must be >= 0");
+	}
+	if (cfg->instance[0] != '\0') {
+		if (strspn(cfg->instance, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+				"0123456789_-") != strlen(cfg->instance)) {
+			return config_error(NULL, "instance must be letters, digits, "
+					"'_' and '-'");
+		}
+		if (cfg->lease_ttl_ms <= 0) {
+			return config_error(NULL, "lease_ttl_ms must be > 0");
+		}
+		if (cfg->lease_dir[0] == '\0') {
+			snprintf(cfg->lease_dir, sizeof(cfg->lease_dir), "%s/%s",
+					cfg->output_dir, LEASE_DIR);
+		}
+	}
+	/* instances on one host need a segment each */
+	if (cfg->stats_shm[0] == '\0') {
+		snprintf(cfg->stats_shm, sizeof(cfg->stats_shm), "%s%s%s", STATS_SHM_DEFAULT,
+				cfg->instance[0] != '\0' ? "-" : "", cfg->instance);
+	}
+	if (cfg->stats_shm[0] != '/') {
+		return config_error(NULL, "stats_shm must start with '/'");
+	}
+	if (cfg->trace_events <= 0) {
+		return config_error(NULL, "trace_events must be > 0");
+	}
+	if (cfg->report_index_ms < 0) {
+		return config_error(NULL, "report_index_ms must be >= 0");
+	}
+	if (cfg->durability == -1) {
+		cfg->durability = DURABILITY_NONE;
+	}
+	if (cfg->sched_policy == -1) {
+		cfg->sched_policy = SCHED_READDIR;
+	}
+	if (cfg->sched_aging <= 0) {
+		return config_error(NULL, "sched_aging must be > 0");
+	}
+	st_sched* check = sched_create(SCHED_READDIR, 1, cfg->fair_share);
+	if (check == NULL) {
+		return config_error(NULL, "fair_share must be PREFIX:WEIGHT,..., "
+				"weights > 0");
+	}
+	sched_destroy(check);
+	if (cfg->output_fanout < 0 || cfg->output_fanout > OUTPUT_FANOUT_MAX) {
+		return config_error(NULL, "output_fanout must be 0 to %d",
+				OUTPUT_FANOUT_MAX);
+	}
+	if (cfg->durability_batch_apps <= 0 || cfg->durability_batch_ms <= 0) {
+		return config_error(NULL, "durability_batch_apps and "
+				"durability_batch_ms must be > 0");
+	}
+	if (cfg->io.bytes < 0 || cfg->io.ops < 0 || cfg->io.worker_bytes < 0
+			|| cfg->io.worker_ops < 0 || cfg->io.latency_ms < 0) {
+		return config_error(NULL, "io_rate_mb, io_rate_ops, "
+				"io_worker_rate_mb, io_worker_rate_ops and io_latency_ms must be >= 0");
+	}
+	if (cfg->io.burst_ms <= 0) {
+		return config_error(NULL, "io_burst_ms must be > 0");
+	}
+	if (cfg->log_max_mb < 0 || cfg->log_keep < 0) {
+		return config_error(NULL, "log_max_mb and log_keep must be >= 0");
+	}
+	if (cfg->log_ring <= 0) {
+		return config_error(NULL, "log_ring must be > 0");
+	}
+	if (cfg->dedup == -1) {
+		cfg->dedup = DEDUP_NONE;
+	}
+	if (cfg->dedup_min_kb < 0) {
+		return config_error(NULL, "dedup_min_kb must be >= 0");
+	}
+	snprintf(cfg->dedup_dir, sizeof(cfg->dedup_dir), "%s/%s", cfg->output_dir, DEDUP_DIR);
+	if (cfg->output_format == -1) {
+		cfg->output_format = OUTPUT_FORMAT_DIR;
+	}
+	if (cfg->output_format == OUTPUT_FORMAT_PACK && cfg->dedup != DEDUP_NONE) {
+		return config_error(NULL, "dedup needs output_format = dir");
+	}
+	if (cfg->output_format == OUTPUT_FORMAT_PACK && cfg->output_fanout != 0) {
+		return config_error(NULL, "output_fanout needs output_format = dir");
+	}
+
+	return 0;
+}
+
+static void print_config(const st_config* cfg) {
+	printf("================================\n");
+	printf("Config file read:\n");
+	for (int i = 0; i < cfg->num_input_dirs; i++) {
+		printf("input_dir = %s\n", cfg->input_dirs[i]);
+	}
+	if (cfg->input_recursive) {
+		printf("input_recursive = 1\n");
+	}
+	printf("output_dir = %s\n", cfg->output_dir);
+	printf("num_workers = %d\n", cfg->num_workers);
+	printf("max_workers = %d\n", cfg->max_workers);
+	printf("interval_ms = %d\n", cfg->interval_ms);
+	printf("worker_stall_ms = %d\n", cfg->worker_stall_ms);
+	printf("job_timeout_ms = %d\n", cfg->job_timeout_ms);
+	printf("input_monitor = %s\n", monitor_names[cfg->input_monitor]);
+	if (cfg->input_monitor != INPUT_MONITOR_INOTIFY) {
+		printf("poll_max_ms = %d\n", cfg->poll_max_ms);
+	}
+	printf("stats_shm = %s\n", cfg->stats_shm);
+	printf("report_index_ms = %d\n", cfg->report_index_ms);
+	printf("input_layout = %s\n", cfg->input_layout == INPUT_LAYOUT_DIR ? "dir" : "flat");
+	printf("output_format = %s\n", format_names[cfg->output_format]);
+	if (cfg->output_format == OUTPUT_FORMAT_DIR) {
+		printf("output_fanout = %d\n", cfg->output_fanout);
+	}
+	printf("durability = %s\n", durability_names[cfg->durability]);
+	printf("sched_policy = %s\n", sched_names[cfg->sched_policy]);
+	if (cfg->sched_policy == SCHED_SJF) {
+		printf("sched_aging = %g\n", cfg->sched_aging);
+	}
+	if (cfg->fair_share[0] != '\0') {
+		printf("fair_share = %s\n", cfg->fair_share);
+	}
+	if (cfg->durability == DURABILITY_BATCH) {
+		printf("durability_batch_apps = %d\n", cfg->durability_batch_apps);
+		printf("durability_batch_ms = %d\n", cfg->durability_batch_ms);
+	}
+	if (cfg->io.bytes > 0 || cfg->io.ops > 0
+			|| cfg->io.worker_bytes > 0 || cfg->io.worker_ops > 0) {
+		printf("io_rate_mb = %g\n", cfg->io.bytes / 1e6);
+		printf("io_rate_ops = %g\n", cfg->io.ops);
+		printf("io_worker_rate_mb = %g\n", cfg->io.worker_bytes / 1e6);
+		printf("io_worker_rate_ops = %g\n", cfg->io.worker_ops);
+		printf("io_burst_ms = %d\n", cfg->io.burst_ms);
+		printf("io_latency_ms = %d\n", cfg->io.latency_ms);
+	}
+	if (cfg->instance[0] != '\0') {
+		printf("instance = %s\n", cfg->instance);
+		printf("lease_dir = %s\n", cfg->lease_dir);
+		printf("lease_ttl_ms = %d\n", cfg->lease_ttl_ms);
+	}
+	if (cfg->trace_dir[0] != '\0') {
+		printf("trace_dir = %s\n", cfg->trace_dir);
+		printf("trace_events = %d\n", cfg->trace_events);
+	}
+	if (cfg->dedup != DEDUP_NONE) {
+		printf("dedup = %s\n", dedup_names[cfg->dedup]);
+		printf("dedup_min_kb = %d\n", cfg->dedup_min_kb);
+	}
+	prio_print(cfg->prio);
+	if (cfg->log_file[0] != '\0') {
+		printf("log_file = %s\n", cfg->log_file);
+		printf("log_max_mb = %d\n", cfg->log_max_mb);
+		printf("log_keep = %d\n", cfg->log_keep);
+	}
+	printf("log_level = %s\n", log_level_name(cfg->log_level));
+	printf("log_ring = %d\n", cfg->log_ring);
+	printf("================================\n");
+	/* flush before fork(), or every child prints the buffer again */
+	fflush(stdout);
+}
+
+static void restart_only(int changed, const char* key) {
+	if (changed) {
+		log_msg(LL_WARN, "reload: %s changed, restart to apply", key);
+	}
+}
+
+/**
+ * SIGHUP: read the configuration again and take the values that can
+ * change while running. The others need a restart; with log set, a
+ * warning names each one. Returns -1 if the file has an error, cfg is
+ * then unchanged.
+ */
+static int config_reload(st_config* cfg, int log) {
+	st_config next = {0};
+	if (read_config_file(config_file, &next) == -1) {
+		return -1;
+	}
+
+	if (log) {
+		int roots = next.num_input_dirs != cfg->num_input_dirs;
+		for (int i = 0; !roots && i < cfg->num_input_dirs; i++) {
+			roots = strcmp(next.input_dirs[i], cfg->input_dirs[i]) != 0;
+		}
+		restart_only(roots, "input_dir");
+		restart_only(next.input_recursive != cfg->input_recursive, "input_recursive");
+		restart_only(next.input_layout != cfg->input_layout, "input_layout");
+		restart_only(next.input_monitor != cfg->input_monitor, "input_monitor");
+		restart_only(strcmp(next.output_dir, cfg->output_dir) != 0, "output_dir");
+		restart_only(next.output_fanout != cfg->output_fanout, "output_fanout");
+		restart_only(next.output_format != cfg->output_format, "output_format");
+		restart_only(next.max_workers != cfg->max_workers, "max_workers");
+		restart_only(strcmp(next.stats_shm, cfg->stats_shm) != 0, "stats_shm");
+		restart_only(strcmp(next.trace_dir, cfg->trace_dir) != 0
+				|| next.trace_events != cfg->trace_events, "trace_dir or trace_events");
+		restart_only(next.durability != cfg->durability, "durability");
+		restart_only((next.report_index_ms == 0) != (cfg->report_index_ms == 0),
+				"report_index_ms 0");
+		restart_only(strcmp(next.instance, cfg->instance) != 0
+				|| strcmp(next.lease_dir, cfg->lease_dir) != 0
+				|| next.lease_ttl_ms != cfg->lease_ttl_ms,
+				"instance, lease_dir or lease_ttl_ms");
+		restart_only(strcmp(next.log_file, cfg->log_file) != 0
+				|| next.log_max_mb != cfg->log_max_mb
+				|| next.log_keep != cfg->log_keep
+				|| next.log_ring != cfg->log_ring,
+				"log_file, log_max_mb, log_keep or log_ring");
+		restart_only(next.dedup != cfg->dedup || next.dedup_min_kb != cfg->dedup_min_kb,
+				"dedup or dedup_min_kb");
+	}
+
+	/* the pool grows up to max_workers, the segments are sized for it */
+	cfg->num_workers = next.num_workers < cfg->max_workers
+			? next.num_workers : cfg->max_workers;
+	cfg->interval_ms = next.interval_ms;
+	cfg->poll_max_ms = next.poll_max_ms;
+	cfg->sched_policy = next.sched_policy;
+	cfg->sched_aging = next.sched_aging;
+	strcpy(cfg->fair_share, next.fair_share);
+	cfg->durability_batch_apps = next.durability_batch_apps;
+	cfg->durability_batch_ms = next.durability_batch_ms;
+	if (next.report_index_ms > 0 && cfg->report_index_ms > 0) {
+		cfg->report_index_ms = next.report_index_ms;
+	}
+	cfg->io = next.io;
+	cfg->worker_stall_ms = next.worker_stall_ms;
+	cfg->job_timeout_ms = next.job_timeout_ms;
+	memcpy(cfg->prio, next.prio, sizeof(cfg->prio));
+	cfg->log_level = next.log_level;
+	return 0;
+}
+
+/**
+ * list the files of dir into m, with their sizes
+ */
+static int manifest_from_dir(const char* path, st_manifest* m) {
+	manifest_reset(m);
+	DIR* dir = opendir(path);
+	if (!dir) {
+		log_perror("opendir");
+		return -1;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		struct stat sb;
+		if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			sb.st_size = 0;
+		}
+		manifest_add(m, entry->d_name, sb.st_size);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/* hard link the files of from into the directory to_fd, replacing the names it has */
+static int link_files(const char* from, int to_fd) {
+	DIR* dir = opendir(from);
+	if (!dir) {
+		return -1;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		worker_beat();
+		if ((unlinkat(to_fd, entry->d_name, 0) == -1 && errno != ENOENT)
+				|| linkat(dirfd(dir), entry->d_name, to_fd, entry->d_name, 0) == -1) {
+			closedir(dir);
+			return -1;
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/* unlink the files of path, then path; a missing path is not an error */
+static int remove_dir(const char* path) {
+	DIR* dir = opendir(path);
+	if (!dir) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		if (unlinkat(dirfd(dir), entry->d_name, 0) == -1 && errno != ENOENT) {
+			closedir(dir);
+			return -1;
+		}
+	}
+
+	closedir(dir);
+	return rmdir(path);
+}
+
+/**
+ * An application delivered again: staging holds the new files, the
+ * published final the old ones. Their union, the new files winning, is
+ * built with hard links in the hidden .Application_N.merge next to final
+ * and swapped with it by one renameat2(RENAME_EXCHANGE), so that final is
+ * complete at every moment. The old directory and staging are removed
+ * after. A crash before the swap leaves staging to the retry, one after it
+ * links the same files again. Without RENAME_EXCHANGE in the filesystem the
+ * redelivery fails rather than being merged in place.
+ */
+static int merge_dir(const char* staging, const char* final) {
+	const char* base = strrchr(final, '/');
+	char merge[1100];
+	snprintf(merge, sizeof(merge), "%.*s/.%s.merge", (int)(base - final), final, base + 1);
+
+	/* links left by an attempt that died before its swap */
+	if (remove_dir(merge) == -1 || mkdir(merge, 0755) == -1) {
+		return -1;
+	}
+	int fd = open(merge, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	int linked = link_files(final, fd) == 0 && link_files(staging, fd) == 0;
+	close(fd);
+	if (!linked) {
+		return -1;
+	}
+
+	if (renameat2(AT_FDCWD, merge, AT_FDCWD, final, RENAME_EXCHANGE) == -1) {
+		if (errno == EINVAL || errno == ENOSYS) {
+			log_msg(LL_ERROR, "merge_dir: %s: the filesystem has no RENAME_EXCHANGE, "
+					"the redelivery is not merged", final);
+		}
+		return -1;
+	}
+
+	/* merge now holds the old files, all of them also linked in final */
+	if (remove_dir(merge) == -1 || remove_dir(staging) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * rename staging to final, unless final exists. Without RENAME_NOREPLACE
+ * support in the filesystem, fall back to a plain rename() of a name
+ * nobody else publishes: only one worker holds a given application.
+ */
+static int publish_dir(const char* staging, const char* final) {
+	if (renameat2(AT_FDCWD, staging, AT_FDCWD, final, RENAME_NOREPLACE) == 0) {
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+	if (access(final, F_OK) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	return rename(staging, final);
+}
+
+/**
+ * name the application directory (see app_relpath()) and create the
+ * directories above it: output_dir/jobref and the fanout levels
+ */
+static int app_output_dirs(const char* output_dir, const char* jobref, int jobapl,
+		int fanout, char* parent, size_t parent_size, char* app_dir, size_t app_dir_size) {
+	char rel[512];
+	if (app_relpath(rel, sizeof(rel), jobref, jobapl, fanout) == -1) {
+		log_msg(LL_ERROR, "app_output_dirs: %s/%d: name too long", jobref, jobapl);
+		return -1;
+	}
+	snprintf(app_dir, app_dir_size, "%s/%s", output_dir, rel);
+	snprintf(parent, parent_size, "%s", app_dir);
+	*strrchr(parent, '/') = '\0';
+
+	if (mkdir_if_need(output_dir) == -1) {
+		return -1;
+	}
+	for (char* p = strchr(parent + strlen(output_dir) + 1, '/'); p != NULL;
+			p = strchr(p + 1, '/')) {
+		*p = '\0';
+		int ret = mkdir_if_need(parent);
+		*p = '/';
+		if (ret == -1) {
+			return -1;
+		}
+	}
+	return mkdir_if_need(parent);
+}
+
+/* fsync dir and every directory above it, up to and including top */
+static int fsync_dirs_up(const char* dir, const char* top) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", dir);
+	size_t top_len = strlen(top);
+	for (;;) {
+		if (fsync_path(path, 0) == -1) {
+			return -1;
+		}
+		char* slash = strrchr(path, '/');
+		if (strlen(path) <= top_len || slash == NULL || slash < path + top_len) {
+			return 0;
+		}
+		*slash = '\0';
+	}
+}
+
+/* fdatasync every file of a directory */
+static int sync_files(const char* path) {
+	DIR* dir = opendir(path);
+	if (!dir) {
+		log_perror("opendir");
+		return -1;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		worker_beat();
+		int fd = openat(dirfd(dir), entry->d_name, O_RDONLY);
+		if (fd == -1 || fdatasync(fd) == -1) {
+			log_perror("fdatasync");
+			if (fd != -1) {
+				close(fd);
+			}
+			closedir(dir);
+			return -1;
+		}
+		close(fd);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/**
+ * publish the complete directory src as app_dir, in parent, with one
+ * rename. An application delivered again is merged with the published
+ * directory, which is replaced in one step too (see merge_dir()). With
+ * sync, the directories src left and app_dir entered reach the disk
+ * before it returns (durability = strict). m then lists the files of
+ * app_dir.
+ */
+static int publish_app(const char* src, const char* input_dir, const char* output_dir,
+		const char* parent, const char* app_dir, int sync, st_manifest* m) {
+	int published = publish_dir(src, app_dir);
+	if (published == -1 && errno == EEXIST) {
+		/* the application was delivered again: add to what was published */
+		log_msg(LL_WARN, "publish_app: '%s' exists, merging", app_dir);
+		published = merge_dir(src, app_dir);
+	}
+	if (published == -1) {
+		log_perror("publish_app");
+		log_msg(LL_ERROR, "publish_app: failed to publish '%s' as '%s'",
+				src, app_dir);
+		return -1;
+	}
+
+	if (sync && (fsync_path(app_dir, 0) == -1
+			|| fsync_dirs_up(parent, output_dir) == -1
+			|| fsync_path(input_dir, 0) == -1)) {
+		log_perror("publish_app: fsync");
+		return -1;
+	}
+
+	if (manifest_from_dir(app_dir, m) == -1) {
+		return -1;
+	}
+
+	for (size_t off = 0; off < m->len; off += strlen(m->names + off) + 1) {
+		log_msg(LL_INFO, "%s/%s", app_dir, m->names + off);
+	}
+	return 0;
+}
+
+/**
+ * cp input_dir/jpbapl-* output_dir/jobref/Application_jobapl
+ * (with output_fanout, output_dir/jobref/00/17/Application_1700)
+ *
+ * The files are moved into the hidden .Application_jobapl next to it,
+ * which is then renamed to Application_jobapl in one step: an application
+ * directory that exists is complete. A failed attempt leaves its files in
+ * the staging directory and the retry carries on from there.
+ *
+ * m lists the files moved, also when a later one fails. Once published,
+ * m lists the files of the application directory. Returns 1 if there was
+ * nothing to move: another instance published the application first.
+ */
+int copy_all_files(const char* input_dir, const char* output_dir,
+		const char* jobref, int jobapl, int fanout, int sync, st_manifest* m) {
+	manifest_reset(m);
+
+	char app_parent[1024];
+	char app_dir[1024];
+	if (app_output_dirs(output_dir, jobref, jobapl, fanout,
+			app_parent, sizeof(app_parent),
+			app_dir, sizeof(app_dir)) == -1) {
+		return -1;
+	}
+	char staging[1100];
+	snprintf(staging, sizeof(staging), "%s/.Application_%d", app_parent, jobapl);
+
+	if (mkdir_if_need(staging) == -1) {
+		return -1;
+	}
+
+	DIR* dir = opendir(input_dir);
+	if (!dir) {
+		log_perror("opendir");
+		return -1;
+	}
+
+	char prefix[512];
+	snprintf(prefix, sizeof(prefix), "^%d-", jobapl);
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			/* skip "." and ".." */
+			continue;
+		}
+
+		if (matches_regex(entry->d_name, prefix) != 1) {
+			continue;
+		}
+
+		char input_dir_file[SPOOL_PATH_MAX + NAME_MAX + 2];
+		snprintf(input_dir_file, sizeof(input_dir_file), "%s/%s",
+				input_dir, entry->d_name);
+		char staging_file[2048];
+		snprintf(staging_file, sizeof(staging_file), "%s/%s", staging, entry->d_name);
+
+		struct stat sb;
+		if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			sb.st_size = 0;
+		}
+
+		worker_beat();
+		if (lease_keep() == -1) {
+			closedir(dir);
+			return -1;
+		}
+		/* one rename, and its fdatasync with durability = strict */
+		ratelimit_take(sb.st_size, sync ? 2 : 1);
+		uint64_t start = now_ns();
+
+		/* use rename to move files, exec only works for one at a time */
+		if (rename(input_dir_file, staging_file) == -1) {
+			log_perror("rename");
+			log_msg(LL_ERROR, "copy_all_files: failed to move '%s' to '%s'",
+					input_dir_file, staging_file);
+			closedir(dir);
+			return -1;
+		}
+
+		if (sync && fsync_path(staging_file, 1) == -1) {
+			log_perror("fdatasync");
+			closedir(dir);
+			return -1;
+		}
+		ratelimit_observe(now_ns() - start);
+
+		manifest_add(m, entry->d_name, sb.st_size);
+	}
+	closedir(dir);
+
+	/* an empty staging directory: no earlier attempt left files either */
+	if (m->nfiles == 0 && rmdir(staging) == 0) {
+		return 1;
+	}
+	if (lease_keep() == -1) {
+		return -1;
+	}
+
+	return publish_app(staging, input_dir, output_dir, app_parent,
+			app_dir, sync, m);
+}
+
+/**
+ * mv input_dir/jobapl output_dir/jobref/Application_jobapl
+ *
+ * input_layout = dir: the email bot gives each application its own
+ * directory, which is published as it is, one rename whatever the
+ * number of files. Returns 1 if the directory is gone, published by
+ * another instance.
+ */
+int move_app_dir(const char* input_dir, const char* output_dir,
+		const char* jobref, int jobapl, int fanout, int sync, st_manifest* m) {
+	manifest_reset(m);
+
+	char app_parent[1024];
+	char app_dir[1024];
+	if (app_output_dirs(output_dir, jobref, jobapl, fanout,
+			app_parent, sizeof(app_parent),
+			app_dir, sizeof(app_dir)) == -1) {
+		return -1;
+	}
+	char input_dir_jobapl[SPOOL_PATH_MAX + 16];
+	snprintf(input_dir_jobapl, sizeof(input_dir_jobapl), "%s/%d", input_dir, jobapl);
+
+	struct stat sb;
+	if (stat(input_dir_jobapl, &sb) == -1 && errno == ENOENT) {
+		return 1;
+	}
+	worker_beat();
+	if (lease_keep() == -1) {
+		return -1;
+	}
+
+	/* the size is only known once published: the next application pays */
+	ratelimit_take(0, 1);
+	uint64_t start = now_ns();
+
+	if (sync && sync_files(input_dir_jobapl) == -1) {
+		return -1;
+	}
+
+	int ret = publish_app(input_dir_jobapl, input_dir, output_dir, app_parent,
+			app_dir, sync, m);
+	if (ret == 0) {
+		ratelimit_observe((now_ns() - start) / (sync ? m->nfiles + 1 : 1));
+		ratelimit_charge(m->bytes, sync ? m->nfiles : 0);
+	}
+	return ret;
+}
+
+/**
+ * output_format = pack: append the files of the application to
+ * output_dir/<jobref>.pack, then remove them from the spool. Many small
+ * applications cost one file per job reference instead of a directory
+ * and an inode per attachment.
+ *
+ * The files are copied, not renamed, and removed only once the append is
+ * committed: a worker that dies in between leaves the application in the
+ * spool, appended again by the next attempt; readers take the last copy.
+ * The candidate data, or the directory with input_layout = dir, goes
+ * last. An unlink, unlike a rename, may reach the disk before the copy it
+ * follows: unless durability = none, the data and then the header of the
+ * append are synced before the spool files are removed. Returns 1 if
+ * there was nothing to append: another instance did.
+ */
+int pack_app(const char* input_dir, const char* output_dir, const char* jobref,
+		int jobapl, int input_layout, int durability, st_manifest* m) {
+	manifest_reset(m);
+	int sync = durability == DURABILITY_STRICT;
+
+	char src[SPOOL_PATH_MAX + 16];
+	char prefix[32] = "";
+	if (input_layout == INPUT_LAYOUT_DIR) {
+		snprintf(src, sizeof(src), "%s/%d", input_dir, jobapl);
+	} else {
+		snprintf(src, sizeof(src), "%s", input_dir);
+		snprintf(prefix, sizeof(prefix), "%d-", jobapl);
+	}
+	size_t prefix_len = strlen(prefix);
+
+	DIR* dir = opendir(src);
+	if (!dir) {
+		if (errno == ENOENT && input_layout == INPUT_LAYOUT_DIR) {
+			return 1;
+		}
+		log_perror("pack_app: opendir");
+		return -1;
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s%s", output_dir, jobref, PACK_SUFFIX);
+	st_pack_writer w = { .fd = -1 };
+	if (pack_begin(&w, path) == -1) {
+		log_msg(LL_ERROR, "pack_app: cannot append to '%s'", path);
+		closedir(dir);
+		return -1;
+	}
+
+	int ret = 0;
+	uint64_t start = now_ns();
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+				|| strncmp(entry->d_name, prefix, prefix_len) != 0) {
+			continue;
+		}
+		int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat sb;
+		if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+			if (fd != -1) {
+				close(fd);
+			}
+			continue;
+		}
+
+		worker_beat();
+		if (lease_keep() == -1) {
+			close(fd);
+			ret = -1;
+			break;
+		}
+		ratelimit_take(sb.st_size, 1);
+		if (pack_add(&w, entry->d_name, fd, sb.st_size) == -1) {
+			log_msg(LL_ERROR, "pack_app: failed to append '%s/%s' to '%s'",
+					src, entry->d_name, path);
+			close(fd);
+			ret = -1;
+			break;
+		}
+		close(fd);
+		manifest_add(m, entry->d_name, w.entries[w.nfiles - 1].size);
+	}
+
+	if (ret == 0 && m->nfiles == 0) {
+		ret = 1;
+	} else if (ret == 0 && lease_keep() == -1) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		pack_writer_free(&w);
+		closedir(dir);
+		if (ret == 1 && input_layout == INPUT_LAYOUT_DIR) {
+			rmdir(src);
+		}
+		return ret;
+	}
+	if (pack_commit(&w, jobapl, durability != DURABILITY_NONE ? PACK_SYNC_ORDERED
+			: PACK_SYNC_NONE) == -1) {
+		log_msg(LL_ERROR, "pack_app: failed to commit '%s'", path);
+		pack_writer_free(&w);
+		closedir(dir);
+		return -1;
+	}
+	pack_writer_free(&w);
+	ratelimit_observe((now_ns() - start) / m->nfiles);
+
+	/* committed: what is left in the spool would only be appended again */
+	const char* marker = NULL;
+	for (size_t off = 0; off < m->len; off += strlen(m->names + off) + 1) {
+		const char* name = m->names + off;
+		log_msg(LL_INFO, "%s:Application_%d/%s", path, jobapl, name);
+		if (input_layout == INPUT_LAYOUT_FLAT
+				&& strstr(name, "-candidate-data.txt") != NULL) {
+			marker = name;
+		} else if (unlinkat(dirfd(dir), name, 0) == -1 && errno != ENOENT) {
+			log_perror("pack_app: unlink");
+		}
+	}
+	if (marker != NULL && unlinkat(dirfd(dir), marker, 0) == -1 && errno != ENOENT) {
+		log_perror("pack_app: unlink");
+	}
+	closedir(dir);
+	if (input_layout == INPUT_LAYOUT_DIR && rmdir(src) == -1) {
+		log_perror("pack_app: rmdir");
+	}
+	if (sync && fsync_path(input_dir, 0) == -1) {
+		log_perror("pack_app: fsync");
+	}
+	return 0;
+}
+
+int create_monitor() {
+	pid_t pid;
+	pid = fork();
+	if (pid == 0) {
+		log_role("monitor");
+		log_msg(LL_INFO, "Monitor process created");
+	}
+	return pid;
+}
+
+/**
+ * fork worker i, with its two pipes. The child returns 0 holding only its
+ * own ends, so that a worker sees EOF once the parent closes its pipe.
+ */
+static pid_t spawn_worker(const st_config* cfg, st_workers* ws, int i) {
+	if (worker_pipes_open(ws, i) == -1) {
+		return -1;
+	}
+	/* or the child writes what the parent has buffered, the report too */
+	fflush(NULL);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		log_perror("fork");
+		for (int k = i*2; k <= i*2+1; k++) {
+			close(ws->worker_pipes[k][0]);
+			close(ws->worker_pipes[k][1]);
+			ws->worker_pipes[k][0] = ws->worker_pipes[k][1] = -1;
+		}
+		return -1;
+	}
+	else if (pid == 0) {
+		log_role("worker");
+		log_msg(LL_INFO, "Worker process created");
+		ws->pids[i] = getpid();
+		prio_apply(0, &cfg->prio[ROLE_WORKER]);
+		for (int j = 0; j < cfg->max_workers; j++) {
+			if (j != i && ws->worker_pipes[j*2][1] != -1) {
+				close(ws->worker_pipes[j*2][1]);
+				close(ws->worker_pipes[j*2+1][0]);
+			}
+		}
+		close(ws->worker_pipes[i*2][1]);
+		close(ws->worker_pipes[i*2+1][0]);
+		return 0;
+	}
+
+	/* set worker pid in st_workers */
+	ws->pids[i] = pid;
+	close(ws->worker_pipes[i*2][0]);
+	close(ws->worker_pipes[i*2+1][1]);
+	ws->worker_pipes[i*2][0] = ws->worker_pipes[i*2+1][1] = -1;
+	return pid;
+}
+
+int create_workers(const st_config* cfg, st_workers* ws) {
+	pid_t pid = -1;
+	/* create N workers */
+	for (int i = 0; i < cfg->num_workers; i++) {
+		pid = spawn_worker(cfg, ws, i);
+		if (pid <= 0) {
+			return pid;
+		}
+	}
+
+	return pid;
+}
+
+void worker_process(const st_config* cfg, st_workers* ws);
+
+/**
+ * spawn_worker() once the pool runs, on a reload or to replace a hung
+ * worker: the new worker drops the notify pipe and opens its own trace.
+ */
+static pid_t worker_start(const st_config* cfg, st_workers* ws, int i, int notify_fd) {
+	pid_t pid = spawn_worker(cfg, ws, i);
+	if (pid == 0) {
+		/* WORKER */
+		close(notify_fd);
+		trace_close();
+		if (trace_open(cfg->trace_dir, "worker", cfg->trace_events) == -1) {
+			log_msg(LL_WARN, "worker: tracing disabled");
+		}
+		worker_process(cfg, ws);
+		die("Filebot exited abnormally");
+	}
+	return pid;
+}
+
+/**
+ * trace the arrival of an application: its candidate-data file, or its
+ * directory with input_layout = dir, is what scan_dir() looks for. The
+ * ctime gives the landing time, which is moved to the monotonic clock used
+ * by all other trace points. The job reference is read from the candidate
+ * data as scan_dir() does, so that filebot-trace tells apart the same
+ * application number under two job references.
+ */
+void trace_detect(const char* dir, const char* name, int input_layout) {
+	if (!trace_enabled()) {
+		return;
+	}
+	int jobapl;
+	if (input_layout == INPUT_LAYOUT_DIR) {
+		if (strspn(name, "0123456789") != strlen(name)) {
+			return;
+		}
+		jobapl = atoi(name);
+	} else {
+		if (!matches_regex(name, "-candidate-data.txt$")) {
+			return;
+		}
+		jobapl = get_jobapl_from_filename(name);
+	}
+
+	char path[SPOOL_PATH_MAX + NAME_MAX + 2];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	char ca_data[SPOOL_PATH_MAX + 2 * NAME_MAX + 2];
+	if (input_layout == INPUT_LAYOUT_DIR) {
+		snprintf(ca_data, sizeof(ca_data), "%s/%s-candidate-data.txt", path, name);
+	} else {
+		snprintf(ca_data, sizeof(ca_data), "%s", path);
+	}
+	char jobref[32];
+	if (get_jobref_from_ca_data(jobref, sizeof(jobref), ca_data) == -1) {
+		jobref[0] = '\0';
+	}
+
+	struct stat sb;
+	struct timespec real;
+	uint64_t mono = now_ns();
+	if (lstat(path, &sb) == 0
+			&& clock_gettime(CLOCK_REALTIME, &real) == 0) {
+		int64_t age = (real.tv_sec - sb.st_ctim.tv_sec) * 1000000000LL
+				+ (real.tv_nsec - sb.st_ctim.tv_nsec);
+		/* ctime is coarser than the clock, it may look like the future */
+		if (age < 0) {
+			age = 0;
+		}
+		if ((uint64_t)age < mono) {
+			trace_event_at(TR_LAND, mono - age, jobref, jobapl, 0);
+		}
+	}
+	trace_event(TR_DETECT, jobref, jobapl, 0);
+}
+
+/**
+ * Tell the parent to scan the directories in dirty, or all of them with
+ * rescan, and wake it up. Returns 1 if the pipe is full: the parent is
+ * behind and the whole spool is to be scanned once it catches up.
+ */
+static int notify_parent(int notify_fd, pid_t ppid, int rescan, const Vec* dirty) {
+	if (rescan && spool_notify(notify_fd, "") == -1) {
+		return 1;
+	}
+	for (size_t i = 0; !rescan && i < dirty->size; i++) {
+		if (spool_notify(notify_fd, dirty->items[i]) == -1) {
+			return 1;
+		}
+	}
+	/* one signal per round: the parent scans everything there is anyway */
+	if ((rescan || dirty->size > 0) && kill(ppid, SIGUSR1) == -1) {
+		die("monitor_process: kill(%d, SIGUSR1):", ppid);
+	}
+	return 0;
+}
+
+/**
+ * input_monitor = poll: every directory of the spool is looked at each
+ * round, the rounds are closer together while applications arrive.
+ */
+static void monitor_poll(st_config* cfg, int notify_fd, pid_t ppid) {
+	st_spool_poll* sp = spool_poll_create(cfg->input_layout, cfg->input_recursive,
+			cfg->interval_ms, cfg->poll_max_ms);
+	if (sp == NULL) {
+		die("monitor_process: cannot poll the spool");
+	}
+	for (int i = 0; i < cfg->num_input_dirs; i++) {
+		if (!dir_exists(cfg->input_dirs[i])) {
+			die("monitor_process: %s: no such directory", cfg->input_dirs[i]);
+		}
+		if (spool_poll_add(sp, cfg->input_dirs[i]) == -1) {
+			die("monitor_process: cannot poll %s", cfg->input_dirs[i]);
+		}
+	}
+	/* the first round scans everything */
+	spool_poll_end_round(sp);
+	int rescan = 1;
+
+	log_msg(LL_INFO, "Polling directory for new files...");
+
+	while (!terminate) {
+		if (reload) {
+			reload = 0;
+			if (config_reload(cfg, 0) == 0) {
+				sp->min_ms = cfg->interval_ms;
+				sp->max_ms = cfg->poll_max_ms;
+			}
+		}
+		spool_poll_round(sp, trace_detect);
+		rescan = notify_parent(notify_fd, ppid, rescan, sp->dirty);
+		spool_poll_end_round(sp);
+		usleep(sp->interval_ms * 1000);
+	}
+
+	spool_poll_destroy(sp);
+}
+
+/**
+ * input_monitor = inotify: one watch per spool directory. With
+ * input_recursive a new subdirectory is watched as soon as it shows up,
+ * and scanned, since files may have come before the watch; a removed one
+ * is forgotten. Returns -1 if the spool cannot be watched.
+ */
+static int monitor_inotify(st_config* cfg, int notify_fd, pid_t ppid) {
+	/* a whole burst per read(): the kernel queue drains while we sleep */
+	static char buf[INOTIFY_BUFSIZE]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	st_spool_watch* sw = spool_watch_create(cfg->input_layout, cfg->input_recursive);
+	if (sw == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < cfg->num_input_dirs; i++) {
+		if (!dir_exists(cfg->input_dirs[i])) {
+			die("monitor_process: %s: no such directory", cfg->input_dirs[i]);
+		}
+		/* the email bot may also rename complete files or directories in */
+		if (spool_watch_add(sw, cfg->input_dirs[i]) == -1) {
+			spool_watch_destroy(sw);
+			return -1;
+		}
+	}
+	/* scan everything once the watches are in place, nothing is missed */
+	spool_watch_end_round(sw);
+	int rescan = 1;
+
+	log_msg(LL_INFO, "Monitoring directory for new files...");
+
+	while(!terminate) {
+		if (reload) {
+			reload = 0;
+			config_reload(cfg, 0);
+		}
+		if (rescan) {
+			rescan = notify_parent(notify_fd, ppid, rescan, sw->dirty);
+		}
+
+		/* while the parent's pipe is full, try the rescan again after interval_ms */
+		struct pollfd pfd = { .fd = sw->fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, rescan ? cfg->interval_ms : -1);
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ready == -1) {
+			die("poll:");
+		}
+		if (ready == 0) {
+			continue;
+		}
+
+		/* monitor the directory, send signal to parent if detects a change */
+		ssize_t len = read(sw->fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR) {
+			continue;
+		}
+		if (len == -1) {
+			die("read:");
+		}
+
+		struct inotify_event *event;
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *) ptr;
+			if (event->mask & IN_Q_OVERFLOW) {
+				/*
+				 * the kernel dropped events: which files came is unknown, so
+				 * the whole spool is scanned, after this read, so every file
+				 * the dropped events were about is seen
+				 */
+				STAT_ADD(stats->parent.inotify_overflows, 1);
+				log_msg(LL_WARN, "monitor_process: inotify queue overflow, rescanning");
+				rescan = 1;
+				continue;
+			}
+			if (event->mask & IN_IGNORED) {
+				spool_watch_forget(sw, event->wd);
+				continue;
+			}
+			const char* dir = spool_watch_path(sw, event->wd);
+			if (dir == NULL) {
+				continue;
+			}
+			if (event->mask & IN_MOVE_SELF && !dir_exists(dir)) {
+				/* moved out of the spool: IN_IGNORED follows */
+				inotify_rm_watch(sw->fd, event->wd);
+				continue;
+			}
+			if (!(event->mask & (IN_CREATE | IN_MOVED_TO)) || event->len == 0) {
+				continue;
+			}
+			if (event->mask & IN_ISDIR && sw->recursive
+					&& spool_subdir(event->name, cfg->input_layout)) {
+				char sub[SPOOL_PATH_MAX];
+				snprintf(sub, sizeof(sub), "%s/%s", dir, event->name);
+				if (spool_watch_add(sw, sub) == -1) {
+					log_msg(LL_WARN, "monitor_process: %s is not watched", sub);
+				}
+				continue;
+			}
+			trace_detect(dir, event->name, cfg->input_layout);
+			spool_watch_dirty(sw, event->wd);
+		}
+
+		rescan = notify_parent(notify_fd, ppid, rescan, sw->dirty);
+		spool_watch_end_round(sw);
+
+		usleep(cfg->interval_ms * 1000);
+	}
+
+	spool_watch_destroy(sw);
+	return 0;
+}
+
+/**
+ * Watch the spool and tell the parent which directories to scan: their
+ * paths go through notify_fd, SIGUSR1 wakes it up. inotify never hears of
+ * the files other hosts write, so a spool on a network filesystem is
+ * polled instead, as is one inotify cannot watch (max_user_watches).
+ */
+void monitor_process(st_config* cfg, int notify_fd) {
+	pid_t ppid;
+
+	ppid = getppid();
+	if (ppid == -1) {
+		die("monitor_process: parent process not found:");
+	}
+
+	int mode = cfg->input_monitor;
+	for (int i = 0; mode == INPUT_MONITOR_AUTO && i < cfg->num_input_dirs; i++) {
+		if (spool_remote(cfg->input_dirs[i])) {
+			log_msg(LL_WARN, "monitor_process: %s is on a network filesystem, "
+					"polling", cfg->input_dirs[i]);
+			mode = INPUT_MONITOR_POLL;
+		}
 	}
-	if (*num_workers <= 0) {
-		die("Error in configuration file: num_workers must be > 0");
-		exit(1);
+	if (mode != INPUT_MONITOR_POLL && monitor_inotify(cfg, notify_fd, ppid) == -1) {
+		if (mode == INPUT_MONITOR_INOTIFY) {
+			die("monitor_process: cannot watch the spool");
+		}
+		log_msg(LL_WARN, "monitor_process: cannot watch the spool, polling");
+		mode = INPUT_MONITOR_POLL;
 	}
-	if (*interval_ms <= 0) {
-		die("Error in configuration file: interval_ms must be > 0");
-		exit(1);
+	if (mode == INPUT_MONITOR_POLL) {
+		monitor_poll(cfg, notify_fd, ppid);
 	}
 
-	printf("================================\n");
-	printf("Config file read:\n");
-	printf("input_dir = %s\n", input_dir);
-	printf("output_dir = %s\n", output_dir);
-	printf("num_workers = %d\n", *num_workers);
-	printf("interval_ms = %d\n", *interval_ms);
-	printf("================================\n");
-
-	fclose(file);
+	close(notify_fd);
+	trace_close();
+	log_msg(LL_INFO, "Exiting from monitor process...");
+	exit(0);
 }
 
-int get_jobapl_from_filename(const char* filename) {
-	int num_apl = 0;
-	int base = 1;
-	/* number before '-' */
-	for (int i = 0; filename[i] != '-' && filename[i] != '\0'; i++) {
-		if (filename[i] < '0' || filename[i] > '9') {
-			return -1;
+/**
+ * Applications queued or in flight, so that a scan that overlaps the jobs
+ * in flight does not queue one twice: jobapl -> Vec of job messages, name
+ * and spool directory, as a jobapl may repeat in other directories.
+ */
+static st_imap* pending = NULL;
+
+static Vec* pending_list(const st_job* job, size_t* idx) {
+	if (pending == NULL) {
+		pending = imap_create();
+	}
+	Vec* list = imap_get(pending, atoi(strrchr(job->name, '/') + 1));
+	size_t len = job_msg_len(job);
+	for (*idx = 0; list != NULL && *idx < list->size; (*idx)++) {
+		if (memcmp(list->items[*idx], job->name, len) == 0) {
+			break;
 		}
-		num_apl = num_apl * base + (filename[i] - '0');
-		base = 10;
 	}
-	return num_apl;
+	return list;
 }
 
-/* get jobref from x-candidate-data.txt by extracting the first line */
-int get_jobref_from_ca_data(char* jobref, size_t nbytes, char* ca_data) {
-	FILE* fp = fopen(ca_data, "r");
-	if (fp == NULL) {
-		return -1;
+/* 1 if job was added, 0 if it is pending already */
+static int pending_add(const st_job* job) {
+	size_t idx;
+	Vec* list = pending_list(job, &idx);
+	if (list != NULL && idx < list->size) {
+		return 0;
 	}
-	if (fgets(jobref, nbytes, fp) == NULL) {
-		fclose(fp);
-		return -1;
+	if (list == NULL) {
+		list = vec_create(1);
+		imap_put(pending, atoi(strrchr(job->name, '/') + 1), list);
 	}
+	size_t len = job_msg_len(job);
+	char* msg = malloc(len);
+	if (msg == NULL) {
+		die("malloc:");
+	}
+	memcpy(msg, job->name, len);
+	vec_push(list, msg);
+	return 1;
+}
 
-	/* ensure jobref has null terminator instead of newline */
-	jobref[strcspn(jobref, "\n")] = '\0';
+/* the job is done with, before it is freed */
+static void pending_del(const st_job* job) {
+	size_t idx;
+	Vec* list = pending_list(job, &idx);
+	if (list == NULL || idx == list->size) {
+		return;
+	}
+	free(vec_remove(list, idx));
+	if (list->size == 0) {
+		imap_del(pending, atoi(strrchr(job->name, '/') + 1));
+		vec_destroy(list);
+	}
+}
 
-	fclose(fp);
-	return 0;
+/**
+ * Jobs whose lease another instance holds, queued again once the lease may
+ * have gone stale: if that instance died, the next attempt steals it and
+ * publishes the application. They stay pending meanwhile, so that a scan
+ * does not queue them twice.
+ */
+typedef struct {
+	st_job* job;
+	uint64_t due_ns;
+} st_deferred;
+
+static st_deferred* deferred = NULL;
+static size_t ndeferred = 0;
+static size_t deferred_capacity = 0;
+
+static void defer_job(st_job* job, int ms) {
+	if (ndeferred == deferred_capacity) {
+		size_t capacity = deferred_capacity ? deferred_capacity * 2 : 16;
+		st_deferred* grown = realloc(deferred, capacity * sizeof(st_deferred));
+		if (grown == NULL) {
+			die("realloc:");
+		}
+		deferred = grown;
+		deferred_capacity = capacity;
+	}
+	deferred[ndeferred].job = job;
+	deferred[ndeferred].due_ns = now_ns() + (uint64_t)ms * 1000000;
+	ndeferred++;
 }
 
-/* cp input_dir/jpbapl-* output_dir/jobref/Application_jobapl */
-int copy_all_files(const char* input_dir, const char* output_dir,
-		const char* jobref, int jobapl) {
-	if (mkdir_if_need(output_dir) == -1) {
-		return -1;
+/* queue the deferred jobs that are due */
+static void deferred_due(st_sched* q) {
+	if (ndeferred == 0) {
+		return;
+	}
+	uint64_t now = now_ns();
+	size_t kept = 0;
+	for (size_t i = 0; i < ndeferred; i++) {
+		if (deferred[i].due_ns <= now) {
+			sched_push(q, deferred[i].job);
+		} else {
+			deferred[kept++] = deferred[i];
+		}
 	}
+	ndeferred = kept;
+}
 
-	char output_dir_jobref[512];
-	snprintf(output_dir_jobref, sizeof(output_dir_jobref), "%s/%s",
-			output_dir, jobref);
-	if (mkdir_if_need(output_dir_jobref) == -1) {
-		return -1;
+/**
+ * Take back the job of worker i, hung or dead, queue it again and put a
+ * new worker in the slot. The old one is killed but not waited for: a
+ * process stuck on an unreachable NFS server dies once the server answers,
+ * it is reaped then. While exiting, the slot is left empty.
+ */
+static int worker_replace(const st_config* cfg, st_workers* ws, st_sched* q, int i,
+		int notify_fd, const char* why) {
+	st_job* job = ws->jobs[i];
+	pid_t pid = ws->pids[i];
+	log_msg(LL_WARN, "watchdog: worker %d (pid %d) %s on %s, replacing it",
+			i, pid, why, job->name);
+	if (pid > 0) {
+		kill(pid, SIGKILL);
+		if (nlost >= lost_capacity) {
+			size_t new_capacity = lost_capacity ? lost_capacity * 2 : 16;
+			pid_t* new_lost = realloc(lost, new_capacity * sizeof(pid_t));
+			if (new_lost == NULL) {
+				die("realloc:");
+			}
+			lost = new_lost;
+			lost_capacity = new_capacity;
+		}
+		lost[nlost++] = pid;
+	}
+	char jobref[128];
+	int jobapl;
+	if (cfg->instance[0] != '\0'
+			&& sscanf(job->name, "%127[^/]/%d", jobref, &jobapl) == 2) {
+		lease_break(cfg->lease_dir, jobref, jobapl, pid);
 	}
 
-	char output_dir_jobref_jobapl[1024];
-	snprintf(output_dir_jobref_jobapl, sizeof(output_dir_jobref_jobapl), "%s/Application_%d",
-			output_dir_jobref, jobapl);
+	close(ws->worker_pipes[i*2][1]);
+	close(ws->worker_pipes[i*2+1][0]);
+	ws->worker_pipes[i*2][1] = ws->worker_pipes[i*2+1][0] = -1;
+	ws->pids[i] = 0;
+	ws->ready[i] = 1;
+	ws->jobs[i] = NULL;
 
-	if (mkdir_if_need(output_dir_jobref_jobapl) == -1) {
-		return -1;
+	trace_job(TR_ACK, job->name, 1);
+	sched_push(q, job);
+	STAT_ADD(stats->parent.in_flight, -1);
+	STAT_ADD(stats->workers[i].replaced, 1);
+	STAT_SET(stats->parent.queue_depth, q->size);
+
+	if (terminate) {
+		return 0;
 	}
+	return worker_start(cfg, ws, i, notify_fd) == -1 ? -1 : 0;
+}
 
-	DIR* dir = opendir(input_dir);
-	if (!dir) {
-		perror("opendir");
-		return -1;
+/**
+ * A busy worker is hung when it has not been heard from for
+ * worker_stall_ms, or has been on its job for job_timeout_ms. The worker
+ * beats at each step of its job, and ahead of time before it waits for the
+ * rate limiter.
+ */
+static int watchdog(const st_config* cfg, st_workers* ws, st_sched* q, int notify_fd) {
+	for (size_t k = 0; k < nlost; ) {
+		if (waitpid(lost[k], NULL, WNOHANG) != 0) {
+			lost[k] = lost[--nlost];
+		} else {
+			k++;
+		}
 	}
 
-	struct dirent* entry;
-	while ((entry = readdir(dir)) != NULL) {
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-			/* skip "." and ".." */
+	uint64_t now = now_ns();
+	for (int i = 0; i < cfg->num_workers; i++) {
+		if (ws->ready[i] != 0) {
 			continue;
 		}
-
-		char prefix[512];
-		snprintf(prefix, sizeof(prefix), "^%d-", jobapl);
-		if (matches_regex(entry->d_name, prefix) != 1) {
+		uint64_t since = ws->dispatched_ns[i];
+		uint64_t beat = STAT_GET(stats->workers[i].heartbeat_ns);
+		uint64_t alive = beat > since ? beat : since;
+		char why[64];
+		if (cfg->worker_stall_ms > 0
+				&& now > alive + (uint64_t)cfg->worker_stall_ms * 1000000) {
+			snprintf(why, sizeof(why), "silent for %lu ms",
+					(unsigned long)((now - alive) / 1000000));
+		} else if (cfg->job_timeout_ms > 0
+				&& now - since > (uint64_t)cfg->job_timeout_ms * 1000000) {
+			snprintf(why, sizeof(why), "past job_timeout_ms");
+		} else {
 			continue;
 		}
-
-		char input_dir_file[512];
-		snprintf(input_dir_file, sizeof(input_dir_file), "%s/%s",
-				input_dir, entry->d_name);
-		char output_dir_jobref_jobapl_file[2048];
-		snprintf(output_dir_jobref_jobapl_file, sizeof(output_dir_jobref_jobapl_file), "%s/%s",
-				output_dir_jobref_jobapl, entry->d_name);
-
-		
-		/* use rename to move files, exec only works for one at a time */
-		if (rename(input_dir_file, output_dir_jobref_jobapl_file) == -1) {
-			perror("rename");
-			fprintf(stderr, "copy_all_files: failed to move '%s' to '%s'\n", 
-					input_dir_file, output_dir_jobref_jobapl_file);
-			closedir(dir);
+		if (worker_replace(cfg, ws, q, i, notify_fd, why) == -1) {
 			return -1;
 		}
-
-		write(STDOUT_FILENO, strcat(output_dir_jobref_jobapl_file, "\n"),
-				strlen(output_dir_jobref_jobapl_file)+1);
 	}
-
-	closedir(dir);
 	return 0;
 }
 
-int create_monitor() {
-	pid_t pid;
-	pid = fork();
-	if (pid == 0) {
-		write(STDOUT_FILENO, "Monitor process created\n", 24);
+static int workers_busy(const st_config* cfg, const st_workers* ws) {
+	int busy = 0;
+	for (int i = 0; i < cfg->num_workers; i++) {
+		busy += ws->ready[i] == 0;
 	}
-	return pid;
+	return busy;
 }
 
-int create_workers(int num_workers, st_workers* ws) {
-	pid_t pid = -1;
-	/* create N workers */
-	for (int i = 0; i < num_workers; i++) {
-		pid = fork();
-		if (pid == -1) {
-			return pid;
+/* longest wait for an answer, the parent loop has more to do */
+#define DIST_WAIT_MS 10
+
+/**
+ * hand queued jobs to the idle workers, then collect the answers that come
+ * within DIST_WAIT_MS. Returns the number of workers that became idle.
+ */
+static int dist_round(const st_config* cfg, st_workers* ws, st_sched* q, st_report* rp,
+		int notify_fd) {
+	int num_workers = cfg->num_workers;
+	int idle = 0;
+	st_ack ack;
+	static st_manifest m;
+	/* the busy workers; max_workers only changes with a restart */
+	static struct pollfd* fds = NULL;
+	static int* fds_worker = NULL;
+	if (fds == NULL) {
+		fds = calloc(cfg->max_workers, sizeof(struct pollfd));
+		fds_worker = calloc(cfg->max_workers, sizeof(int));
+		if (fds == NULL || fds_worker == NULL) {
+			die("calloc:");
 		}
-		else if (pid == 0) {
-			write(STDOUT_FILENO, "Worker process created\n", 23);
-			ws->pids[i] = getpid();
-			close(ws->worker_pipes[i*2][1]);
-			close(ws->worker_pipes[i*2+1][0]);
-			return pid;
+	}
+
+	for (int i = 0; i < num_workers && q->size != 0 && !reload && !terminate; i++) {
+		if (ws->ready[i] != 1) {
+			continue;
 		}
-		else {
-			/* set worker pid in st_workers */
-			ws->pids[i] = pid;
-			close(ws->worker_pipes[i*2][0]);
-			close(ws->worker_pipes[i*2+1][1]);
+		st_job* job = sched_pop(q);
+		char jobref[128];
+		int jobapl;
+		if (cfg->instance[0] != '\0'
+				&& sscanf(job->name, "%127[^/]/%d", jobref, &jobapl) == 2
+				&& lease_busy(cfg->lease_dir, jobref, jobapl, cfg->lease_ttl_ms)) {
+			/* another instance is on it, spare the worker a round trip */
+			defer_job(job, cfg->lease_ttl_ms);
+			i--;
+			continue;
+		}
+		/* keep the job until the worker answers */
+		ws->ready[i] = 0;
+		free(ws->jobs[i]);
+		ws->jobs[i] = job;
+		ws->dispatched_ns[i] = now_ns();
+		STAT_ADD(stats->parent.in_flight, 1);
+
+		/* jobref/jobapl and its spool directory, null terminated */
+		const char* msg = job->name;
+		if (write(ws->worker_pipes[i*2][1], msg, job_msg_len(job)) == -1) {
+			if (errno != EPIPE) {
+				log_perror("dist_files: write");
+				return -1;
+			}
+			if (worker_replace(cfg, ws, q, i, notify_fd, "exited") == -1) {
+				return -1;
+			}
+			continue;
 		}
+		trace_job(TR_DISPATCH, msg, 0);
 	}
+	STAT_SET(stats->parent.queue_depth, q->size);
 
-	return pid;
-}
-
-void monitor_process(const char* input_dir, int interval_ms) {
-	/* file/watch descriptor */
-	int fd, wd;
-	pid_t ppid;
-	char buf[BUFMAX];
-
-	ppid = getppid();
-	if (ppid == -1) {
-		die("monitor_process: parent process not found:");
+	int nfds = 0;
+	for (int i = 0; i < num_workers; i++) {
+		if (ws->ready[i] == 0) {
+			fds[nfds].fd = ws->worker_pipes[i*2+1][0];
+			fds[nfds].events = POLLIN;
+			fds_worker[nfds++] = i;
+		}
 	}
-
-	/* inotify */
-	fd = inotify_init();
-	if (fd == -1) {
-		die("inotify_init:");
+	if (nfds == 0) {
+		return 0;
 	}
-
-	wd = inotify_add_watch(fd, input_dir, IN_CREATE);
-	if (wd == -1) {
-		die("inotify_add_watch: %s:", input_dir);
+	/* a signal cuts the wait short: new files, reload or exit */
+	if (poll(fds, nfds, DIST_WAIT_MS) == -1 && errno != EINTR) {
+		log_perror("dist_files: poll");
+		return -1;
 	}
 
-	write(STDOUT_FILENO, "Monitoring directory for new files...\n", 38);
+	for (int k = 0; k < nfds; k++) {
+		if (fds[k].revents == 0) {
+			continue;
+		}
+		int j = fds_worker[k];
+		int fd = fds[k].fd;
+		/* EOF or a short read: the worker died, maybe halfway through its answer */
+		if (read_full(fd, &ack, sizeof(ack)) != sizeof(ack)) {
+			if (worker_replace(cfg, ws, q, j, notify_fd, "exited") == -1) {
+				return -1;
+			}
+			idle++;
+			continue;
+		}
+		manifest_reserve(&m, ack.names_len);
+		manifest_reserve_files(&m, ack.nfiles);
+		size_t sizes_len = ack.nfiles * sizeof(uint64_t);
+		if ((ack.names_len > 0
+				&& read_full(fd, m.names, ack.names_len) != ack.names_len)
+				|| (sizes_len > 0
+				&& read_full(fd, m.sizes, sizes_len) != (ssize_t)sizes_len)) {
+			if (worker_replace(cfg, ws, q, j, notify_fd, "exited") == -1) {
+				return -1;
+			}
+			idle++;
+			continue;
+		}
+		m.len = ack.names_len;
+		m.nfiles = ack.nfiles;
+		m.bytes = ack.bytes;
+
+		ws->ready[j] = 1;
+		idle++;
+		STAT_ADD(stats->parent.in_flight, -1);
+
+		st_job* job = ws->jobs[j];
+		ws->jobs[j] = NULL;
+		trace_job(TR_ACK, job->name, ack.status == -1);
+
+		char jobref[128];
+		int jobapl;
+		if (ack.status == 0) {
+			if (sscanf(job->name, "%127[^/]/%d", jobref, &jobapl) == 2) {
+				report_app(rp, jobref, jobapl, &m);
+			}
+			pending_del(job);
+			free(job);
+		} else if (ack.status == 1) {
+			/* gone from the spool: another instance published it and reports it */
+			pending_del(job);
+			free(job);
+		} else if (ack.status == 2) {
+			/* another instance holds the lease: look again once it may be stale */
+			defer_job(job, cfg->lease_ttl_ms);
+		} else {
+			/* try again */
+			sched_push(q, job);
+			STAT_ADD(stats->workers[j].retries, 1);
+			STAT_SET(stats->parent.queue_depth, q->size);
+		}
+	}
+	return idle;
+}
 
-	while(!terminate) {
-		/* monitor the directory, send signal to parent if detects a change */
-		ssize_t len = read(fd, buf, sizeof(buf));
-		if (len == -1) {
-			die("read:");
+/**
+ * distribute files across worker processes, for as long as the workers
+ * keep answering and nothing else is waiting for the parent. It never
+ * waits on one worker, the watchdog replaces the hung ones. No job is
+ * handed out while a reload or the exit waits for the workers.
+ */
+int dist_files(const st_config* cfg, st_workers* ws, st_sched* q, st_report* rp,
+		int notify_fd) {
+	int idle;
+	do {
+		idle = dist_round(cfg, ws, q, rp, notify_fd);
+		if (idle == -1 || watchdog(cfg, ws, q, notify_fd) == -1) {
+			return -1;
 		}
+	} while (idle > 0 && q->size != 0 && !distfiles && !reload && !terminate);
+	return 0;
+}
 
-		struct inotify_event *event;
-		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
-			event = (struct inotify_event *) ptr;
-			if (event->mask & IN_CREATE) {
-				/* send signal */
-				if (kill(ppid, SIGUSR1) == -1) {
-					die("monitor_process: kill(%d, SIGUSR1):", ppid);
-				}
-			}
+/* applications found by one scan_dir(), before they are queued */
+typedef struct {
+	st_job** jobs;
+	int* jobapls;
+	size_t size;
+	size_t capacity;
+} st_found;
+
+static int found_add(st_found* f, const char* jobref, int jobapl, const char* dir,
+		uint64_t arrival_ns) {
+	if (f->size >= f->capacity) {
+		size_t new_capacity = f->capacity ? f->capacity * 2 : 64;
+		st_job** new_jobs = realloc(f->jobs, new_capacity * sizeof(st_job*));
+		if (new_jobs == NULL) {
+			log_perror("scan_dir: realloc");
+			return -1;
 		}
+		f->jobs = new_jobs;
+		int* new_jobapls = realloc(f->jobapls, new_capacity * sizeof(int));
+		if (new_jobapls == NULL) {
+			log_perror("scan_dir: realloc");
+			return -1;
+		}
+		f->jobapls = new_jobapls;
+		f->capacity = new_capacity;
+	}
 
-		usleep(interval_ms * 1000);
+	st_job* job = job_create(jobref, jobapl, dir, arrival_ns, 0);
+	if (job == NULL) {
+		log_perror("scan_dir: malloc");
+		return -1;
 	}
+	f->jobs[f->size] = job;
+	f->jobapls[f->size] = jobapl;
+	f->size++;
+	return 0;
+}
 
-	close(fd);
-	write(STDOUT_FILENO, "Exiting from monitor process...\n", 32);
-	exit(0);
+static uint64_t ctime_ns(const struct stat* sb) {
+	return (uint64_t)sb->st_ctim.tv_sec * 1000000000ULL + sb->st_ctim.tv_nsec;
 }
 
-/* distribute files across worker processes */
-int dist_files(st_workers* ws, int num_workers, Vec* fifo) {
-	if (terminate) {
-		return -1;
+/* total size of the regular files of a directory */
+static uint64_t dir_bytes(int parent_fd, const char* name) {
+	int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+	DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		return 0;
 	}
-	int i;
-	char buf[PIPE_BUF];
 
-	while(fifo->size != 0) {
-		for (i = 0; i < num_workers && fifo->size != 0; i++) {
-			//printf("==============================\n");
-			//printf("(DEBUG) FIRST FOR LOOP, i = %d\n", i);
-			//printf("==============================\n");
-			//printf("(DEBUG) ws->ready[1] = %d\n", ws->ready[1]);
-			if (ws->ready[i] == 1) {
-				//printf("(DEBUG) IS READY\n");
-				ws->ready[i] = 0;
-				char* msg = vec_remove(fifo, 0);
-				size_t msg_len = strlen(msg);
-
-				//printf("(DEBUG) strlen(msg) = %zu\n", msg_len);
-				//printf("(DEBUG) msg to write in worker = %s\n", msg);
-				//printf("(DEBUG) writing to worker %d\n", i);
-
-				if (write(ws->worker_pipes[i*2][1], msg, msg_len) == -1) {
-					perror("dist_files: write");
-					return -1;
-				}
-			}
+	uint64_t bytes = 0;
+	struct dirent* entry;
+	struct stat sb;
+	while ((entry = readdir(dir)) != NULL) {
+		if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISREG(sb.st_mode)) {
+			bytes += sb.st_size;
 		}
-		//printf("(DEBUG) after 1st for, i = %d\n", i);
+	}
+	closedir(dir);
+	return bytes;
+}
 
-		for (int j = 0; j < i; j++) {
-			if (ws->ready[j] == 0) {
-				if (read(ws->worker_pipes[j*2+1][0], buf, sizeof(buf)) == -1) {
-					perror("parent_process: read");
-				}
+static int cmp_found(const void* x, const void* y, void* arg) {
+	const int* jobapls = arg;
+	int a = jobapls[*(const size_t*)x];
+	int b = jobapls[*(const size_t*)y];
+	return (a > b) - (a < b);
+}
 
-				if (matches_regex(buf, "done")) {
-					ws->ready[j] = 1;
-				} else {
-					/* try again */
-					//printf("(DEBUG) failed to copy, trying again...\n");
-					size_t buf_len = strlen(buf);
-					char* item = (char*)malloc(buf_len);
-					if (item == NULL) {
-						perror("dist_files: malloc");
-						return -1;
-					}
-					strncpy(item, buf, buf_len);
-					vec_push(fifo, item);
-				}
+/**
+ * SCHED_SJF ranks applications by size: add up the files of each one.
+ * input_layout = flat needs one more pass over input_dir, matching the
+ * files to the applications by their <jobapl>- prefix.
+ */
+static void found_bytes(st_found* f, DIR* dir, int input_layout) {
+	char name[32];
+	if (input_layout == INPUT_LAYOUT_DIR) {
+		for (size_t i = 0; i < f->size; i++) {
+			snprintf(name, sizeof(name), "%d", f->jobapls[i]);
+			f->jobs[i]->bytes = dir_bytes(dirfd(dir), name);
+		}
+		return;
+	}
+
+	size_t* order = malloc(f->size * sizeof(size_t));
+	if (order == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < f->size; i++) {
+		order[i] = i;
+	}
+	qsort_r(order, f->size, sizeof(size_t), cmp_found, f->jobapls);
+
+	rewinddir(dir);
+	struct dirent* entry;
+	struct stat sb;
+	while ((entry = readdir(dir)) != NULL) {
+		int jobapl = get_jobapl_from_filename(entry->d_name);
+		if (jobapl < 1) {
+			continue;
+		}
+		/* binary search of jobapl in order */
+		size_t lo = 0, hi = f->size;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (f->jobapls[order[mid]] < jobapl) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
 			}
 		}
+		if (lo < f->size && f->jobapls[order[lo]] == jobapl
+				&& fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+			f->jobs[order[lo]]->bytes += sb.st_size;
+		}
 	}
-	return 0;
+	free(order);
 }
 
-int scan_dir(const char* input_dir, Vec* fifo) {
+/**
+ * input_layout = flat: an application is ready once its
+ * <jobapl>-candidate-data.txt is in input_dir.
+ * input_layout = dir: the directory input_dir/<jobapl> is renamed in
+ * complete, with <jobapl>-candidate-data.txt inside.
+ *
+ * The ctime of the candidate data, or of the directory, is the arrival of
+ * the application, the moment the monitor is woken up for it.
+ *
+ * Returns the number of applications queued, or -1. A spool directory
+ * removed since it was notified has none.
+ */
+int scan_dir(const char* input_dir, int input_layout, st_sched* q) {
 	int jobapl;
 	char jobref[32];
-	char buf[PIPE_BUF];
+	st_found found = {0};
+	struct stat sb;
+	int ret = 0;
 	DIR* dir = opendir(input_dir);
 
+	if (!dir && errno == ENOENT) {
+		return 0;
+	}
 	if (!dir) {
-		perror("scan_dir: opendir");
+		log_perror("scan_dir: opendir");
 		return -1;
 	}
 
@@ -366,88 +2037,339 @@ int scan_dir(const char* input_dir, Vec* fifo) {
 
 		//printf("(DEBUG) new entry: %s\n", entry->d_name);
 
+		if (input_layout == INPUT_LAYOUT_DIR) {
+			const char* name = entry->d_name;
+			if (strspn(name, "0123456789") != strlen(name)) {
+				/* not an application, e.g. the hidden staging directory of the bot */
+				continue;
+			}
+			char ca_data[SPOOL_PATH_MAX + 2 * NAME_MAX];
+			snprintf(ca_data, sizeof(ca_data), "%s/%s/%s-candidate-data.txt",
+					input_dir, name, name);
+			jobapl = atoi(name);
+			if (jobapl < 1 || get_jobref_from_ca_data(jobref, sizeof(jobref), ca_data) == -1) {
+				log_msg(LL_WARN, "scan_dir: %s/%s: no candidate data, skipped",
+						input_dir, name);
+				continue;
+			}
+			if (fstatat(dirfd(dir), name, &sb, 0) == -1) {
+				continue;
+			}
+			if (found_add(&found, jobref, jobapl, input_dir, ctime_ns(&sb)) == -1) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
 		if (matches_regex(entry->d_name, "-candidate-data.txt")) {
 			//printf("(DEBUG) `%s` matches `-candidate-data.txt`\n", entry->d_name);
 			/* path to candidate-data file */
-			char ca_data[512];
+			char ca_data[SPOOL_PATH_MAX + NAME_MAX + 2];
 			snprintf(ca_data, sizeof(ca_data), "%s/%s", input_dir, entry->d_name);
 
 			//printf("(DEBUG) ca_data = %s\n", ca_data);
 
+			errno = 0;
 			if (get_jobref_from_ca_data(jobref, sizeof(jobref), ca_data) == -1) {
-				fprintf(stderr, "scan_dir: get_jobref_from_ca_data: could "
+				if (errno == ENOENT) {
+					/* moved since readdir(): scans overlap the jobs in flight */
+					continue;
+				}
+				log_msg(LL_ERROR, "scan_dir: get_jobref_from_ca_data: could "
 						"not extract job reference from %s", entry->d_name);
-				closedir(dir);
-				return -1;
+				ret = -1;
+				break;
 			}
 			//printf("(DEBUG) jobref = %s\n", jobref);
 
 			jobapl = get_jobapl_from_filename(entry->d_name);
 			//printf("(DEBUG) jobapl = %d\n", jobapl);
 			if (jobapl < 1) {
-				fprintf(stderr, "scan_dir: get_jobapl_from_filename: "
-						"invalid job application: %d\n", jobapl);
-				closedir(dir);
-				return -1;
+				log_msg(LL_ERROR, "scan_dir: get_jobapl_from_filename: "
+						"invalid job application: %d", jobapl);
+				ret = -1;
+				break;
 			}
 
-			/* buf: IBM-000123/1 */
-			snprintf(buf, sizeof(buf), "%s/%d", jobref, jobapl);
-
-			/* only allocate the bytes needed! */
-			size_t buf_len = strlen(buf);
-			char* item = (char*)malloc(buf_len);
-			if (item == NULL) {
-				perror("scan_dir: malloc");
-				closedir(dir);
-				return -1;
+			if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+				continue;
+			}
+			if (found_add(&found, jobref, jobapl, input_dir, ctime_ns(&sb)) == -1) {
+				ret = -1;
+				break;
 			}
+		}
+	}
 
-			strncpy(item, buf, buf_len);
-			vec_push(fifo, item);
+	if (ret == 0 && q->policy == SCHED_SJF) {
+		found_bytes(&found, dir, input_layout);
+	}
+	closedir(dir);
 
-			//printf("(DEBUG) strlen(buf) = %lu\n", buf_len);
-			//printf("(DEBUG) item after strncpy = %s\n", item);
+	int queued = 0;
+	for (size_t i = 0; i < found.size; i++) {
+		if (ret == 0 && pending_add(found.jobs[i])) {
+			sched_push(q, found.jobs[i]);
+			trace_job(TR_ENQUEUE, found.jobs[i]->name, 0);
+			queued++;
+		} else {
+			free(found.jobs[i]);
 		}
 	}
+	free(found.jobs);
+	free(found.jobapls);
 
-	closedir(dir);
+	return ret == 0 ? queued : -1;
+}
+
+typedef struct {
+	int input_layout;
+	st_sched* q;
+	size_t found;
+} st_scan;
+
+static int scan_one(const char* dir, void* arg) {
+	st_scan* scan = arg;
+	int n = scan_dir(dir, scan->input_layout, scan->q);
+	if (n == -1) {
+		return -1;
+	}
+	scan->found += n;
 	return 0;
 }
 
-void parent_process(const char* input_dir, const char* output_dir, st_workers* ws,
-				int num_workers, pid_t pid_monitor) {
+static int cmp_str(const void* a, const void* b) {
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * scan the spool directories the monitor notified, each once, or all of
+ * them if it asked for a full scan (at start and after a lost event)
+ */
+int scan_spool(const st_config* cfg, int notify_fd, st_sched* q) {
+	st_scan scan = { .input_layout = cfg->input_layout, .q = q, .found = 0 };
+	Vec* dirs = vec_create(16);
+	int all = 0;
+	int ret = spool_notified(notify_fd, dirs, &all) == -1 ? -1 : 0;
+
+	trace_event(TR_SCAN_BEGIN, NULL, 0, 0);
+	if (ret == 0 && all) {
+		for (int i = 0; ret == 0 && i < cfg->num_input_dirs; i++) {
+			ret = spool_walk(cfg->input_dirs[i], cfg->input_recursive,
+					cfg->input_layout, scan_one, &scan);
+		}
+	} else if (ret == 0) {
+		qsort(dirs->items, dirs->size, sizeof(void*), cmp_str);
+		for (size_t i = 0; ret == 0 && i < dirs->size; i++) {
+			if (i > 0 && strcmp(dirs->items[i], dirs->items[i - 1]) == 0) {
+				continue;
+			}
+			ret = scan_one(dirs->items[i], &scan);
+		}
+	}
+	trace_event(TR_SCAN_END, NULL, 0, 0);
+
+	for (size_t i = 0; i < dirs->size; i++) {
+		free(dirs->items[i]);
+	}
+	vec_destroy(dirs);
+
+	if (ret == 0) {
+		stats_intake(stats, scan.found);
+	}
+	STAT_SET(stats->parent.queue_depth, q->size);
+	return ret;
+}
+
+/**
+ * Grow or shrink the pool to cfg->num_workers. Only called when every
+ * worker is idle: a worker stopped has no job in flight, it only has to
+ * leave its loop.
+ */
+static void resize_workers(st_config* cfg, st_workers* ws, int from, int notify_fd) {
+	for (int i = from - 1; i >= cfg->num_workers; i--) {
+		worker_stop(ws, i);
+	}
+	for (int i = from; i < cfg->num_workers; i++) {
+		if (worker_start(cfg, ws, i, notify_fd) == -1) {
+			cfg->num_workers = i;
+			break;
+		}
+	}
+	STAT_SET(stats->num_workers, cfg->num_workers);
+}
+
+/**
+ * SIGHUP: apply the new configuration without dropping what is queued or
+ * in flight, then have the monitor reload it too.
+ */
+static void parent_reload(st_config* cfg, st_workers* ws, st_sched** q, st_report* rp,
+		pid_t pid_monitor, int notify_fd) {
+	int num_workers = cfg->num_workers;
+	int policy = cfg->sched_policy;
+	double aging = cfg->sched_aging;
+	char fair_share[BUFMAX];
+	strcpy(fair_share, cfg->fair_share);
+
+	if (config_reload(cfg, 1) == -1) {
+		log_msg(LL_ERROR, "reload: %s not applied", config_file);
+		return;
+	}
+	log_set_level(cfg->log_level);
+
+	/* a new scheduler: the queued jobs move over, ranked by the new policy */
+	if (cfg->sched_policy != policy || cfg->sched_aging != aging
+			|| strcmp(cfg->fair_share, fair_share) != 0) {
+		st_sched* next = sched_create(cfg->sched_policy, cfg->sched_aging, cfg->fair_share);
+		st_job* job;
+		while ((job = sched_pop(*q)) != NULL) {
+			job->seq = 0;
+			sched_push(next, job);
+		}
+		sched_destroy(*q);
+		*q = next;
+	}
+	report_tune(rp, cfg->durability_batch_apps, cfg->durability_batch_ms,
+			cfg->report_index_ms);
+	ratelimit_update(&cfg->io);
+	resize_workers(cfg, ws, num_workers, notify_fd);
+
+	/* the new workers got theirs in spawn_worker() */
+	prio_apply(0, &cfg->prio[ROLE_PARENT]);
+	if (pid_monitor > 0) {
+		prio_apply(pid_monitor, &cfg->prio[ROLE_MONITOR]);
+	}
+	for (int i = 0; i < cfg->num_workers && i < num_workers; i++) {
+		prio_apply(ws->pids[i], &cfg->prio[ROLE_WORKER]);
+	}
+
+	if (pid_monitor > 0 && kill(pid_monitor, SIGHUP) == -1) {
+		log_perror("reload: kill");
+	}
+	print_config(cfg);
+}
+
+void parent_process(st_config* cfg, st_workers* ws, pid_t pid_monitor,
+		int notify_fd) {
+	const char* output_dir = cfg->output_dir;
+
+	/* one queue per customer prefix, dispatched by weighted fair sharing */
+	st_sched* q = sched_create(cfg->sched_policy, cfg->sched_aging, cfg->fair_share);
+
+	/* the report names the pack of an application with output_format = pack */
+	st_report* rp = report_open(output_dir, cfg->instance, cfg->report_index_ms,
+			cfg->output_format == OUTPUT_FORMAT_PACK ? OUTPUT_FANOUT_PACK
+					: cfg->output_fanout);
+	if (rp == NULL) {
+		log_msg(LL_ERROR, "parent_process: cannot open the report in %s", output_dir);
+		terminate = 1;
+	} else if (cfg->instance[0] != '\0' && mkdir_if_need(cfg->lease_dir) == -1) {
+		terminate = 1;
+	} else if (cfg->dedup != DEDUP_NONE && mkdir_if_need(cfg->dedup_dir) == -1) {
+		terminate = 1;
+	} else if (report_durability(rp, cfg->durability, output_dir,
+			cfg->durability_batch_apps, cfg->durability_batch_ms) == -1) {
+		terminate = 1;
+	}
+	for (int i = 0; !terminate && i < cfg->num_input_dirs; i++) {
+		if (report_sync_dir(rp, cfg->input_dirs[i]) == -1) {
+			terminate = 1;
+		}
+	}
 
-	Vec* fifo = vec_create(num_workers);
-	
 	while(!terminate) {
+		/* a reload waits until no job is in flight */
+		if (reload && workers_busy(cfg, ws) == 0) {
+			reload = 0;
+			parent_reload(cfg, ws, &q, rp, pid_monitor, notify_fd);
+		}
 		if (distfiles) {
 			distfiles = 0;
-			/* scan input_dir and add "jobref/jobapl" to fifo */
-
-			if (scan_dir(input_dir, fifo) == -1) {
+			log_msg(LL_DEBUG, "New files detected");
+			/* scan the spool directories that changed, queue the applications found */
+			if (scan_spool(cfg, notify_fd, q) == -1) {
 				terminate = 1;
 			}
 
-			//printf("(DEBUG) fifo->size = %zu\n", fifo->size);
-			
-			if (dist_files(ws, num_workers, fifo) == -1) {
-				terminate = 1;
-			}
+			//printf("(DEBUG) q->size = %zu\n", q->size);
+		}
+		deferred_due(q);
+		if ((q->size > 0 || workers_busy(cfg, ws) > 0)
+				&& dist_files(cfg, ws, q, rp, notify_fd) == -1) {
+			terminate = 1;
 		}
+		/* make the report current, the index once report_index_ms elapsed */
+		report_flush(rp);
 		usleep(100); /* avoid high cpu usage */
 	}
 
-	/* exit all processes */
-	vec_destroy(fifo);
-	cleanup(ws, num_workers, pid_monitor);
-	generate_report_file(output_dir);
+	log_msg(LL_INFO, "Terminating...");
+	/* the answers of the jobs in flight, for the report */
+	while (workers_busy(cfg, ws) > 0 && dist_files(cfg, ws, q, rp, notify_fd) == 0) {
+	}
 
-	write(STDOUT_FILENO, "Exiting from parent process...\n", 31);
+	/* exit all processes */
+	sched_destroy(q);
+	for (size_t i = 0; i < ndeferred; i++) {
+		free(deferred[i].job);
+	}
+	free(deferred);
+	close(notify_fd);
+	cleanup(ws, cfg->num_workers, pid_monitor);
+	stats_destroy(stats, cfg->stats_shm);
+	ratelimit_destroy();
+	trace_close();
+	report_close(rp);
+
+	log_msg(LL_INFO, "Exiting from parent process...");
+	log_drain_stop(pid_drain);
 	exit(0);
 }
 
-void worker_process(const char* input_dir, const char* output_dir, st_workers* ws, int num_workers) {
+/**
+ * dedup = hardlink or reflink: the files of the application just published
+ * whose content was published before become links to that first copy.
+ * Their bytes are read once to be hashed, and once more to be compared:
+ * the rate limiter is charged for it.
+ */
+static void dedup_app(const st_config* cfg, const char* jobref, int jobapl,
+		const st_manifest* m, st_worker_stats* wst) {
+	char rel[512];
+	char app_dir[1024];
+	if (app_relpath(rel, sizeof(rel), jobref, jobapl, cfg->output_fanout) == -1) {
+		return;
+	}
+	snprintf(app_dir, sizeof(app_dir), "%s/%s", cfg->output_dir, rel);
+	int dirfd = open(app_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1) {
+		log_perror("dedup_app: open");
+		return;
+	}
+
+	size_t i = 0;
+	for (size_t off = 0; off < m->len; off += strlen(m->names + off) + 1, i++) {
+		if (m->sizes[i] < (uint64_t)cfg->dedup_min_kb * 1024) {
+			continue;
+		}
+		worker_beat();
+		if (lease_keep() == -1) {
+			break;
+		}
+		ratelimit_take(m->sizes[i], 1);
+		if (dedup_file(dirfd, m->names + off) == 1) {
+			STAT_ADD(wst->dedup_files, 1);
+			STAT_ADD(wst->dedup_bytes, m->sizes[i]);
+		}
+	}
+	close(dirfd);
+}
+
+void worker_process(const st_config* cfg, st_workers* ws) {
+	const char* output_dir = cfg->output_dir;
+	int num_workers = cfg->num_workers;
+	int sync = cfg->durability == DURABILITY_STRICT;
+	int fanout = cfg->output_fanout;
 	int jobapl;
 	char jobref[128];
 	char buf[PIPE_BUF];
@@ -455,34 +2377,94 @@ void worker_process(const char* input_dir, const char* output_dir, st_workers* w
 	for (int i = num_workers-1; i >= 0; i--) {
 		if (ws->pids[i] == getpid()) {
 			//printf("(DEBUG) ws->pids[%d] = %d\n", i, ws->pids[i]);
+			st_worker_stats* wst = &stats->workers[i];
+			heartbeat = &wst->heartbeat_ns;
+			ratelimit_worker(i, heartbeat);
+			st_manifest m = {0};
+			st_ack ack;
 			while(!terminate) {
-				/* pipe will have: jobref/jobapl */
-				if (read(ws->worker_pipes[i*2][0], buf, sizeof(buf)) == -1) {
-					perror("worker_process: read");
+				/* pipe will have: jobref/jobapl, then its spool directory */
+				ssize_t len = read(ws->worker_pipes[i*2][0], buf, sizeof(buf) - 1);
+				if (len == -1) {
+					if (errno != EINTR) {
+						log_perror("worker_process: read");
+					}
+					continue;
+				}
+				if (len == 0) {
+					/* parent closed the pipe */
+					break;
+				}
+				buf[len] = '\0';
+				const char* input_dir = buf + strlen(buf) + 1;
+				if (input_dir >= buf + len) {
+					input_dir = cfg->input_dirs[0];
 				}
 				//printf("(DEBUG) pipe read from worker = %s\n", buf);
 
 				int s = sscanf(buf, "%[^/]/%d", jobref, &jobapl);
 				if (s != 2) {
-					fprintf(stderr, "worker_process: sscanf: %d\n", s);
+					log_msg(LL_ERROR, "worker_process: sscanf: %d", s);
 				}
 
 				//printf("(DEBUG) in worker: jobref = %s\n", jobref);
 				//printf("(DEBUG) in worker: jobapl = %d\n", jobapl);
 				//printf("(DEBUG) worker sscanf success\n");
 
-				if (copy_all_files(input_dir, output_dir, jobref, jobapl) == -1) {
-					snprintf(buf, sizeof(buf), "%s/%d", jobref, jobapl);
-					//printf("(DEBUG) %s\n", buf);
-					write(ws->worker_pipes[i*2+1][1], buf, strlen(buf));
+				uint64_t start = now_ns();
+				worker_beat();
+				trace_event(TR_MOVE_START, jobref, jobapl, 0);
+				/* shared spool: only the holder of the lease moves the application */
+				int err = 0;
+				manifest_reset(&m);
+				if (cfg->instance[0] != '\0') {
+					err = lease_acquire(cfg->lease_dir, jobref, jobapl, cfg->lease_ttl_ms);
+					err = err == LEASE_BUSY ? 2 : err;
+				}
+				if (err == 0 && cfg->output_format == OUTPUT_FORMAT_PACK) {
+					err = pack_app(input_dir, output_dir, jobref, jobapl,
+							cfg->input_layout, cfg->durability, &m);
+					lease_release();
+				} else if (err == 0) {
+					err = cfg->input_layout == INPUT_LAYOUT_DIR
+							? move_app_dir(input_dir, output_dir, jobref, jobapl, fanout,
+									sync, &m)
+							: copy_all_files(input_dir, output_dir, jobref, jobapl, fanout,
+									sync, &m);
+					if (err == 0 && cfg->dedup != DEDUP_NONE) {
+						dedup_app(cfg, jobref, jobapl, &m, wst);
+					}
+					lease_release();
+				}
+				trace_event(TR_MOVE_END, jobref, jobapl, err == -1);
+				STAT_ADD(wst->files_moved, m.nfiles);
+				STAT_ADD(wst->bytes_moved, m.bytes);
+				if (err == -1) {
+					STAT_ADD(wst->failures, 1);
+				} else if (err >= 1) {
+					STAT_ADD(wst->skipped, 1);
 				} else {
-					snprintf(buf, sizeof(buf), "done");
-					//printf("(DEBUG) %s\n", buf);
-					write(ws->worker_pipes[i*2+1][1], buf, strlen(buf));
+					STAT_ADD(wst->apps_moved, 1);
+				}
+				STAT_ADD(wst->busy_ns, now_ns() - start);
+				STAT_SET(wst->throttled_ns, ratelimit_slept());
+
+				/* answer: header, then the names and sizes of the files moved */
+				ack.status = err;
+				ack.nfiles = m.nfiles;
+				ack.bytes = m.bytes;
+				ack.names_len = m.len;
+				int fd = ws->worker_pipes[i*2+1][1];
+				if (write_full(fd, &ack, sizeof(ack)) == -1
+						|| write_full(fd, m.names, m.len) == -1
+						|| write_full(fd, m.sizes, m.nfiles * sizeof(uint64_t)) == -1) {
+					log_perror("worker_process: write");
 				}
 				usleep(100);
 			}
-			write(STDOUT_FILENO, "Exiting from worker process...\n", 31);
+			manifest_free(&m);
+			trace_close();
+			log_msg(LL_INFO, "Exiting from worker process...");
 			exit(0);
 		}
 	}
@@ -494,40 +2476,84 @@ int main(int argc, char** argv) {
 	}
 	st_workers* ws = NULL;
 	pid_t pid_monitor, pid;
-	char input_dir[BUFMAX];
-	char output_dir[BUFMAX];
-	int num_workers = 0;
-	int interval_ms = 0;
+	st_config cfg = {0};
 
 	/* read config file and validate files */
-	read_config_file(argv[1], input_dir, output_dir,
-			&num_workers, &interval_ms);
+	config_file = argv[1];
+	if (read_config_file(config_file, &cfg) == -1) {
+		exit(1);
+	}
+	print_config(&cfg);
+	int num_workers = cfg.num_workers;
+	/* what a role that sets nothing goes back to on a reload */
+	prio_save();
+	dedup_init(cfg.dedup, cfg.dedup_dir, (uint64_t)cfg.dedup_min_kb * 1024);
+
+	/* first: the processes forked next log through it */
+	if (log_create(cfg.log_ring, cfg.log_level) == -1) {
+		die("log_create: could not create the log ring");
+	}
+	pid_drain = fork();
+	if (pid_drain == -1) {
+		die("fork:");
+	} else if (pid_drain == 0) {
+		log_drain_process(cfg.log_file, (uint64_t)cfg.log_max_mb * 1000000, cfg.log_keep);
+	}
+	log_role("parent");
+
+	stats = stats_create(cfg.stats_shm, num_workers, cfg.max_workers);
+	if (stats == NULL) {
+		die("stats_create: %s: could not create statistics segment", cfg.stats_shm);
+	}
+	if (ratelimit_create(&cfg.io, cfg.max_workers) == -1) {
+		die("ratelimit_create: could not create the rate limiter");
+	}
 
 	struct sigaction act;
 	sigaction_setup(&act);
 
+	/* the monitor tells the parent which spool directories to scan */
+	int notify_pipe[2];
+	if (pipe2(notify_pipe, O_NONBLOCK) == -1) {
+		die("pipe2:");
+	}
+
 	pid_monitor = create_monitor();
 	if (pid_monitor == -1) {
 		die("create_monitor: fork:");
 	}
 	else if (pid_monitor == 0) {
 		/* MONITOR */
-		monitor_process(input_dir, interval_ms);
+		prio_apply(0, &cfg.prio[ROLE_MONITOR]);
+		if (trace_open(cfg.trace_dir, "monitor", cfg.trace_events) == -1) {
+			log_msg(LL_WARN, "monitor: tracing disabled");
+		}
+		close(notify_pipe[0]);
+		monitor_process(&cfg, notify_pipe[1]);
 	}
 	else {
 		/* PARENT */
-		ws = st_workers_create(num_workers);
-		pid = create_workers(num_workers, ws);
+		close(notify_pipe[1]);
+		ws = st_workers_create(cfg.max_workers);
+		pid = create_workers(&cfg, ws);
 		if (pid == -1) {
 			cleanup(ws, num_workers, pid_monitor);
+			stats_destroy(stats, cfg.stats_shm);
 		}
 		else if (pid > 0) {
 			/* PARENT */
-			parent_process(input_dir, output_dir, ws, num_workers, pid_monitor);
+			prio_apply(0, &cfg.prio[ROLE_PARENT]);
+			if (trace_open(cfg.trace_dir, "parent", cfg.trace_events) == -1) {
+				log_msg(LL_WARN, "parent: tracing disabled");
+			}
+			parent_process(&cfg, ws, pid_monitor, notify_pipe[0]);
 		}
 		else {
 			/* WORKERS */
-			worker_process(input_dir, output_dir, ws, num_workers);
+			if (trace_open(cfg.trace_dir, "worker", cfg.trace_events) == -1) {
+				log_msg(LL_WARN, "worker: tracing disabled");
+			}
+			worker_process(&cfg, ws);
 		}
 	}
 	die("Filebot exited abnormally");
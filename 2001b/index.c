@@ -0,0 +1,365 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+
+/* count records of rec bytes at off lie within size, without overflow */
+static int index_fits(uint64_t off, uint64_t count, size_t rec, size_t size) {
+	return off <= size && count <= (size - off) / rec;
+}
+
+/**
+ * the ranges each record points to lie within the tables, and the strings
+ * end in the table: a damaged index is refused, not read out of bounds
+ */
+static int index_valid(const st_index* ix) {
+	const st_index_header* hdr = ix->hdr;
+	for (uint32_t j = 0; j < hdr->njobrefs; j++) {
+		const st_index_jobref* jr = &ix->jobrefs[j];
+		if (jr->first_app > hdr->napps || jr->napps > hdr->napps - jr->first_app) {
+			return 0;
+		}
+	}
+	for (uint32_t a = 0; a < hdr->napps; a++) {
+		const st_index_app* app = &ix->apps[a];
+		if (app->first_file > hdr->nfiles || app->nfiles > hdr->nfiles - app->first_file) {
+			return 0;
+		}
+	}
+	return hdr->strings_len == 0 || ix->strings[hdr->strings_len - 1] == '\0';
+}
+
+st_index* index_open(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(st_index_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	const st_index_header* hdr = map;
+	size_t size = sb.st_size;
+	if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION
+			|| !index_fits(hdr->jobrefs_off, hdr->njobrefs, sizeof(st_index_jobref), size)
+			|| !index_fits(hdr->apps_off, hdr->napps, sizeof(st_index_app), size)
+			|| !index_fits(hdr->files_off, hdr->nfiles, sizeof(st_index_file), size)
+			|| !index_fits(hdr->strings_off, hdr->strings_len, 1, size)) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	st_index* ix = (st_index*)malloc(sizeof(st_index));
+	if (ix == NULL) {
+		munmap(map, size);
+		return NULL;
+	}
+	ix->hdr = hdr;
+	ix->jobrefs = (const st_index_jobref*)((const char*)map + hdr->jobrefs_off);
+	ix->apps = (const st_index_app*)((const char*)map + hdr->apps_off);
+	ix->files = (const st_index_file*)((const char*)map + hdr->files_off);
+	ix->strings = (const char*)map + hdr->strings_off;
+	ix->size = size;
+	if (!index_valid(ix)) {
+		index_close(ix);
+		return NULL;
+	}
+	return ix;
+}
+
+void index_close(st_index* ix) {
+	if (ix != NULL) {
+		munmap((void*)ix->hdr, ix->size);
+		free(ix);
+	}
+}
+
+const char* index_str(const st_index* ix, uint32_t off) {
+	return off < ix->hdr->strings_len ? ix->strings + off : "";
+}
+
+/* binary search over the sorted job references */
+const st_index_jobref* index_find(const st_index* ix, const char* jobref) {
+	size_t lo = 0, hi = ix->hdr->njobrefs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(jobref, index_str(ix, ix->jobrefs[mid].name));
+		if (cmp == 0) {
+			return &ix->jobrefs[mid];
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/* binary search over the applications of one job reference */
+const st_index_app* index_find_app(const st_index* ix, const st_index_jobref* jr,
+		int jobapl) {
+	size_t lo = jr->first_app, hi = jr->first_app + jr->napps;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ix->apps[mid].jobapl == jobapl) {
+			return &ix->apps[mid];
+		}
+		if (jobapl < ix->apps[mid].jobapl) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+st_index_builder* index_builder_create(void) {
+	st_index_builder* b = (st_index_builder*)calloc(1, sizeof(st_index_builder));
+	if (b == NULL) {
+		die("calloc:");
+	}
+	b->jobrefs = vec_create(16);
+	return b;
+}
+
+void index_builder_destroy(st_index_builder* b) {
+	if (b == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < b->jobrefs->size; i++) {
+		free(b->jobrefs->items[i]);
+	}
+	vec_destroy(b->jobrefs);
+	free(b->entries);
+	manifest_free(&b->files);
+	free(b);
+}
+
+/* drop the entries, keep the memory */
+void index_builder_reset(st_index_builder* b) {
+	b->size = 0;
+	manifest_reset(&b->files);
+	b->dirty = 0;
+}
+
+void index_builder_add(st_index_builder* b, const char* jobref, int jobapl,
+		const st_manifest* m) {
+	if (b->size >= b->capacity) {
+		size_t new_capacity = b->capacity ? b->capacity * 2 : 64;
+		st_index_entry* new_entries = realloc(b->entries,
+				new_capacity * sizeof(st_index_entry));
+		if (new_entries == NULL) {
+			die("realloc:");
+		}
+		b->entries = new_entries;
+		b->capacity = new_capacity;
+	}
+
+	/* applications of the same job reference share one copy of its name */
+	char* name_copy = NULL;
+	for (size_t i = b->jobrefs->size; i > 0 && name_copy == NULL; i--) {
+		if (strcmp(b->jobrefs->items[i-1], jobref) == 0) {
+			name_copy = b->jobrefs->items[i-1];
+		}
+	}
+	if (name_copy == NULL) {
+		name_copy = strdup(jobref);
+		if (name_copy == NULL) {
+			die("strdup:");
+		}
+		vec_push(b->jobrefs, name_copy);
+	}
+
+	st_index_entry* e = &b->entries[b->size++];
+	e->jobref = name_copy;
+	e->jobapl = jobapl;
+	e->nfiles = m->nfiles;
+	e->bytes = m->bytes;
+	e->first_file = b->files.nfiles;
+	e->names_off = b->files.len;
+
+	const char* name = m->names;
+	for (uint32_t i = 0; i < m->nfiles; i++) {
+		manifest_add(&b->files, name, m->sizes[i]);
+		name += strlen(name) + 1;
+	}
+	b->dirty = 1;
+}
+
+/* keep the applications of a previous run */
+int index_builder_load(st_index_builder* b, const char* path) {
+	st_index* ix = index_open(path);
+	if (ix == NULL) {
+		return -1;
+	}
+
+	if ((int)ix->hdr->fanout != b->fanout) {
+		fprintf(stderr, "index_builder_load: %s: written with output_fanout = %u, "
+				"its applications are not moved\n", path, ix->hdr->fanout);
+	}
+
+	st_manifest m = {0};
+	for (uint32_t j = 0; j < ix->hdr->njobrefs; j++) {
+		const st_index_jobref* jr = &ix->jobrefs[j];
+		for (uint32_t a = jr->first_app; a < jr->first_app + jr->napps; a++) {
+			const st_index_app* app = &ix->apps[a];
+			manifest_reset(&m);
+			for (uint32_t f = app->first_file; f < app->first_file + app->nfiles; f++) {
+				manifest_add(&m, index_str(ix, ix->files[f].name), ix->files[f].size);
+			}
+			index_builder_add(b, index_str(ix, jr->name), app->jobapl, &m);
+		}
+	}
+	manifest_free(&m);
+	index_close(ix);
+	b->dirty = 0;
+	return 0;
+}
+
+static int cmp_entry(const void* x, const void* y) {
+	const st_index_entry* a = x;
+	const st_index_entry* b = y;
+	int cmp = strcmp(a->jobref, b->jobref);
+	if (cmp != 0) {
+		return cmp;
+	}
+	if (a->jobapl != b->jobapl) {
+		return (a->jobapl > b->jobapl) - (a->jobapl < b->jobapl);
+	}
+	return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+/* append a null terminated string to the string table, return its offset */
+static uint32_t strtab_add(st_manifest* strtab, const char* s) {
+	uint32_t off = strtab->len;
+	size_t n = strlen(s) + 1;
+	manifest_reserve(strtab, strtab->len + n);
+	memcpy(strtab->names + strtab->len, s, n);
+	strtab->len += n;
+	return off;
+}
+
+/**
+ * Write the whole index to path.tmp and rename it over path, so readers
+ * always map a complete file. Does nothing if no application was added
+ * since the last write.
+ *
+ * An application reported again (delivered again, or merged) replaces its
+ * entry: entries are added oldest first, the last one of each
+ * (jobref, jobapl) is kept.
+ */
+int index_builder_write(st_index_builder* b, const char* path) {
+	if (!b->dirty) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < b->size; i++) {
+		b->entries[i].seq = i;
+	}
+	qsort(b->entries, b->size, sizeof(st_index_entry), cmp_entry);
+	size_t n = 0;
+	for (size_t i = 0; i < b->size; i++) {
+		if (i + 1 < b->size && b->entries[i].jobapl == b->entries[i+1].jobapl
+				&& strcmp(b->entries[i].jobref, b->entries[i+1].jobref) == 0) {
+			continue;
+		}
+		b->entries[n++] = b->entries[i];
+	}
+	b->size = n;
+
+	size_t njobrefs = 0;
+	for (size_t i = 0; i < b->size; i++) {
+		if (i == 0 || strcmp(b->entries[i].jobref, b->entries[i-1].jobref) != 0) {
+			njobrefs++;
+		}
+	}
+
+	st_index_jobref* jobrefs = calloc(njobrefs ? njobrefs : 1, sizeof(st_index_jobref));
+	st_index_app* apps = calloc(b->size ? b->size : 1, sizeof(st_index_app));
+	st_index_file* files = calloc(b->files.nfiles ? b->files.nfiles : 1,
+			sizeof(st_index_file));
+	st_manifest strtab = {0};
+	if (jobrefs == NULL || apps == NULL || files == NULL) {
+		die("calloc:");
+	}
+
+	size_t j = 0, nfiles = 0;
+	for (size_t i = 0; i < b->size; i++) {
+		const st_index_entry* e = &b->entries[i];
+		if (i == 0 || strcmp(e->jobref, b->entries[i-1].jobref) != 0) {
+			if (i > 0) {
+				j++;
+			}
+			jobrefs[j].name = strtab_add(&strtab, e->jobref);
+			jobrefs[j].first_app = i;
+		}
+		jobrefs[j].napps++;
+
+		apps[i].jobapl = e->jobapl;
+		apps[i].first_file = nfiles;
+		apps[i].nfiles = e->nfiles;
+		apps[i].bytes = e->bytes;
+
+		const char* name = b->files.names + e->names_off;
+		for (uint32_t f = 0; f < e->nfiles; f++) {
+			files[nfiles].name = strtab_add(&strtab, name);
+			files[nfiles].size = b->files.sizes[e->first_file + f];
+			nfiles++;
+			name += strlen(name) + 1;
+		}
+	}
+
+	st_index_header hdr = {0};
+	hdr.magic = INDEX_MAGIC;
+	hdr.version = INDEX_VERSION;
+	hdr.njobrefs = njobrefs;
+	hdr.napps = b->size;
+	hdr.nfiles = nfiles;
+	hdr.fanout = b->fanout;
+	hdr.jobrefs_off = sizeof(hdr);
+	hdr.apps_off = hdr.jobrefs_off + njobrefs * sizeof(st_index_jobref);
+	hdr.files_off = hdr.apps_off + b->size * sizeof(st_index_app);
+	hdr.strings_off = hdr.files_off + nfiles * sizeof(st_index_file);
+	hdr.strings_len = strtab.len;
+
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int ret = -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("index_builder_write: open");
+	} else if (write_full(fd, &hdr, sizeof(hdr)) == -1
+			|| write_full(fd, jobrefs, njobrefs * sizeof(st_index_jobref)) == -1
+			|| write_full(fd, apps, b->size * sizeof(st_index_app)) == -1
+			|| write_full(fd, files, nfiles * sizeof(st_index_file)) == -1
+			|| write_full(fd, strtab.names, strtab.len) == -1) {
+		perror("index_builder_write: write");
+		close(fd);
+	} else if (close(fd) == -1 || rename(tmp, path) == -1) {
+		perror("index_builder_write: rename");
+	} else {
+		ret = 0;
+		b->dirty = 0;
+	}
+
+	free(jobrefs);
+	free(apps);
+	free(files);
+	manifest_free(&strtab);
+	return ret;
+}
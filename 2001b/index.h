@@ -0,0 +1,106 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define INDEX_FILE "report.idx"
+#define INDEX_MAGIC 0x58494246 /* "FBIX" */
+#define INDEX_VERSION 1
+
+/**
+ * Binary report index, meant to be mmap'ed and searched in place.
+ *
+ * header | jobrefs[njobrefs] | apps[napps] | files[nfiles] | strings
+ *
+ * jobrefs are sorted by name, so a job reference is found by binary
+ * search. The applications of one job reference are contiguous and sorted
+ * by jobapl, the files of one application are contiguous too. Names are
+ * offsets into the string table, null terminated. All offsets are from
+ * the start of the file, in native byte order.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t njobrefs;
+	uint32_t napps;
+	uint32_t nfiles;
+	uint32_t fanout;	/* output_fanout of the applications, see app_relpath(),
+				   (uint32_t)OUTPUT_FANOUT_PACK with output_format = pack */
+	uint64_t jobrefs_off;
+	uint64_t apps_off;
+	uint64_t files_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+} st_index_header;
+
+typedef struct {
+	uint32_t name;		/* string table offset */
+	uint32_t first_app;
+	uint32_t napps;
+	uint32_t reserved;
+} st_index_jobref;
+
+typedef struct {
+	int32_t jobapl;
+	uint32_t first_file;
+	uint32_t nfiles;
+	uint32_t reserved;
+	uint64_t bytes;
+} st_index_app;
+
+typedef struct {
+	uint32_t name;		/* string table offset */
+	uint32_t reserved;
+	uint64_t size;
+} st_index_file;
+
+/* reader: read-only mapping of an index file */
+typedef struct {
+	const st_index_header* hdr;
+	const st_index_jobref* jobrefs;
+	const st_index_app* apps;
+	const st_index_file* files;
+	const char* strings;
+	size_t size;
+} st_index;
+
+st_index* index_open(const char* path);
+void index_close(st_index* ix);
+const char* index_str(const st_index* ix, uint32_t off);
+const st_index_jobref* index_find(const st_index* ix, const char* jobref);
+const st_index_app* index_find_app(const st_index* ix, const st_index_jobref* jr,
+		int jobapl);
+
+/* writer: the parent collects applications and rewrites the file from time to time */
+typedef struct {
+	const char* jobref;	/* owned by st_index_builder.jobrefs */
+	int jobapl;
+	uint32_t nfiles;
+	uint64_t bytes;
+	size_t first_file;	/* into files.sizes */
+	size_t names_off;	/* into files.names */
+	size_t seq;		/* position before index_builder_write() sorts */
+} st_index_entry;
+
+typedef struct {
+	st_index_entry* entries;
+	Vec* jobrefs;		/* distinct job reference names */
+	size_t size;
+	size_t capacity;
+	st_manifest files;	/* names and sizes of the files of all entries */
+	int fanout;
+	int dirty;
+} st_index_builder;
+
+st_index_builder* index_builder_create(void);
+void index_builder_destroy(st_index_builder* b);
+void index_builder_reset(st_index_builder* b);
+int index_builder_load(st_index_builder* b, const char* path);
+void index_builder_add(st_index_builder* b, const char* jobref, int jobapl,
+		const st_manifest* m);
+int index_builder_write(st_index_builder* b, const char* path);
+
+#endif /* !INDEX_H */
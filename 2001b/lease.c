@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lease.h"
+#include "log.h"
+#include "util.h"
+
+static st_lease lease = { .fd = -1 };
+
+/* the name still refers to the file we locked */
+static int lease_named(void) {
+	struct stat sb;
+	return stat(lease.path, &sb) == 0 && sb.st_dev == lease.dev && sb.st_ino == lease.ino;
+}
+
+static void lease_path(char* path, size_t size, const char* dir, const char* jobref,
+		int jobapl) {
+	snprintf(path, size, "%s/%s.%d", dir, jobref, jobapl);
+}
+
+static int64_t silent_ms(const struct stat* sb) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec - sb->st_mtim.tv_sec) * 1000
+			+ (now.tv_nsec - sb->st_mtim.tv_nsec) / 1000000;
+}
+
+/**
+ * 1 if some instance holds the lease and was heard from within ttl_ms,
+ * without taking it: the parent skips such applications. A lease file
+ * that is left behind only delays the application to the worker.
+ */
+int lease_busy(const char* dir, const char* jobref, int jobapl, int ttl_ms) {
+	char path[1024];
+	lease_path(path, sizeof(path), dir, jobref, jobapl);
+	struct stat sb;
+	return stat(path, &sb) == 0 && silent_ms(&sb) < ttl_ms;
+}
+
+static int lease_touch(void) {
+	char owner[64];
+	int n = snprintf(owner, sizeof(owner), "%d\n", getpid());
+	if (ftruncate(lease.fd, 0) == -1 || pwrite(lease.fd, owner, n, 0) != n
+			|| futimens(lease.fd, NULL) == -1) {
+		log_perror("lease: touch");
+		return -1;
+	}
+	lease.touched_ns = now_ns();
+	return 0;
+}
+
+/**
+ * 0 if the lease is ours, LEASE_BUSY if another instance holds it and was
+ * heard from within ttl_ms, -1 on error.
+ */
+int lease_acquire(const char* dir, const char* jobref, int jobapl, int ttl_ms) {
+	lease_release();
+	lease_path(lease.path, sizeof(lease.path), dir, jobref, jobapl);
+	lease.ttl_ms = ttl_ms;
+
+	/* twice: the file may go away under us, released or stolen */
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int fd = open(lease.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			log_perror("lease_acquire: open");
+			return -1;
+		}
+		struct stat sb;
+		if (fstat(fd, &sb) == -1) {
+			log_perror("lease_acquire: fstat");
+			close(fd);
+			return -1;
+		}
+		lease.dev = sb.st_dev;
+		lease.ino = sb.st_ino;
+
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+			if (!lease_named()) {
+				/* released and unlinked between our open and flock */
+				close(fd);
+				continue;
+			}
+			lease.fd = fd;
+			if (lease_touch() == -1) {
+				lease_release();
+				return -1;
+			}
+			return 0;
+		}
+		if (errno != EWOULDBLOCK) {
+			log_perror("lease_acquire: flock");
+			close(fd);
+			return -1;
+		}
+
+		int64_t silent = silent_ms(&sb);
+		if (silent < ttl_ms) {
+			close(fd);
+			return LEASE_BUSY;
+		}
+
+		/* the holder is alive but hung: take the name away from it */
+		log_msg(LL_WARN, "lease_acquire: %s silent for %ld ms, stealing",
+				lease.path, (long)silent);
+		if (lease_named() && unlink(lease.path) == -1 && errno != ENOENT) {
+			log_perror("lease_acquire: unlink");
+		}
+		close(fd);
+	}
+	return LEASE_BUSY;
+}
+
+/**
+ * Call before each step of the work: -1 if the lease was stolen, else 0,
+ * refreshing the file every quarter of the ttl. Without a lease, 0.
+ */
+int lease_keep(void) {
+	if (lease.fd == -1) {
+		return 0;
+	}
+	if (!lease_named()) {
+		log_msg(LL_WARN, "lease_keep: %s was stolen", lease.path);
+		return -1;
+	}
+	if (now_ns() - lease.touched_ns > (uint64_t)lease.ttl_ms * 1000000 / 4) {
+		return lease_touch();
+	}
+	return 0;
+}
+
+/**
+ * In the parent, once the watchdog killed holder: unlink its lease, so
+ * that the application is not skipped as busy until the file goes silent.
+ * A holder stuck in the kernel keeps its lock, but on a name nobody uses.
+ * The lease is left alone if it names another owner, who stole it.
+ */
+void lease_break(const char* dir, const char* jobref, int jobapl, pid_t holder) {
+	char path[1024];
+	lease_path(path, sizeof(path), dir, jobref, jobapl);
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return;
+	}
+	int owner = 0;
+	int n = fscanf(file, "%d", &owner);
+	fclose(file);
+	if (n == 1 && owner == holder && unlink(path) == -1 && errno != ENOENT) {
+		log_perror("lease_break: unlink");
+	}
+}
+
+/* unlink before unlocking: a waiter never locks a released file */
+void lease_release(void) {
+	if (lease.fd == -1) {
+		return;
+	}
+	if (lease_named() && unlink(lease.path) == -1) {
+		log_perror("lease_release: unlink");
+	}
+	close(lease.fd);
+	lease.fd = -1;
+}
@@ -0,0 +1,37 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LEASE_DIR ".leases"	/* in output_dir, unless lease_dir is set */
+#define LEASE_TTL_MS_DEFAULT 30000
+#define LEASE_BUSY -2
+
+/**
+ * Lease of one application, so that several filebot instances can share a
+ * spool. A lease is the file <lease_dir>/<jobref>.<jobapl> locked with
+ * flock(): a holder that dies drops it with its last descriptor. The
+ * holder touches the file as it works; one silent for ttl_ms is taken to
+ * be hung and the lease is stolen by unlinking the name it holds. Before
+ * each rename the holder checks that the name is still its file, so a
+ * holder that wakes up after losing the lease stops there.
+ *
+ * A worker holds at most one lease at a time, kept in this process.
+ */
+typedef struct {
+	int fd;			/* -1: no lease held */
+	dev_t dev;
+	ino_t ino;
+	int ttl_ms;
+	uint64_t touched_ns;	/* CLOCK_MONOTONIC */
+	char path[1024];
+} st_lease;
+
+int lease_busy(const char* dir, const char* jobref, int jobapl, int ttl_ms);
+int lease_acquire(const char* dir, const char* jobref, int jobapl, int ttl_ms);
+int lease_keep(void);
+void lease_release(void);
+void lease_break(const char* dir, const char* jobref, int jobapl, pid_t holder);
+
+#endif /* !LEASE_H */
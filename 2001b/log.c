@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+#define LOG_BATCH_MAX 65536	/* bytes the drain writes at once */
+#define LOG_LINE_MAX (LOG_TEXT_MAX + 64)
+
+static const char* const level_names[] = { "error", "warn", "info", "debug" };
+
+/* the mapping, inherited by every process, and who this process is */
+static st_log_ring* ring = NULL;
+static char log_role_name[9] = "filebot";
+
+/* until the ring exists, e.g. for configuration errors */
+static int fallback_level = LL_INFO;
+
+int log_level_parse(const char* name) {
+	for (int i = LL_ERROR; i <= LL_DEBUG; i++) {
+		if (strcmp(name, level_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* log_level_name(int level) {
+	return level >= LL_ERROR && level <= LL_DEBUG ? level_names[level] : "?";
+}
+
+/**
+ * Create the ring before forking, capacity rounded up to a power of two.
+ * Until then, and in a process where it failed, messages go to stderr.
+ */
+int log_create(int capacity, int level) {
+	uint32_t n = 2;
+	while (n < (uint32_t)capacity && n < (1U << 20)) {
+		n <<= 1;
+	}
+	size_t size = sizeof(st_log_ring) + n * sizeof(st_log_record);
+	st_log_ring* map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("log_create: mmap");
+		return -1;
+	}
+
+	map->capacity = n;
+	map->level = level;
+	for (uint32_t i = 0; i < n; i++) {
+		map->records[i].seq = i;
+	}
+	fallback_level = level;
+	ring = map;
+	return 0;
+}
+
+/* called by each process after fork(), shown in its lines */
+void log_role(const char* role) {
+	snprintf(log_role_name, sizeof(log_role_name), "%s", role);
+}
+
+/* after a reload: every process filters with it from its next message */
+void log_set_level(int level) {
+	fallback_level = level;
+	if (ring != NULL) {
+		__atomic_store_n(&ring->level, level, __ATOMIC_RELAXED);
+	}
+}
+
+void log_vmsg(int level, const char* fmt, va_list ap) {
+	if (ring == NULL) {
+		if (level <= fallback_level) {
+			vfprintf(stderr, fmt, ap);
+			fputc('\n', stderr);
+		}
+		return;
+	}
+	if (level > __atomic_load_n(&ring->level, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	st_log_record* r;
+	for (;;) {
+		r = &ring->records[pos & (ring->capacity - 1)];
+		uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* the slot still holds the record of the previous lap */
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->pid = getpid();
+	r->level = level;
+	memcpy(r->role, log_role_name, sizeof(r->role));
+	int len = vsnprintf(r->text, sizeof(r->text), fmt, ap);
+	len = len < 0 ? 0 : len < (int)sizeof(r->text) ? len : (int)sizeof(r->text) - 1;
+	while (len > 0 && r->text[len - 1] == '\n') {
+		len--;
+	}
+	r->len = len;
+
+	/* fails only if the drain gave the slot up, see log_drain_process() */
+	uint64_t expected = pos;
+	__atomic_compare_exchange_n(&r->seq, &expected, pos + 1, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+void log_msg(int level, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	log_vmsg(level, fmt, ap);
+	va_end(ap);
+}
+
+/* perror() through the log */
+void log_perror(const char* s) {
+	log_msg(LL_ERROR, "%s: %s", s, strerror(errno));
+}
+
+/* the drain's output: a file it rotates, or stdout */
+typedef struct {
+	const char* path;
+	int fd;
+	uint64_t size;
+	uint64_t max_bytes;
+	int keep;
+	char buf[LOG_BATCH_MAX];
+	size_t len;
+	time_t sec;		/* of the cached timestamp */
+	char stamp[32];
+} st_log_out;
+
+static volatile sig_atomic_t drain_stop = 0;
+
+static void drain_signal(int signo) {
+	(void)signo;
+	drain_stop = 1;
+}
+
+static int out_open(st_log_out* out) {
+	if (out->path[0] == '\0') {
+		out->fd = STDOUT_FILENO;
+		return 0;
+	}
+	out->fd = open(out->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (out->fd == -1) {
+		fprintf(stderr, "log: %s: %s\n", out->path, strerror(errno));
+		out->fd = STDERR_FILENO;
+		return -1;
+	}
+	struct stat st;
+	out->size = fstat(out->fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+	return 0;
+}
+
+/* log.<keep-1> -> log.<keep> ... log -> log.1, the oldest one is lost */
+static void out_rotate(st_log_out* out) {
+	char from[PATH_MAX], to[PATH_MAX];
+	close(out->fd);
+	if (out->keep == 0) {
+		unlink(out->path);
+	}
+	for (int k = out->keep - 1; k >= 0; k--) {
+		if (k == 0) {
+			snprintf(from, sizeof(from), "%s", out->path);
+		} else {
+			snprintf(from, sizeof(from), "%s.%d", out->path, k);
+		}
+		snprintf(to, sizeof(to), "%s.%d", out->path, k + 1);
+		if (rename(from, to) == -1 && errno != ENOENT) {
+			fprintf(stderr, "log: rename %s: %s\n", from, strerror(errno));
+		}
+	}
+	out_open(out);
+}
+
+static void out_flush(st_log_out* out) {
+	if (out->len == 0) {
+		return;
+	}
+	if (out->fd != STDOUT_FILENO && out->fd != STDERR_FILENO && out->max_bytes > 0
+			&& out->size > 0 && out->size + out->len > out->max_bytes) {
+		out_rotate(out);
+	}
+	if (write_full(out->fd, out->buf, out->len) == -1) {
+		fprintf(stderr, "log: write: %s\n", strerror(errno));
+	}
+	out->size += out->len;
+	out->len = 0;
+}
+
+/* "2026-10-19 12:34:56.789 info worker[1234]: text" */
+static void out_line(st_log_out* out, uint64_t time_ns, int level, const char* role,
+		pid_t pid, const char* text, int len) {
+	if (out->len + LOG_LINE_MAX > sizeof(out->buf)) {
+		out_flush(out);
+	}
+	time_t sec = time_ns / 1000000000;
+	if (sec != out->sec || out->stamp[0] == '\0') {
+		struct tm tm;
+		localtime_r(&sec, &tm);
+		strftime(out->stamp, sizeof(out->stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		out->sec = sec;
+	}
+	int n = snprintf(out->buf + out->len, sizeof(out->buf) - out->len,
+			"%s.%03d %-5s %s[%d]: %.*s\n", out->stamp,
+			(int)(time_ns / 1000000 % 1000), log_level_name(level), role,
+			(int)pid, len, text);
+	if (n > 0) {
+		out->len += (size_t)n < sizeof(out->buf) - out->len ? (size_t)n
+				: sizeof(out->buf) - out->len - 1;
+	}
+}
+
+/**
+ * Copy out the records that are ready, as lines into out->buf. Returns how
+ * many were read; a slot reserved but not published since *stalled_ns is
+ * given up after LOG_STALL_MS, its process was most likely killed.
+ */
+static size_t drain_batch(st_log_out* out, uint64_t* stalled_ns) {
+	size_t count = 0;
+	uint64_t pos = ring->tail;
+	for (;;) {
+		st_log_record* r = &ring->records[pos & (ring->capacity - 1)];
+		uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos + 1) {
+			if (seq != pos || __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == pos) {
+				break;
+			}
+			uint64_t now = now_ns();
+			if (*stalled_ns == 0) {
+				*stalled_ns = now;
+			}
+			uint64_t expected = pos;
+			if (now - *stalled_ns < (uint64_t)LOG_STALL_MS * 1000000
+					|| !__atomic_compare_exchange_n(&r->seq, &expected,
+						pos + ring->capacity, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			*stalled_ns = 0;
+			pos++;
+			continue;
+		}
+		*stalled_ns = 0;
+
+		char role[sizeof(r->role) + 1];
+		memcpy(role, r->role, sizeof(r->role));
+		role[sizeof(r->role)] = '\0';
+		int len = r->len < sizeof(r->text) ? r->len : sizeof(r->text);
+		out_line(out, r->time_ns, r->level, role, r->pid, r->text, len);
+		__atomic_store_n(&r->seq, pos + ring->capacity, __ATOMIC_RELEASE);
+		pos++;
+		count++;
+	}
+	__atomic_store_n(&ring->tail, pos, __ATOMIC_RELAXED);
+	return count;
+}
+
+/**
+ * The drain process, forked before every other one: batches the records
+ * into one write() to path, or to stdout if it is "", and rotates the file
+ * past max_bytes (0: never), keeping keep old ones. Ctrl+C and SIGHUP are
+ * for the others: it empties the ring once SIGTERM comes or its parent is
+ * gone, then exits.
+ */
+void log_drain_process(const char* path, uint64_t max_bytes, int keep) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = drain_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGPIPE, &sa, NULL);
+
+	static st_log_out out;
+	out.path = path;
+	out.max_bytes = max_bytes;
+	out.keep = keep;
+	out_open(&out);
+
+	pid_t parent = getppid();
+	uint64_t reported = 0;
+	uint64_t stalled_ns = 0;
+	for (;;) {
+		int stop = drain_stop || getppid() != parent;
+		size_t n = drain_batch(&out, &stalled_ns);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			char text[64];
+			int len = snprintf(text, sizeof(text), "%lu messages dropped, log_ring is full",
+					dropped - reported);
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			out_line(&out, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, LL_WARN,
+					"log", getpid(), text, len);
+			reported = dropped;
+		}
+		out_flush(&out);
+
+		if (n == 0) {
+			if (stop) {
+				break;
+			}
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_MS * 1000000L };
+			nanosleep(&ts, NULL);
+		}
+	}
+	if (out.fd != STDOUT_FILENO && out.fd != STDERR_FILENO) {
+		close(out.fd);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* last thing the parent does: what is still in the ring gets written */
+void log_drain_stop(pid_t pid) {
+	if (pid <= 0) {
+		return;
+	}
+	if (kill(pid, SIGTERM) == -1) {
+		perror("log_drain_stop: kill");
+		return;
+	}
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+	}
+	/* anything logged from here goes to stderr */
+	ring = NULL;
+}
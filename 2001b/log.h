@@ -0,0 +1,66 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LOG_RING_DEFAULT 4096	/* records */
+#define LOG_KEEP_DEFAULT 5	/* rotated files kept */
+#define LOG_TEXT_MAX 216	/* longer messages are cut */
+#define LOG_DRAIN_MS 50		/* the drain sleeps this long on an empty ring */
+#define LOG_STALL_MS 1000	/* a slot reserved this long is given up */
+
+enum log_level {
+	LL_ERROR = 0,
+	LL_WARN,
+	LL_INFO,
+	LL_DEBUG,
+};
+
+/* one message, formatted in place by the process that logs it */
+typedef struct {
+	uint64_t seq;		/* turn of the slot, see st_log_ring */
+	uint64_t time_ns;	/* CLOCK_REALTIME */
+	pid_t pid;
+	uint16_t len;
+	uint8_t level;
+	char role[9];
+	char text[LOG_TEXT_MAX];
+} __attribute__((aligned(64))) st_log_record;
+
+/**
+ * Bounded ring of records shared by every process through a MAP_SHARED
+ * mapping made before fork(), drained by one process. The slot for
+ * position pos is free when its seq is pos and holds a record once seq is
+ * pos + 1. A producer takes the next position with a compare-and-swap on
+ * head, fills the slot and publishes it with another on seq; the drain
+ * reads the record at tail and hands the slot to the next lap with seq =
+ * pos + capacity. Nobody waits: a producer that finds the ring full drops
+ * its record and counts it. A slot reserved by a process that died before
+ * publishing it is skipped by the drain after LOG_STALL_MS.
+ */
+typedef struct {
+	uint64_t head;		/* next position a producer takes */
+	uint64_t dropped;	/* records lost to a full ring */
+	int level;		/* records above it are not even formatted */
+	uint32_t capacity;	/* power of two */
+	uint64_t tail __attribute__((aligned(64)));	/* next position to drain */
+	st_log_record records[];
+} st_log_ring;
+
+int log_level_parse(const char* name);
+const char* log_level_name(int level);
+
+int log_create(int capacity, int level);
+void log_role(const char* role);
+void log_set_level(int level);
+void log_vmsg(int level, const char* fmt, va_list ap);
+void log_msg(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_perror(const char* s);
+
+void log_drain_process(const char* path, uint64_t max_bytes, int keep)
+		__attribute__((noreturn));
+void log_drain_stop(pid_t pid);
+
+#endif /* !LOG_H */
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "util.h"
+
+#define PACK_COPY_CHUNK 65536
+
+static uint64_t align_up(uint64_t off) {
+	return (off + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+/* a footer and what it points to lie within the first size bytes */
+static int footer_valid(const unsigned char* map, uint64_t size, uint64_t off) {
+	if (off < sizeof(st_pack_header) || off % PACK_ALIGN != 0
+			|| off + sizeof(st_pack_footer) > size) {
+		return 0;
+	}
+	const st_pack_footer* f = (const st_pack_footer*)(map + off);
+	/* entries before the footer first: the sums below cannot wrap then */
+	if (f->magic != PACK_APP_MAGIC || f->prev >= off || f->entries >= off
+			|| f->entries % PACK_ALIGN != 0 || f->entries < sizeof(st_pack_header)) {
+		return 0;
+	}
+	uint64_t names = f->entries + (uint64_t)f->nfiles * sizeof(st_pack_entry);
+	if (names + f->names_len > off
+			|| (f->names_len > 0 && map[names + f->names_len - 1] != '\0')) {
+		return 0;
+	}
+	const st_pack_entry* e = (const st_pack_entry*)(map + f->entries);
+	for (uint32_t i = 0; i < f->nfiles; i++) {
+		if (e[i].name >= f->names_len || e[i].off > f->entries
+				|| e[i].size > f->entries - e[i].off) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Map the committed part of a pack and read its index, from the last
+ * application back to the first. Returns NULL if path is not a pack or
+ * is damaged.
+ */
+st_pack* pack_open(const char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	st_pack_header hdr;
+	struct stat sb;
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != PACK_MAGIC
+			|| hdr.version != PACK_VERSION || hdr.end < sizeof(hdr)
+			|| hdr.napps > (hdr.end - sizeof(hdr)) / sizeof(st_pack_footer)
+			|| fstat(fd, &sb) == -1 || (uint64_t)sb.st_size < hdr.end) {
+		close(fd);
+		return NULL;
+	}
+	void* map = mmap(NULL, hdr.end, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	st_pack* p = (st_pack*)malloc(sizeof(st_pack));
+	const st_pack_footer** apps = (const st_pack_footer**)malloc(
+			(hdr.napps > 0 ? hdr.napps : 1) * sizeof(st_pack_footer*));
+	if (p == NULL || apps == NULL) {
+		free(p);
+		free(apps);
+		munmap(map, hdr.end);
+		return NULL;
+	}
+
+	uint64_t off = hdr.last;
+	for (uint64_t i = hdr.napps; i > 0; i--) {
+		if (!footer_valid(map, hdr.end, off)) {
+			break;
+		}
+		apps[i - 1] = (const st_pack_footer*)((const unsigned char*)map + off);
+		off = apps[i - 1]->prev;
+		if (i == 1 && off == 0) {
+			off = hdr.end;	/* the whole chain is read */
+		}
+	}
+	if ((hdr.napps > 0 && off != hdr.end) || (hdr.napps == 0 && hdr.last != 0)) {
+		free(apps);
+		free(p);
+		munmap(map, hdr.end);
+		return NULL;
+	}
+
+	p->map = map;
+	p->size = hdr.end;
+	p->hdr = hdr;
+	p->apps = apps;
+	p->napps = hdr.napps;
+	return p;
+}
+
+void pack_close(st_pack* p) {
+	if (p != NULL) {
+		munmap((void*)p->map, p->size);
+		free(p->apps);
+		free(p);
+	}
+}
+
+/* the last delivery of jobapl, NULL if there is none */
+const st_pack_footer* pack_find(const st_pack* p, int jobapl) {
+	for (size_t i = p->napps; i > 0; i--) {
+		if (p->apps[i - 1]->jobapl == jobapl) {
+			return p->apps[i - 1];
+		}
+	}
+	return NULL;
+}
+
+const st_pack_entry* pack_entries(const st_pack* p, const st_pack_footer* app) {
+	return (const st_pack_entry*)(p->map + app->entries);
+}
+
+const char* pack_name(const st_pack* p, const st_pack_footer* app, const st_pack_entry* e) {
+	return (const char*)(p->map + app->entries + (uint64_t)app->nfiles * sizeof(st_pack_entry)
+			+ e->name);
+}
+
+const void* pack_data(const st_pack* p, const st_pack_entry* e) {
+	return p->map + e->off;
+}
+
+/**
+ * the committed length is in the file and the last footer lies within it,
+ * as pack_commit() left them; the rest of the chain is pack_open()'s
+ */
+static int chain_valid(int fd, const st_pack_header* hdr) {
+	struct stat sb;
+	if (hdr->end < sizeof(*hdr) || fstat(fd, &sb) == -1
+			|| (uint64_t)sb.st_size < hdr->end) {
+		return 0;
+	}
+	if (hdr->napps == 0) {
+		return hdr->last == 0;
+	}
+	st_pack_footer f;
+	if (hdr->last < sizeof(*hdr) || hdr->last % PACK_ALIGN != 0
+			|| hdr->last > hdr->end - sizeof(f)
+			|| pread(fd, &f, sizeof(f), hdr->last) != sizeof(f)) {
+		return 0;
+	}
+	return f.magic == PACK_APP_MAGIC && f.prev < hdr->last && f.entries < hdr->last;
+}
+
+/**
+ * Lock the pack, creating it if needed, and cut off an append that did
+ * not finish. The lock is held until pack_commit() or pack_abort(). A
+ * damaged pack is not appended to: the next commit would chain to it.
+ */
+int pack_begin(st_pack_writer* w, const char* path) {
+	w->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (w->fd == -1) {
+		perror("pack_begin: open");
+		return -1;
+	}
+	if (flock(w->fd, LOCK_EX) == -1) {
+		perror("pack_begin: flock");
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+
+	ssize_t n = pread(w->fd, &w->hdr, sizeof(w->hdr), 0);
+	if (n == 0) {
+		memset(&w->hdr, 0, sizeof(w->hdr));
+		w->hdr.magic = PACK_MAGIC;
+		w->hdr.version = PACK_VERSION;
+		w->hdr.end = sizeof(w->hdr);
+		n = pwrite(w->fd, &w->hdr, sizeof(w->hdr), 0);
+	}
+	if (n != sizeof(w->hdr) || w->hdr.magic != PACK_MAGIC
+			|| w->hdr.version != PACK_VERSION) {
+		fprintf(stderr, "pack_begin: %s: not a pack\n", path);
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+	if (!chain_valid(w->fd, &w->hdr)) {
+		fprintf(stderr, "pack_begin: %s: damaged, last application missing\n", path);
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+	if (ftruncate(w->fd, w->hdr.end) == -1) {
+		perror("pack_begin: ftruncate");
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+
+	w->pos = w->hdr.end;
+	w->nfiles = 0;
+	w->names_len = 0;
+	w->bytes = 0;
+	return 0;
+}
+
+/* pread/pwrite where copy_file_range() cannot, e.g. across filesystems */
+static ssize_t copy_plain(int in, int out, uint64_t out_off) {
+	static char buf[PACK_COPY_CHUNK];
+	uint64_t done = 0;
+	for (;;) {
+		ssize_t n = pread(in, buf, sizeof(buf), done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return n == 0 ? (ssize_t)done : -1;
+		}
+		for (ssize_t w = 0; w < n; ) {
+			ssize_t k = pwrite(out, buf + w, n - w, out_off + done + w);
+			if (k == -1 && errno != EINTR) {
+				return -1;
+			}
+			w += k > 0 ? k : 0;
+		}
+		done += n;
+	}
+}
+
+/**
+ * Append the content of fd as name. The kernel copies it, or shares the
+ * blocks where the filesystem can; size is a hint, the file is copied to
+ * its end.
+ */
+int pack_add(st_pack_writer* w, const char* name, int fd, uint64_t size) {
+	size_t len = strlen(name) + 1;
+	if (w->nfiles == w->capacity) {
+		size_t capacity = w->capacity > 0 ? 2 * w->capacity : 16;
+		st_pack_entry* entries = (st_pack_entry*)realloc(w->entries,
+				capacity * sizeof(st_pack_entry));
+		if (entries == NULL) {
+			perror("pack_add: realloc");
+			return -1;
+		}
+		w->entries = entries;
+		w->capacity = capacity;
+	}
+	if (w->names_len + len > w->names_capacity) {
+		size_t capacity = w->names_capacity > 0 ? 2 * w->names_capacity : 1024;
+		while (capacity < w->names_len + len) {
+			capacity *= 2;
+		}
+		char* names = (char*)realloc(w->names, capacity);
+		if (names == NULL) {
+			perror("pack_add: realloc");
+			return -1;
+		}
+		w->names = names;
+		w->names_capacity = capacity;
+	}
+
+	loff_t in_off = 0;
+	loff_t out_off = w->pos;
+	uint64_t done = 0;
+	for (;;) {
+		ssize_t n = copy_file_range(fd, &in_off, w->fd, &out_off,
+				size > done ? size - done : PACK_COPY_CHUNK, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && done == 0 && (errno == EXDEV || errno == ENOSYS
+				|| errno == EINVAL || errno == EOPNOTSUPP)) {
+			n = copy_plain(fd, w->fd, w->pos);
+			if (n == -1) {
+				perror("pack_add: copy");
+				return -1;
+			}
+			done = n;
+			break;
+		}
+		if (n == -1) {
+			perror("pack_add: copy_file_range");
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+
+	st_pack_entry* e = &w->entries[w->nfiles++];
+	memset(e, 0, sizeof(*e));
+	e->off = w->pos;
+	e->size = done;
+	e->name = w->names_len;
+	memcpy(w->names + w->names_len, name, len);
+	w->names_len += len;
+	w->pos += done;
+	w->bytes += done;
+	return 0;
+}
+
+/**
+ * Write the index and footer of the application, then the header that
+ * makes it part of the pack. PACK_SYNC_ORDERED syncs the data before the
+ * header, so that a header on disk never points to data that is not, and
+ * the header after it. The header fits in one sector and is rewritten in
+ * place, a power loss leaves the old one or the new. Releases the lock.
+ */
+int pack_commit(st_pack_writer* w, int jobapl, int sync) {
+	uint64_t entries = align_up(w->pos);
+	size_t entries_len = w->nfiles * sizeof(st_pack_entry);
+	size_t names_len = align_up(w->names_len);
+	st_pack_footer f = {
+		.magic = PACK_APP_MAGIC,
+		.jobapl = jobapl,
+		.nfiles = w->nfiles,
+		.names_len = w->names_len,
+		.entries = entries,
+		.prev = w->hdr.last,
+		.bytes = w->bytes,
+	};
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	f.published_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	size_t len = entries_len + names_len + sizeof(f);
+	char* buf = (char*)calloc(1, len);
+	if (buf == NULL) {
+		perror("pack_commit: calloc");
+		pack_abort(w);
+		return -1;
+	}
+	memcpy(buf, w->entries, entries_len);
+	memcpy(buf + entries_len, w->names, w->names_len);
+	memcpy(buf + entries_len + names_len, &f, sizeof(f));
+
+	int ret = -1;
+	if (lseek(w->fd, entries, SEEK_SET) == -1 || write_full(w->fd, buf, len) == -1) {
+		perror("pack_commit: write");
+	} else if (sync == PACK_SYNC_ORDERED && fdatasync(w->fd) == -1) {
+		perror("pack_commit: fdatasync");
+	} else {
+		/* until the header is written, an abort cuts back to the old end */
+		st_pack_header hdr = w->hdr;
+		hdr.last = entries + entries_len + names_len;
+		hdr.end = entries + len;
+		hdr.napps++;
+		if (pwrite(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			perror("pack_commit: header");
+		} else {
+			/* written, if not yet synced: the file holds the new end now */
+			w->hdr = hdr;
+			if (sync == PACK_SYNC_ORDERED && fdatasync(w->fd) == -1) {
+				perror("pack_commit: fdatasync");
+			} else {
+				ret = 0;
+			}
+		}
+	}
+	free(buf);
+	if (ret == -1) {
+		pack_abort(w);
+		return -1;
+	}
+	close(w->fd);
+	w->fd = -1;
+	return 0;
+}
+
+/* forget the application being appended, release the lock */
+void pack_abort(st_pack_writer* w) {
+	if (w->fd == -1) {
+		return;
+	}
+	/* the next writer cuts it off anyway */
+	if (ftruncate(w->fd, w->hdr.end) == -1) {
+		perror("pack_abort: ftruncate");
+	}
+	close(w->fd);
+	w->fd = -1;
+}
+
+void pack_writer_free(st_pack_writer* w) {
+	pack_abort(w);
+	free(w->entries);
+	free(w->names);
+	memset(w, 0, sizeof(*w));
+	w->fd = -1;
+}
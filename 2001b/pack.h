@@ -0,0 +1,107 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_SUFFIX ".pack"	/* output_dir/<jobref>.pack */
+#define PACK_MAGIC 0x4B504246	/* "FBPK" */
+#define PACK_APP_MAGIC 0x41504246	/* "FBPA" */
+#define PACK_VERSION 1
+#define PACK_ALIGN 8
+
+/* what pack_commit() waits for */
+enum pack_sync {
+	PACK_SYNC_NONE = 0,
+	PACK_SYNC_ORDERED,	/* the data on disk, then the header, before it returns */
+};
+
+/* how a worker publishes an application */
+enum output_format {
+	OUTPUT_FORMAT_DIR = 0,	/* output_dir/jobref/Application_N/ */
+	OUTPUT_FORMAT_PACK,	/* appended to output_dir/jobref.pack */
+};
+
+/**
+ * Pack file: the applications of one job reference appended one after
+ * the other, meant to be mmap'ed and read in place.
+ *
+ * header | app | app | ...
+ * app: data of each file | entries[nfiles] | names | footer
+ *
+ * Each application ends with a footer pointing to its entries and to the
+ * footer of the application before it, so the index of a pack is read
+ * from its end. The header holds the committed length: an append is
+ * written past it and becomes part of the pack only when the header is
+ * updated. What lies past `end` is an append that did not finish, cut off
+ * by the next writer; a header whose last footer is missing, e.g. synced
+ * before its data, is refused rather than appended to. Writers take an
+ * exclusive flock() on the file; readers need no lock, a pack only grows.
+ * Offsets are from the start of the file, in native byte order; entries
+ * and footers are PACK_ALIGN aligned.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t end;		/* committed length */
+	uint64_t last;		/* footer of the last application, 0: none */
+	uint64_t napps;
+	uint64_t reserved[4];
+} st_pack_header;
+
+/* one file of an application */
+typedef struct {
+	uint64_t off;		/* of its data */
+	uint64_t size;
+	uint32_t name;		/* offset of its name in the names of the application */
+	uint32_t reserved;
+} st_pack_entry;
+
+typedef struct {
+	uint32_t magic;		/* PACK_APP_MAGIC */
+	int32_t jobapl;
+	uint32_t nfiles;
+	uint32_t names_len;	/* null terminated names after the entries */
+	uint64_t entries;	/* offset of entries[0] */
+	uint64_t prev;		/* footer of the application before, 0: first */
+	uint64_t published_ns;	/* CLOCK_REALTIME */
+	uint64_t bytes;
+} st_pack_footer;
+
+/* reader: read-only mapping of a pack, applications oldest first */
+typedef struct {
+	const unsigned char* map;
+	size_t size;		/* the committed length when opened */
+	st_pack_header hdr;	/* as it was then, writers update the mapped one */
+	const st_pack_footer** apps;
+	size_t napps;
+} st_pack;
+
+st_pack* pack_open(const char* path);
+void pack_close(st_pack* p);
+const st_pack_footer* pack_find(const st_pack* p, int jobapl);
+const st_pack_entry* pack_entries(const st_pack* p, const st_pack_footer* app);
+const char* pack_name(const st_pack* p, const st_pack_footer* app, const st_pack_entry* e);
+const void* pack_data(const st_pack* p, const st_pack_entry* e);
+
+/* writer: one application at a time, under the lock of the pack */
+typedef struct {
+	int fd;
+	st_pack_header hdr;
+	uint64_t pos;		/* where the next data goes */
+	st_pack_entry* entries;
+	size_t nfiles;
+	size_t capacity;
+	char* names;
+	size_t names_len;
+	size_t names_capacity;
+	uint64_t bytes;
+} st_pack_writer;
+
+int pack_begin(st_pack_writer* w, const char* path);
+int pack_add(st_pack_writer* w, const char* name, int fd, uint64_t size);
+int pack_commit(st_pack_writer* w, int jobapl, int sync);	/* enum pack_sync */
+void pack_abort(st_pack_writer* w);
+void pack_writer_free(st_pack_writer* w);
+
+#endif /* !PACK_H */
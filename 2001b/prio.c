@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "prio.h"
+
+/* <linux/ioprio.h> is missing from older headers */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_VALUE(class, level) (((class) << IOPRIO_CLASS_SHIFT) | (level))
+
+static const char* const role_names[] = { "parent", "monitor", "worker" };
+static const char* const sched_names[] = { "inherit", "other", "batch", "idle" };
+
+/* settings filebot was started with, what a role that sets nothing gets */
+static st_prio saved;
+static cpu_set_t saved_cpus;
+static int saved_policy = SCHED_OTHER;
+
+void prio_init(st_prio* roles) {
+	for (int i = 0; i < ROLES; i++) {
+		memset(&roles[i], 0, sizeof(st_prio));
+		roles[i].ioprio = PRIO_IOPRIO_INHERIT;
+	}
+}
+
+/* "0-3,8,10-11" */
+static int parse_cpus(const char* value, uint64_t* set) {
+	memset(set, 0, PRIO_CPUS_MAX / 8);
+	int count = 0;
+	const char* p = value;
+	while (*p != '\0') {
+		char* end;
+		long lo = strtol(p, &end, 10);
+		long hi = lo;
+		if (end == p || lo < 0) {
+			return -1;
+		}
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo) {
+				return -1;
+			}
+		}
+		if (hi >= PRIO_CPUS_MAX) {
+			return -1;
+		}
+		for (long cpu = lo; cpu <= hi; cpu++) {
+			set[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+			count++;
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		p = end;
+	}
+	return count > 0 ? 0 : -1;
+}
+
+/* "rt:0" to "rt:7", "be:0" to "be:7", "idle" */
+static int parse_ioprio(const char* value) {
+	if (strcmp(value, "idle") == 0) {
+		return IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+	}
+	int class;
+	if (strncmp(value, "rt:", 3) == 0) {
+		class = IOPRIO_CLASS_RT;
+	} else if (strncmp(value, "be:", 3) == 0) {
+		class = IOPRIO_CLASS_BE;
+	} else {
+		return -1;
+	}
+	if (value[3] < '0' || value[3] > '7' || value[4] != '\0') {
+		return -1;
+	}
+	return IOPRIO_VALUE(class, value[3] - '0');
+}
+
+/**
+ * Parse <role>_cpus, <role>_nice, <role>_sched or <role>_ioprio into
+ * roles. Returns 1 if it was one of them, 0 if key is not, -1 if value is
+ * invalid.
+ */
+int prio_config(st_prio* roles, const char* key, const char* value) {
+	st_prio* p = NULL;
+	const char* what = NULL;
+	for (int i = 0; i < ROLES; i++) {
+		size_t n = strlen(role_names[i]);
+		if (strncmp(key, role_names[i], n) == 0 && key[n] == '_') {
+			p = &roles[i];
+			what = key + n + 1;
+		}
+	}
+	if (p == NULL) {
+		return 0;
+	}
+
+	if (strcmp(what, "cpus") == 0) {
+		if (parse_cpus(value, p->cpus) == -1) {
+			return -1;
+		}
+		p->has_cpus = 1;
+		snprintf(p->cpus_str, sizeof(p->cpus_str), "%s", value);
+	} else if (strcmp(what, "nice") == 0) {
+		char* end;
+		long nice = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || nice < -20 || nice > 19) {
+			return -1;
+		}
+		p->nice = nice;
+		p->has_nice = 1;
+	} else if (strcmp(what, "sched") == 0) {
+		p->sched = -1;
+		for (int i = PRIO_SCHED_OTHER; i <= PRIO_SCHED_IDLE; i++) {
+			if (strcmp(value, sched_names[i]) == 0) {
+				p->sched = i;
+			}
+		}
+		if (p->sched == -1) {
+			return -1;
+		}
+	} else if (strcmp(what, "ioprio") == 0) {
+		p->ioprio = parse_ioprio(value);
+		if (p->ioprio == -1) {
+			return -1;
+		}
+		snprintf(p->ioprio_str, sizeof(p->ioprio_str), "%s", value);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+void prio_print(const st_prio* roles) {
+	for (int i = 0; i < ROLES; i++) {
+		const st_prio* p = &roles[i];
+		if (p->has_cpus) {
+			printf("%s_cpus = %s\n", role_names[i], p->cpus_str);
+		}
+		if (p->has_nice) {
+			printf("%s_nice = %d\n", role_names[i], p->nice);
+		}
+		if (p->sched != PRIO_SCHED_INHERIT) {
+			printf("%s_sched = %s\n", role_names[i], sched_names[p->sched]);
+		}
+		if (p->ioprio != PRIO_IOPRIO_INHERIT) {
+			printf("%s_ioprio = %s\n", role_names[i], p->ioprio_str);
+		}
+	}
+}
+
+/* before any role is applied: what filebot was started with */
+void prio_save(void) {
+	saved.has_cpus = sched_getaffinity(0, sizeof(cpu_set_t), &saved_cpus) == 0;
+	errno = 0;
+	saved.nice = getpriority(PRIO_PROCESS, 0);
+	saved.has_nice = errno == 0;
+	saved_policy = sched_getscheduler(0);
+	saved.ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+}
+
+/* a setting refused for want of privilege is a warning, filebot runs on */
+static void prio_perror(const char* s) {
+	log_msg(errno == EPERM || errno == EACCES ? LL_WARN : LL_ERROR, "%s: %s", s,
+			strerror(errno));
+}
+
+/**
+ * Apply p to process pid (0: this one), what p does not set goes back to
+ * the saved settings. Each setting is tried even if another fails, e.g. a
+ * negative nice or ioprio rt without the privilege. Returns -1 if one
+ * failed.
+ */
+int prio_apply(pid_t pid, const st_prio* p) {
+	int ret = 0;
+
+	cpu_set_t cpus = saved_cpus;
+	if (p->has_cpus) {
+		CPU_ZERO(&cpus);
+		for (int cpu = 0; cpu < PRIO_CPUS_MAX; cpu++) {
+			if (p->cpus[cpu / 64] & (uint64_t)1 << (cpu % 64)) {
+				CPU_SET(cpu, &cpus);
+			}
+		}
+	}
+	if ((p->has_cpus || saved.has_cpus)
+			&& sched_setaffinity(pid, sizeof(cpu_set_t), &cpus) == -1) {
+		prio_perror("prio_apply: sched_setaffinity");
+		ret = -1;
+	}
+
+	int policy = p->sched == PRIO_SCHED_BATCH ? SCHED_BATCH
+			: p->sched == PRIO_SCHED_IDLE ? SCHED_IDLE
+			: p->sched == PRIO_SCHED_OTHER ? SCHED_OTHER
+			: saved_policy;
+	/* the real-time classes are not for filebot, keep them as they are */
+	if (policy == SCHED_OTHER || policy == SCHED_BATCH || policy == SCHED_IDLE) {
+		struct sched_param sp = { .sched_priority = 0 };
+		if (sched_setscheduler(pid, policy, &sp) == -1) {
+			prio_perror("prio_apply: sched_setscheduler");
+			ret = -1;
+		}
+	}
+
+	/* after the class: a nice value is kept across the change */
+	int has_nice = p->has_nice || saved.has_nice;
+	if (has_nice && setpriority(PRIO_PROCESS, pid,
+			p->has_nice ? p->nice : saved.nice) == -1) {
+		prio_perror("prio_apply: setpriority");
+		ret = -1;
+	}
+
+	int ioprio = p->ioprio != PRIO_IOPRIO_INHERIT ? p->ioprio : saved.ioprio;
+	if (ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio) == -1) {
+		prio_perror("prio_apply: ioprio_set");
+		ret = -1;
+	}
+	return ret;
+}
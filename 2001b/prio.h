@@ -0,0 +1,49 @@
+#ifndef PRIO_H
+#define PRIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* the processes filebot is made of, each with its own settings */
+enum prio_role {
+	ROLE_PARENT = 0,
+	ROLE_MONITOR,
+	ROLE_WORKER,
+	ROLES,
+};
+
+/* CPU scheduling class, PRIO_SCHED_INHERIT: as filebot was started */
+enum prio_sched {
+	PRIO_SCHED_INHERIT = 0,
+	PRIO_SCHED_OTHER,
+	PRIO_SCHED_BATCH,
+	PRIO_SCHED_IDLE,
+};
+
+#define PRIO_IOPRIO_INHERIT -1
+#define PRIO_CPUS_MAX 1024	/* CPU_SETSIZE, <sched.h> clashes with queue.h */
+
+/**
+ * CPU and I/O footprint of one role, from the <role>_cpus, <role>_nice,
+ * <role>_sched and <role>_ioprio keys. What is not set stays as filebot
+ * was started, also for a worker forked by a parent whose own settings
+ * differ.
+ */
+typedef struct {
+	uint64_t cpus[PRIO_CPUS_MAX / 64];	/* bit n: CPU n */
+	int has_cpus;
+	int nice;
+	int has_nice;
+	int sched;		/* enum prio_sched */
+	int ioprio;		/* ioprio_set() value, PRIO_IOPRIO_INHERIT */
+	char cpus_str[128];	/* as configured, for printing */
+	char ioprio_str[16];
+} st_prio;
+
+void prio_init(st_prio* roles);
+int prio_config(st_prio* roles, const char* key, const char* value);
+void prio_print(const st_prio* roles);
+void prio_save(void);
+int prio_apply(pid_t pid, const st_prio* p);
+
+#endif /* !PRIO_H */
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.h"
+#include "util.h"
+
+st_job* job_create(const char* jobref, int jobapl, const char* dir, uint64_t arrival_ns,
+		uint64_t bytes) {
+	int len = snprintf(NULL, 0, "%s/%d", jobref, jobapl);
+	size_t dir_len = strlen(dir);
+	st_job* job = (st_job*)malloc(sizeof(st_job) + len + 1 + dir_len + 1);
+	if (job == NULL) {
+		return NULL;
+	}
+	job->arrival_ns = arrival_ns;
+	job->bytes = bytes;
+	job->key = 0;
+	job->seq = 0;
+	snprintf(job->name, len + 1, "%s/%d", jobref, jobapl);
+	memcpy(job->name + len + 1, dir, dir_len + 1);
+	return job;
+}
+
+const char* job_dir(const st_job* job) {
+	return job->name + strlen(job->name) + 1;
+}
+
+/* name and directory with their null terminators, as sent to the worker */
+size_t job_msg_len(const st_job* job) {
+	const char* dir = job_dir(job);
+	return dir + strlen(dir) + 1 - job->name;
+}
+
+void queue_init(st_queue* q, int policy, double aging_mb_per_s) {
+	q->heap = NULL;		/* grown by the first push */
+	q->size = 0;
+	q->capacity = 0;
+	q->policy = policy;
+	q->aging = aging_mb_per_s * 1e6;
+	q->seq = 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	q->epoch_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* frees the queued jobs and the heap, not q itself */
+void queue_free(st_queue* q) {
+	for (size_t i = 0; i < q->size; i++) {
+		free(q->heap[i]);
+	}
+	free(q->heap);
+	q->heap = NULL;
+	q->size = q->capacity = 0;
+}
+
+static int job_before(const st_job* a, const st_job* b) {
+	return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static void swap(st_job** heap, size_t i, size_t j) {
+	st_job* tmp = heap[i];
+	heap[i] = heap[j];
+	heap[j] = tmp;
+}
+
+/**
+ * The key is set on the first push only: a job that failed and is pushed
+ * again keeps its place.
+ */
+void queue_push(st_queue* q, st_job* job) {
+	if (job->seq == 0) {
+		job->seq = ++q->seq;
+		double waited_s = ((double)job->arrival_ns - (double)q->epoch_ns) / 1e9;
+		switch (q->policy) {
+		case SCHED_FIFO:
+			job->key = waited_s;
+			break;
+		case SCHED_SJF:
+			job->key = (double)job->bytes + q->aging * waited_s;
+			break;
+		default:
+			job->key = (double)job->seq;
+			break;
+		}
+	}
+
+	if (q->size >= q->capacity) {
+		size_t new_capacity = q->capacity ? q->capacity * 2 : 64;
+		st_job** new_heap = realloc(q->heap, new_capacity * sizeof(st_job*));
+		if (new_heap == NULL) {
+			die("realloc:");
+		}
+		q->heap = new_heap;
+		q->capacity = new_capacity;
+	}
+
+	size_t i = q->size++;
+	q->heap[i] = job;
+	while (i > 0 && job_before(q->heap[i], q->heap[(i - 1) / 2])) {
+		swap(q->heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/* NULL if the queue is empty */
+st_job* queue_pop(st_queue* q) {
+	if (q->size == 0) {
+		return NULL;
+	}
+	st_job* top = q->heap[0];
+	q->heap[0] = q->heap[--q->size];
+
+	size_t i = 0;
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, min = i;
+		if (l < q->size && job_before(q->heap[l], q->heap[min])) {
+			min = l;
+		}
+		if (r < q->size && job_before(q->heap[r], q->heap[min])) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+		swap(q->heap, i, min);
+		i = min;
+	}
+	return top;
+}
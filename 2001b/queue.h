@@ -0,0 +1,57 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHED_AGING_DEFAULT 10	/* MB/s, see SCHED_SJF */
+
+/* order in which queued applications are dispatched */
+enum sched_policy {
+	SCHED_READDIR = 0,	/* as scan_dir() finds them */
+	SCHED_FIFO,		/* by arrival: ctime of the candidate data */
+	SCHED_SJF,		/* smallest total bytes first, with aging */
+};
+
+/**
+ * One queued application. The name, "jobref/jobapl", is followed by the
+ * spool directory the application is in, each null terminated: both are
+ * what the worker receives. They are allocated with the job, so free()
+ * releases everything.
+ */
+typedef struct st_job {
+	uint64_t arrival_ns;	/* CLOCK_REALTIME */
+	uint64_t bytes;		/* total size of its files, SCHED_SJF only */
+	double key;		/* smallest first, set by queue_push() */
+	uint64_t seq;		/* push order, breaks ties */
+	char name[];
+} st_job;
+
+/**
+ * Binary min-heap of jobs. With SCHED_SJF a job is ranked by its bytes
+ * minus `aging` bytes per second it has waited; as every job ages at the
+ * same rate, bytes + aging * arrival ranks them the same at any time and
+ * the key never has to be updated. A job of B bytes waits at most
+ * B / aging seconds behind smaller ones arriving after it.
+ */
+typedef struct {
+	st_job** heap;
+	size_t size;
+	size_t capacity;
+	int policy;
+	double aging;		/* bytes per second of waiting */
+	uint64_t epoch_ns;	/* arrival times are taken from here */
+	uint64_t seq;
+} st_queue;
+
+st_job* job_create(const char* jobref, int jobapl, const char* dir, uint64_t arrival_ns,
+		uint64_t bytes);
+const char* job_dir(const st_job* job);
+size_t job_msg_len(const st_job* job);
+
+void queue_init(st_queue* q, int policy, double aging_mb_per_s);
+void queue_free(st_queue* q);
+void queue_push(st_queue* q, st_job* job);
+st_job* queue_pop(st_queue* q);
+
+#endif /* !QUEUE_H */
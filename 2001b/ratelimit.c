@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "log.h"
+#include "ratelimit.h"
+#include "util.h"
+
+/* the mapping, inherited by every worker, and the worker this process is */
+static st_ratelimit* rl = NULL;
+static size_t rl_size = 0;
+static int rl_worker = -1;
+static uint64_t* rl_heartbeat = NULL;
+static uint64_t rl_slept_ns = 0;
+
+/* set while the workers may be using the bucket: no torn doubles */
+static void bucket_set(st_bucket* b, double rate, int burst_ms) {
+	__atomic_store(&b->rate, &rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->burst_ns, (uint64_t)burst_ms * 1000000, __ATOMIC_RELAXED);
+}
+
+static int rates_set(const st_rates* r) {
+	return r->bytes > 0 || r->ops > 0 || r->worker_bytes > 0 || r->worker_ops > 0;
+}
+
+/**
+ * Create the limiter before forking, with buckets for max_workers. It is
+ * mapped even when every rate is 0, so that a reload can set them; the
+ * other functions then return at once.
+ */
+int ratelimit_create(const st_rates* r, int max_workers) {
+	rl_size = sizeof(st_ratelimit) + 2 * max_workers * sizeof(st_bucket);
+	st_ratelimit* map = mmap(NULL, rl_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		log_perror("ratelimit_create: mmap");
+		return -1;
+	}
+
+	/* a fresh anonymous mapping is zeroed: every bucket is full */
+	map->scale = RATE_SCALE_ONE;
+	map->num_workers = max_workers;
+	rl = map;
+	ratelimit_update(r);
+	return 0;
+}
+
+/**
+ * Apply new rates, in the parent after a reload. The workers see them on
+ * their next take; what they reserved at the old rates stays reserved.
+ */
+void ratelimit_update(const st_rates* r) {
+	if (rl == NULL) {
+		return;
+	}
+	__atomic_store_n(&rl->latency_ns, (uint64_t)r->latency_ms * 1000000, __ATOMIC_RELAXED);
+	bucket_set(&rl->bytes, r->bytes, r->burst_ms);
+	bucket_set(&rl->ops, r->ops, r->burst_ms);
+	for (int i = 0; i < rl->num_workers; i++) {
+		bucket_set(&rl->workers[2 * i], r->worker_bytes, r->burst_ms);
+		bucket_set(&rl->workers[2 * i + 1], r->worker_ops, r->burst_ms);
+	}
+	__atomic_store_n(&rl->limited, rates_set(r), __ATOMIC_RELAXED);
+}
+
+void ratelimit_destroy(void) {
+	if (rl != NULL) {
+		munmap(rl, rl_size);
+		rl = NULL;
+	}
+}
+
+/**
+ * called by each worker after fork(): its own buckets, and the heartbeat
+ * the watchdog reads, moved past each wait so that a throttled worker is
+ * not taken for a hung one
+ */
+void ratelimit_worker(int worker, uint64_t* heartbeat) {
+	rl_worker = worker;
+	rl_heartbeat = heartbeat;
+}
+
+/* reserve n units, the wait in ns before they may be used */
+static uint64_t bucket_take(st_bucket* b, uint64_t n, uint64_t scale, uint64_t now) {
+	double rate;
+	__atomic_load(&b->rate, &rate, __ATOMIC_RELAXED);
+	if (rate <= 0 || n == 0) {
+		return 0;
+	}
+	uint64_t cost = (uint64_t)((double)n * 1e9 * RATE_SCALE_ONE / (rate * scale));
+	uint64_t burst_ns = __atomic_load_n(&b->burst_ns, __ATOMIC_RELAXED);
+
+	uint64_t tat = __atomic_load_n(&b->tat_ns, __ATOMIC_RELAXED);
+	uint64_t next;
+	do {
+		next = (tat > now ? tat : now) + cost;
+	} while (!__atomic_compare_exchange_n(&b->tat_ns, &tat, next, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return next > now + burst_ns ? next - now - burst_ns : 0;
+}
+
+/**
+ * Account bytes and ops without waiting, for work already done whose size
+ * was not known before: the next ratelimit_take() pays for it. Returns the
+ * time the caller is behind, in ns.
+ */
+uint64_t ratelimit_charge(uint64_t bytes, uint64_t ops) {
+	if (rl == NULL || !__atomic_load_n(&rl->limited, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	uint64_t now = now_ns();
+	uint64_t scale = __atomic_load_n(&rl->scale, __ATOMIC_RELAXED);
+
+	uint64_t wait = bucket_take(&rl->bytes, bytes, scale, now);
+	uint64_t w = bucket_take(&rl->ops, ops, scale, now);
+	wait = w > wait ? w : wait;
+	if (rl_worker >= 0 && rl_worker < rl->num_workers) {
+		w = bucket_take(&rl->workers[2 * rl_worker], bytes, RATE_SCALE_ONE, now);
+		wait = w > wait ? w : wait;
+		w = bucket_take(&rl->workers[2 * rl_worker + 1], ops, RATE_SCALE_ONE, now);
+		wait = w > wait ? w : wait;
+	}
+	return wait;
+}
+
+/* wait until bytes and ops may be used, returns the time slept in ns */
+uint64_t ratelimit_take(uint64_t bytes, uint64_t ops) {
+	uint64_t wait = ratelimit_charge(bytes, ops);
+	if (wait == 0) {
+		return 0;
+	}
+
+	if (rl_heartbeat != NULL) {
+		__atomic_store_n(rl_heartbeat, now_ns() + wait, __ATOMIC_RELAXED);
+	}
+	struct timespec ts = {
+		.tv_sec = wait / 1000000000,
+		.tv_nsec = wait % 1000000000,
+	};
+	/* a signal ends the wait: terminate is checked by the caller */
+	if (nanosleep(&ts, NULL) == -1 && errno != EINTR) {
+		log_perror("ratelimit_take: nanosleep");
+	}
+	rl_slept_ns += wait;
+	return wait;
+}
+
+/* time this process spent in ratelimit_take() */
+uint64_t ratelimit_slept(void) {
+	return rl_slept_ns;
+}
+
+/**
+ * Feed back how long one rename or sync took. Slower than latency_ns:
+ * halve the global rates, once per latency_ns so that a burst of slow
+ * operations counts once. Faster: win back 1/64 of the full rate.
+ */
+void ratelimit_observe(uint64_t latency_ns) {
+	uint64_t target = rl == NULL ? 0 : __atomic_load_n(&rl->latency_ns, __ATOMIC_RELAXED);
+	if (target == 0) {
+		return;
+	}
+
+	uint64_t scale = __atomic_load_n(&rl->scale, __ATOMIC_RELAXED);
+	uint64_t next;
+	if (latency_ns > target) {
+		uint64_t now = now_ns();
+		uint64_t cut = __atomic_load_n(&rl->cut_ns, __ATOMIC_RELAXED);
+		if (now - cut < target || !__atomic_compare_exchange_n(&rl->cut_ns,
+				&cut, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return;
+		}
+		do {
+			next = scale / 2 > RATE_SCALE_MIN ? scale / 2 : RATE_SCALE_MIN;
+		} while (!__atomic_compare_exchange_n(&rl->scale, &scale, next, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	} else {
+		do {
+			if (scale >= RATE_SCALE_ONE) {
+				return;
+			}
+			next = scale + RATE_SCALE_ONE / 64;
+			next = next < RATE_SCALE_ONE ? next : RATE_SCALE_ONE;
+		} while (!__atomic_compare_exchange_n(&rl->scale, &scale, next, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+#define RATE_BURST_MS_DEFAULT 100
+#define RATE_SCALE_ONE 1024	/* full configured rate */
+#define RATE_SCALE_MIN 64	/* latency feedback never goes below 1/16 */
+
+/* limits of the copy and move path, 0: unlimited */
+typedef struct {
+	double bytes;		/* all workers, bytes/s */
+	double ops;		/* all workers, renames and syncs/s */
+	double worker_bytes;	/* each worker */
+	double worker_ops;
+	int burst_ms;		/* a bucket holds this long of its rate */
+	int latency_ms;		/* 0: the global rates are fixed */
+} st_rates;
+
+/**
+ * Token bucket kept as the time at which it is full again (GCRA). Taking
+ * n units pushes tat_ns forward by n / rate; the taker then waits until
+ * tat_ns is no more than burst_ns ahead of now. Every taker reserves its
+ * share with one compare-and-swap, so workers sharing a bucket queue up in
+ * order without a lock. A bucket nobody used for burst_ns is full.
+ */
+typedef struct {
+	double rate;		/* units/s, 0: unlimited */
+	uint64_t burst_ns;
+	uint64_t tat_ns;	/* CLOCK_MONOTONIC */
+} __attribute__((aligned(64))) st_bucket;
+
+/**
+ * Shared by the workers through a MAP_SHARED mapping made before fork().
+ * With latency_ns set, the global buckets run at scale / RATE_SCALE_ONE of
+ * their rate: an operation slower than latency_ns halves scale, at most
+ * once per latency_ns, and every faster one wins a little of it back. The
+ * workers fill an idle volume up to the configured rates and back off as
+ * soon as the other tenants make it slow.
+ */
+typedef struct {
+	uint64_t latency_ns;
+	uint64_t scale;
+	uint64_t cut_ns;	/* last time scale was halved */
+	int limited;		/* some rate is set */
+	int num_workers;	/* buckets for max_workers */
+	st_bucket bytes;
+	st_bucket ops;
+	st_bucket workers[];	/* bytes and ops of worker i at 2 * i and 2 * i + 1 */
+} st_ratelimit;
+
+int ratelimit_create(const st_rates* r, int max_workers);
+void ratelimit_update(const st_rates* r);
+void ratelimit_destroy(void);
+void ratelimit_worker(int worker, uint64_t* heartbeat);
+uint64_t ratelimit_charge(uint64_t bytes, uint64_t ops);
+uint64_t ratelimit_take(uint64_t bytes, uint64_t ops);
+uint64_t ratelimit_slept(void);
+void ratelimit_observe(uint64_t latency_ns);
+
+#endif /* !RATELIMIT_H */
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "report.h"
+#include "trace.h"
+
+/* output_dir/report.txt, or output_dir/report.<instance>.txt */
+static void report_path(char* path, size_t size, const char* output_dir,
+		const char* instance, const char* file) {
+	const char* ext = strrchr(file, '.');
+	if (instance == NULL || instance[0] == '\0') {
+		snprintf(path, size, "%s/%s", output_dir, file);
+	} else {
+		snprintf(path, size, "%s/%.*s.%s%s", output_dir, (int)(ext - file), file,
+				instance, ext);
+	}
+}
+
+/**
+ * index_ms > 0 also keeps report.idx, a binary index by job reference
+ * (see index.h), rewritten at most every index_ms while applications come.
+ *
+ * Instances sharing an output directory each keep their own report and
+ * index, named after the instance, and append to the same completion log.
+ */
+st_report* report_open(const char* output_dir, const char* instance, int index_ms,
+		int fanout) {
+	if (mkdir_if_need(output_dir) == -1) {
+		return NULL;
+	}
+
+	char path[1024];
+	report_path(path, sizeof(path), output_dir, instance, REPORT_FILE);
+
+	st_report* rp = (st_report*)calloc(1, sizeof(st_report));
+	if (rp == NULL) {
+		log_perror("report_open: calloc");
+		return NULL;
+	}
+
+	/* append: the report of a previous run is kept */
+	rp->fp = fopen(path, "a");
+	if (rp->fp == NULL) {
+		log_perror("report_open: fopen");
+		free(rp);
+		return NULL;
+	}
+
+	rp->buf = (char*)malloc(REPORT_BUFSIZE);
+	if (rp->buf == NULL || setvbuf(rp->fp, rp->buf, _IOFBF, REPORT_BUFSIZE) != 0) {
+		log_perror("report_open: setvbuf");
+		fclose(rp->fp);
+		free(rp->buf);
+		free(rp);
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, COMPLETION_FILE);
+	rp->log = completion_log_open(path, instance != NULL && instance[0] != '\0');
+	if (rp->log == NULL) {
+		fclose(rp->fp);
+		free(rp->buf);
+		free(rp);
+		return NULL;
+	}
+	rp->nsync = 0;
+	rp->fanout = fanout;
+
+	if (index_ms > 0) {
+		report_path(rp->ix_path, sizeof(rp->ix_path), output_dir, instance, INDEX_FILE);
+		rp->ix = index_builder_create();
+		rp->ix->fanout = fanout;
+		rp->ix_interval_ms = index_ms;
+		/* missing or unreadable index: start a new one */
+		index_builder_load(rp->ix, rp->ix_path);
+	}
+
+	return rp;
+}
+
+/**
+ * DURABILITY_BATCH needs the directories to sync: one syncfs() per
+ * filesystem covers every file and directory entry the workers changed.
+ * output_dir is one of them, report_sync_dir() adds the input roots.
+ */
+int report_durability(st_report* rp, int durability, const char* output_dir,
+		int batch_apps, int batch_ms) {
+	if (rp == NULL) {
+		return 0;
+	}
+	rp->durability = durability;
+	if (durability != DURABILITY_BATCH) {
+		return 0;
+	}
+
+	rp->batch_apps = batch_apps;
+	rp->batch_ms = batch_ms;
+	rp->pending = index_builder_create();
+	return report_sync_dir(rp, output_dir);
+}
+
+/**
+ * new batch limits and index interval after a reload; the index itself
+ * is only turned on or off by a restart
+ */
+void report_tune(st_report* rp, int batch_apps, int batch_ms, int index_ms) {
+	if (rp == NULL) {
+		return;
+	}
+	rp->batch_apps = batch_apps;
+	rp->batch_ms = batch_ms;
+	if (rp->ix != NULL && index_ms > 0) {
+		rp->ix_interval_ms = index_ms;
+	}
+}
+
+/* sync the filesystem of dir too, unless one already synced holds it */
+int report_sync_dir(st_report* rp, const char* dir) {
+	if (rp == NULL || rp->durability != DURABILITY_BATCH) {
+		return 0;
+	}
+
+	struct stat sb, other;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		log_perror("report_sync_dir: open");
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	for (int i = 0; i < rp->nsync; i++) {
+		if (fstat(rp->sync_fds[i], &other) == 0 && other.st_dev == sb.st_dev) {
+			close(fd);
+			return 0;
+		}
+	}
+	if (rp->nsync == REPORT_SYNC_MAX) {
+		log_msg(LL_ERROR, "report_sync_dir: %s: too many filesystems", dir);
+		close(fd);
+		return -1;
+	}
+	rp->sync_fds[rp->nsync++] = fd;
+	return 0;
+}
+
+/* append one application, it reaches the file on the next flush */
+static int report_publish(st_report* rp, const char* jobref, int jobapl,
+		const st_manifest* m) {
+	char rel[512];
+	if (app_relpath(rel, sizeof(rel), jobref, jobapl, rp->fanout) == -1) {
+		snprintf(rel, sizeof(rel), "%s/Application_%d", jobref, jobapl);
+	}
+	fprintf(rp->fp, "%s (%u files, %lu bytes)\n", rel, m->nfiles, m->bytes);
+	for (size_t off = 0; off < m->len; off += strlen(m->names + off) + 1) {
+		fprintf(rp->fp, "    %s\n", m->names + off);
+	}
+
+	if (rp->ix != NULL) {
+		index_builder_add(rp->ix, jobref, jobapl, m);
+	}
+
+	if (completion_log_append(rp->log, jobref, jobapl, m) == -1) {
+		return -1;
+	}
+	trace_event(TR_PUBLISH, jobref, jobapl, 0);
+
+	if (ferror(rp->fp)) {
+		log_perror("report_app");
+		return -1;
+	}
+	return 0;
+}
+
+/* sync the batch, then report its applications */
+static int report_commit(st_report* rp) {
+	st_index_builder* b = rp->pending;
+	if (b->size == 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < rp->nsync; i++) {
+		if (syncfs(rp->sync_fds[i]) == -1) {
+			/* keep the batch, the next commit tries again */
+			log_perror("report_commit: syncfs");
+			return -1;
+		}
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < b->size; i++) {
+		const st_index_entry* e = &b->entries[i];
+		size_t names_end = i + 1 < b->size ? b->entries[i+1].names_off : b->files.len;
+		st_manifest m = {
+			.names = b->files.names + e->names_off,
+			.len = names_end - e->names_off,
+			.sizes = b->files.sizes + e->first_file,
+			.nfiles = e->nfiles,
+			.bytes = e->bytes,
+		};
+		if (report_publish(rp, e->jobref, e->jobapl, &m) == -1) {
+			ret = -1;
+		}
+	}
+	index_builder_reset(b);
+	return ret;
+}
+
+/**
+ * report one application: right away, or with DURABILITY_BATCH once its
+ * batch is synced
+ */
+int report_app(st_report* rp, const char* jobref, int jobapl, const st_manifest* m) {
+	if (rp == NULL) {
+		return 0;
+	}
+	if (rp->pending == NULL) {
+		return report_publish(rp, jobref, jobapl, m);
+	}
+
+	if (rp->pending->size == 0) {
+		rp->pending_since_ns = now_ns();
+	}
+	index_builder_add(rp->pending, jobref, jobapl, m);
+	if (rp->pending->size >= (size_t)rp->batch_apps
+			|| now_ns() - rp->pending_since_ns >= (uint64_t)rp->batch_ms * 1000000) {
+		return report_commit(rp);
+	}
+	return 0;
+}
+
+int report_flush(st_report* rp) {
+	if (rp == NULL) {
+		return 0;
+	}
+
+	uint64_t now = now_ns();
+	if (rp->pending != NULL && rp->pending->size > 0
+			&& now - rp->pending_since_ns >= (uint64_t)rp->batch_ms * 1000000) {
+		report_commit(rp);
+	}
+
+	if (fflush(rp->fp) == EOF) {
+		log_perror("report_flush");
+		return -1;
+	}
+
+	if (rp->ix != NULL && rp->ix->dirty
+			&& now - rp->ix_written_ns >= (uint64_t)rp->ix_interval_ms * 1000000) {
+		rp->ix_written_ns = now;
+		return index_builder_write(rp->ix, rp->ix_path);
+	}
+	return 0;
+}
+
+void report_close(st_report* rp) {
+	if (rp == NULL) {
+		return;
+	}
+	/* the last batch is synced and reported before its fds are closed */
+	report_flush(rp);
+	if (rp->pending != NULL) {
+		report_commit(rp);
+		index_builder_destroy(rp->pending);
+		rp->pending = NULL;
+		if (fflush(rp->fp) == EOF) {
+			log_perror("report_close: fflush");
+		}
+	}
+	for (int i = 0; i < rp->nsync; i++) {
+		close(rp->sync_fds[i]);
+	}
+	if (rp->ix != NULL) {
+		index_builder_write(rp->ix, rp->ix_path);
+		index_builder_destroy(rp->ix);
+	}
+	completion_log_close(rp->log);
+	fclose(rp->fp);
+	free(rp->buf);
+	free(rp);
+}
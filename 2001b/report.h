@@ -0,0 +1,74 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdio.h>
+
+#include "completion.h"
+#include "index.h"
+#include "util.h"
+
+#define REPORT_FILE "report.txt"	/* report.<instance>.txt with an instance */
+#define REPORT_BUFSIZE 65536
+#define REPORT_INDEX_MS_DEFAULT 1000
+#define DURABILITY_BATCH_APPS_DEFAULT 64
+#define DURABILITY_BATCH_MS_DEFAULT 50
+#define REPORT_SYNC_MAX 17	/* output_dir and every input root */
+
+/* when a published application is safe from a power loss */
+enum durability {
+	DURABILITY_NONE = 0,	/* whenever the kernel writes it back */
+	DURABILITY_BATCH,	/* the parent syncs groups of applications */
+	DURABILITY_STRICT,	/* the worker syncs each application before its ack */
+};
+
+/**
+ * Report of the processed applications, written by the parent as the
+ * workers answer. The report is only appended to, one block per
+ * application, so it never needs a walk of the output directory:
+ *
+ * IBM-000123/Application_1 (4 files, 4491 bytes)
+ *     1-candidate-data.txt
+ *     1-cv.txt
+ *
+ * The first line is the path of the application in output_dir, which
+ * has the fanout levels if any: IBM-000123/00/00/Application_1. With
+ * output_format = pack it names the pack and the application in it:
+ * IBM-000123.pack:Application_1.
+ *
+ * Each application also gets a record in the completion log (see
+ * completion.h), written right away rather than on the next flush.
+ *
+ * With DURABILITY_BATCH an application is held back in `pending` until a
+ * syncfs() of the filesystems involved, done every batch_apps applications
+ * or batch_ms: only then is it reported, so nothing downstream sees an
+ * application that a power loss could still take back.
+ */
+typedef struct {
+	FILE* fp;
+	char* buf;	/* stdio buffer, flushed by report_flush() */
+	st_completion_log* log;
+	st_index_builder* ix;	/* NULL if the binary index is disabled */
+	char ix_path[1024];
+	int ix_interval_ms;	/* rewrite report.idx at most this often */
+	uint64_t ix_written_ns;
+	int fanout;		/* output_fanout, see app_relpath() */
+	int durability;
+	st_index_builder* pending;	/* DURABILITY_BATCH: waiting for the sync */
+	uint64_t pending_since_ns;
+	int batch_apps;
+	int batch_ms;
+	int sync_fds[REPORT_SYNC_MAX];	/* one directory per filesystem */
+	int nsync;
+} st_report;
+
+st_report* report_open(const char* output_dir, const char* instance, int index_ms,
+		int fanout);
+int report_durability(st_report* rp, int durability, const char* output_dir,
+		int batch_apps, int batch_ms);
+int report_sync_dir(st_report* rp, const char* dir);
+void report_tune(st_report* rp, int batch_apps, int batch_ms, int index_ms);
+int report_app(st_report* rp, const char* jobref, int jobapl, const st_manifest* m);
+int report_flush(st_report* rp);
+void report_close(st_report* rp);
+
+#endif /* !REPORT_H */
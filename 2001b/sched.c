@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "util.h"
+
+/* the customer prefix of a job: its job reference up to the first '-' */
+static void job_prefix(const st_job* job, char* prefix, size_t size) {
+	size_t n = strcspn(job->name, "-/");
+	if (n >= size) {
+		n = size - 1;
+	}
+	memcpy(prefix, job->name, n);
+	prefix[n] = '\0';
+}
+
+static st_class* sched_class(st_sched* s, const char* prefix) {
+	for (size_t i = 0; i < s->nclasses; i++) {
+		if (strcmp(s->classes[i].prefix, prefix) == 0) {
+			return &s->classes[i];
+		}
+	}
+
+	if (s->nclasses == SCHED_CLASSES_MAX) {
+		return &s->classes[SCHED_CLASSES_MAX - 1];
+	}
+	st_class* c = &s->classes[s->nclasses++];
+	snprintf(c->prefix, sizeof(c->prefix), "%s", prefix);
+	c->weight = s->default_weight;
+	c->deficit = 0;
+	queue_init(&c->q, s->policy, s->aging / 1e6);
+	return c;
+}
+
+/**
+ * weights: "IBM:4,ACME:2,*:1", the weight of the applications of each
+ * customer prefix, "*" for the others (1 if not given). NULL or "" puts
+ * every customer in the default class with weight 1. Returns NULL if the
+ * list is malformed.
+ */
+st_sched* sched_create(int policy, double aging_mb_per_s, const char* weights) {
+	st_sched* s = (st_sched*)calloc(1, sizeof(st_sched));
+	if (s == NULL) {
+		die("calloc:");
+	}
+	s->policy = policy;
+	s->aging = aging_mb_per_s * 1e6;
+	s->default_weight = 1;
+
+	char list[512];
+	snprintf(list, sizeof(list), "%s", weights != NULL ? weights : "");
+	char* save = NULL;
+	for (char* tok = strtok_r(list, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save)) {
+		char* colon = strrchr(tok, ':');
+		double weight = colon != NULL ? atof(colon + 1) : 0;
+		if (colon == NULL || colon == tok || weight <= 0) {
+			sched_destroy(s);
+			return NULL;
+		}
+		*colon = '\0';
+		if (strcmp(tok, "*") == 0) {
+			s->default_weight = weight;
+		} else {
+			sched_class(s, tok)->weight = weight;
+		}
+	}
+	return s;
+}
+
+void sched_destroy(st_sched* s) {
+	if (s == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < s->nclasses; i++) {
+		queue_free(&s->classes[i].q);
+	}
+	free(s);
+}
+
+void sched_push(st_sched* s, st_job* job) {
+	char prefix[SCHED_PREFIX_MAX];
+	job_prefix(job, prefix, sizeof(prefix));
+	st_class* c = sched_class(s, prefix);
+	s->size++;
+	queue_push(&c->q, job);
+}
+
+/* next job by deficit round robin, NULL if nothing is queued */
+st_job* sched_pop(st_sched* s) {
+	if (s->size == 0) {
+		return NULL;
+	}
+	for (;;) {
+		st_class* c = &s->classes[s->cur];
+		if (c->q.size > 0) {
+			if (!s->in_turn) {
+				c->deficit += c->weight;
+				s->in_turn = 1;
+			}
+			if (c->deficit >= 1) {
+				c->deficit -= 1;
+				s->size--;
+				return queue_pop(&c->q);
+			}
+		} else {
+			c->deficit = 0;
+		}
+		s->in_turn = 0;
+		s->cur = (s->cur + 1) % s->nclasses;
+	}
+}
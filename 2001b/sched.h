@@ -0,0 +1,44 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+
+#include "queue.h"
+
+#define SCHED_PREFIX_MAX 32
+#define SCHED_CLASSES_MAX 64
+
+/* the applications of one customer, job references "<prefix>-..." */
+typedef struct {
+	char prefix[SCHED_PREFIX_MAX];
+	double weight;
+	double deficit;
+	st_queue q;
+} st_class;
+
+/**
+ * Weighted fair sharing across customers, by deficit round robin over
+ * one queue per job reference prefix. On its turn a class earns `weight`
+ * applications of credit and is served while it has credit and work, so
+ * over a busy period the classes get dispatches in the ratio of their
+ * weights whatever their backlog. A class that runs out of work loses its
+ * credit. Prefixes without a configured weight get default_weight; past
+ * SCHED_CLASSES_MAX customers, the newcomers share the last class.
+ */
+typedef struct {
+	st_class classes[SCHED_CLASSES_MAX];
+	size_t nclasses;
+	size_t cur;		/* class whose turn it is */
+	int in_turn;		/* cur already got its credit */
+	size_t size;		/* applications queued in all classes */
+	int policy;
+	double aging;
+	double default_weight;
+} st_sched;
+
+st_sched* sched_create(int policy, double aging_mb_per_s, const char* weights);
+void sched_destroy(st_sched* s);
+void sched_push(st_sched* s, st_job* job);
+st_job* sched_pop(st_sched* s);
+
+#endif /* !SCHED_H */
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spool.h"
+
+int spool_subdir(const char* name, int input_layout) {
+	if (name[0] == '.') {
+		return 0;
+	}
+	if (input_layout == INPUT_LAYOUT_DIR && strspn(name, "0123456789") == strlen(name)) {
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Depth first, root first. A directory that disappears during the walk is
+ * skipped; fn returning -1 stops it.
+ */
+int spool_walk(const char* root, int recursive, int input_layout, spool_fn fn, void* arg) {
+	if (fn(root, arg) == -1) {
+		return -1;
+	}
+	if (!recursive) {
+		return 0;
+	}
+
+	DIR* dir = opendir(root);
+	if (dir == NULL) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	int ret = 0;
+	struct dirent* entry;
+	while (ret == 0 && (entry = readdir(dir)) != NULL) {
+		if (!spool_subdir(entry->d_name, input_layout)) {
+			continue;
+		}
+		struct stat sb;
+		if (entry->d_type != DT_DIR && (entry->d_type != DT_UNKNOWN
+				|| fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1
+				|| !S_ISDIR(sb.st_mode))) {
+			continue;
+		}
+		char path[SPOOL_PATH_MAX];
+		if (snprintf(path, sizeof(path), "%s/%s", root, entry->d_name) >= (int)sizeof(path)) {
+			log_msg(LL_WARN, "spool_walk: %s/%s: path too long, skipped",
+					root, entry->d_name);
+			continue;
+		}
+		ret = spool_walk(path, recursive, input_layout, fn, arg);
+	}
+	closedir(dir);
+	return ret;
+}
+
+st_spool_watch* spool_watch_create(int input_layout, int recursive) {
+	st_spool_watch* sw = (st_spool_watch*)malloc(sizeof(st_spool_watch));
+	if (sw == NULL) {
+		log_perror("spool_watch_create: malloc");
+		return NULL;
+	}
+	sw->fd = inotify_init1(IN_CLOEXEC);
+	if (sw->fd == -1) {
+		log_perror("spool_watch_create: inotify_init1");
+		free(sw);
+		return NULL;
+	}
+	sw->input_layout = input_layout;
+	sw->recursive = recursive;
+	sw->dirs = imap_create();
+	sw->round = 1;
+	sw->dirty = vec_create(64);
+	sw->dead = vec_create(16);
+	return sw;
+}
+
+void spool_watch_destroy(st_spool_watch* sw) {
+	if (sw == NULL) {
+		return;
+	}
+	spool_watch_end_round(sw);
+	for (size_t i = 0; i < sw->dirs->capacity; i++) {
+		if (sw->dirs->keys[i] != -1) {
+			free(sw->dirs->values[i]);
+		}
+	}
+	imap_destroy(sw->dirs);
+	vec_destroy(sw->dirty);
+	vec_destroy(sw->dead);
+	close(sw->fd);
+	free(sw);
+}
+
+static int watch_one(const char* dir, void* arg) {
+	st_spool_watch* sw = arg;
+	int wd = inotify_add_watch(sw->fd, dir, SPOOL_WATCH_MASK | IN_ONLYDIR);
+	if (wd == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			/* gone already */
+			return 0;
+		}
+		log_msg(LL_ERROR, "spool_watch_add: inotify_add_watch %s: %s", dir, strerror(errno));
+		return -1;
+	}
+
+	/* a directory watched again, e.g. renamed within the spool, gets its new path */
+	st_watch_dir* d = imap_get(sw->dirs, wd);
+	if (d == NULL || strcmp(d->path, dir) != 0) {
+		size_t len = strlen(dir) + 1;
+		st_watch_dir* nd = (st_watch_dir*)malloc(sizeof(st_watch_dir) + len);
+		if (nd == NULL) {
+			log_perror("spool_watch_add: malloc");
+			return -1;
+		}
+		nd->round = 0;
+		memcpy(nd->path, dir, len);
+		imap_put(sw->dirs, wd, nd);
+		if (d != NULL) {
+			vec_push(sw->dead, (char*)d);
+		}
+	}
+	/* files may have come before the watch: scan it */
+	spool_watch_dirty(sw, wd);
+	return 0;
+}
+
+/**
+ * Watch root and, with recursive, every spool directory below it, each
+ * reported dirty this round. -1 if a watch could not be added, e.g. when
+ * /proc/sys/fs/inotify/max_user_watches is reached.
+ */
+int spool_watch_add(st_spool_watch* sw, const char* root) {
+	return spool_walk(root, sw->recursive, sw->input_layout, watch_one, sw);
+}
+
+/* NULL if wd is not a spool directory (any more) */
+const char* spool_watch_path(const st_spool_watch* sw, int wd) {
+	const st_watch_dir* d = imap_get(sw->dirs, wd);
+	return d != NULL ? d->path : NULL;
+}
+
+void spool_watch_dirty(st_spool_watch* sw, int wd) {
+	st_watch_dir* d = imap_get(sw->dirs, wd);
+	if (d != NULL && d->round != sw->round) {
+		d->round = sw->round;
+		vec_push(sw->dirty, d->path);
+	}
+}
+
+/* the kernel dropped wd (IN_IGNORED), or the directory left the spool */
+void spool_watch_forget(st_spool_watch* sw, int wd) {
+	st_watch_dir* d = imap_del(sw->dirs, wd);
+	if (d != NULL) {
+		vec_push(sw->dead, (char*)d);
+	}
+}
+
+void spool_watch_end_round(st_spool_watch* sw) {
+	sw->dirty->size = 0;
+	char* d;
+	while ((d = vec_pop(sw->dead)) != NULL) {
+		free(d);
+	}
+	sw->round++;
+}
+
+/**
+ * 1 if path is on a filesystem changed by other hosts, which inotify
+ * never hears about: NFS, SMB, Ceph, AFS, 9p or FUSE (sshfs and the like)
+ */
+int spool_remote(const char* path) {
+	struct statfs sf;
+	if (statfs(path, &sf) == -1) {
+		return 0;
+	}
+	switch ((unsigned long)sf.f_type) {
+	case NFS_SUPER_MAGIC:
+	case SMB_SUPER_MAGIC:
+	case CIFS_SUPER_MAGIC:
+	case SMB2_SUPER_MAGIC:
+	case CEPH_SUPER_MAGIC:
+	case AFS_SUPER_MAGIC:
+	case AFS_FS_MAGIC:
+	case V9FS_MAGIC:
+	case FUSE_SUPER_MAGIC:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int cmp_name(const void* x, const void* y, void* arg) {
+	const char* buf = arg;
+	return strcmp(buf + *(const size_t*)x, buf + *(const size_t*)y);
+}
+
+static const char* listing_name(const st_listing* ls, size_t i) {
+	return ls->buf + ls->offs[i];
+}
+
+static void listing_free(st_listing* ls) {
+	free(ls->buf);
+	free(ls->offs);
+	memset(ls, 0, sizeof(*ls));
+}
+
+/* read the names of the directory open as fd, which is closed */
+static int listing_read(st_listing* ls, int fd) {
+	DIR* dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+	ls->len = 0;
+	ls->count = 0;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		size_t n = strlen(entry->d_name) + 1;
+		if (ls->len + n > ls->capacity) {
+			size_t capacity = ls->capacity ? ls->capacity * 2 : 4096;
+			while (capacity < ls->len + n) {
+				capacity *= 2;
+			}
+			char* buf = realloc(ls->buf, capacity);
+			if (buf == NULL) {
+				die("realloc:");
+			}
+			ls->buf = buf;
+			ls->capacity = capacity;
+		}
+		if (ls->count == ls->offs_capacity) {
+			size_t capacity = ls->offs_capacity ? ls->offs_capacity * 2 : 256;
+			size_t* offs = realloc(ls->offs, capacity * sizeof(size_t));
+			if (offs == NULL) {
+				die("realloc:");
+			}
+			ls->offs = offs;
+			ls->offs_capacity = capacity;
+		}
+		memcpy(ls->buf + ls->len, entry->d_name, n);
+		ls->offs[ls->count++] = ls->len;
+		ls->len += n;
+	}
+	closedir(dir);
+
+	qsort_r(ls->offs, ls->count, sizeof(size_t), cmp_name, ls->buf);
+	return 0;
+}
+
+static uint64_t timespec_ns(const struct timespec* ts) {
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* mtimes are on the wall clock */
+static uint64_t realtime_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return timespec_ns(&ts);
+}
+
+static int timespec_eq(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* note the attributes of d, whose listing was read at now (CLOCK_REALTIME) */
+static void poll_seen(st_poll_dir* d, const struct stat* sb, uint64_t now) {
+	d->dev = sb->st_dev;
+	d->ino = sb->st_ino;
+	d->mtime = sb->st_mtim;
+	d->ctime = sb->st_ctim;
+	/*
+	 * an entry added within the granularity of the mtime after the listing
+	 * leaves the mtime as it is: read it again until that cannot happen
+	 */
+	d->racy = timespec_ns(&sb->st_mtim) + POLL_RACY_NS > now;
+}
+
+static void poll_dirty(st_spool_poll* sp, st_poll_dir* d) {
+	if (d->round != sp->round) {
+		d->round = sp->round;
+		vec_push(sp->dirty, d->path);
+	}
+}
+
+/*
+ * opening the directory, rather than stat(), makes the NFS client check its
+ * attributes with the server instead of trusting its cache
+ */
+static int poll_open(const char* path, struct stat* sb) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1 && fstat(fd, sb) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static int poll_one(const char* path, void* arg) {
+	st_spool_poll* sp = arg;
+	struct stat sb;
+	int fd = poll_open(path, &sb);
+	if (fd == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			/* gone already */
+			return 0;
+		}
+		log_msg(LL_ERROR, "spool_poll_add: %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	size_t len = strlen(path) + 1;
+	st_poll_dir* d = (st_poll_dir*)calloc(1, sizeof(st_poll_dir) + len);
+	if (d == NULL) {
+		log_perror("spool_poll_add: calloc");
+		close(fd);
+		return -1;
+	}
+	memcpy(d->path, path, len);
+	poll_seen(d, &sb, realtime_ns());
+	if (listing_read(&d->names, fd) == -1) {
+		log_perror("spool_poll_add: fdopendir");
+		free(d);
+		return -1;
+	}
+	vec_push(sp->dirs, (char*)d);
+	/* files came before it was listed: scan it */
+	poll_dirty(sp, d);
+	return 0;
+}
+
+st_spool_poll* spool_poll_create(int input_layout, int recursive, int min_ms, int max_ms) {
+	st_spool_poll* sp = (st_spool_poll*)calloc(1, sizeof(st_spool_poll));
+	if (sp == NULL) {
+		log_perror("spool_poll_create: calloc");
+		return NULL;
+	}
+	sp->input_layout = input_layout;
+	sp->recursive = recursive;
+	sp->dirs = vec_create(64);
+	sp->round = 1;
+	sp->dirty = vec_create(64);
+	sp->dead = vec_create(16);
+	sp->min_ms = min_ms;
+	sp->max_ms = max_ms > min_ms ? max_ms : min_ms;
+	sp->interval_ms = min_ms;
+	sp->polled_ns = now_ns();
+	return sp;
+}
+
+static void poll_dir_free(st_poll_dir* d) {
+	listing_free(&d->names);
+	free(d);
+}
+
+void spool_poll_destroy(st_spool_poll* sp) {
+	if (sp == NULL) {
+		return;
+	}
+	spool_poll_end_round(sp);
+	for (size_t i = 0; i < sp->dirs->size; i++) {
+		poll_dir_free((st_poll_dir*)sp->dirs->items[i]);
+	}
+	vec_destroy(sp->dirs);
+	vec_destroy(sp->dirty);
+	vec_destroy(sp->dead);
+	listing_free(&sp->scratch);
+	free(sp);
+}
+
+/* poll root and, with recursive, every spool directory below it */
+int spool_poll_add(st_spool_poll* sp, const char* root) {
+	size_t first = sp->dirs->size;
+	if (spool_walk(root, sp->recursive, sp->input_layout, poll_one, sp) == -1) {
+		return -1;
+	}
+	if (sp->dirs->size > first) {
+		((st_poll_dir*)sp->dirs->items[first])->root = 1;
+	}
+	return 0;
+}
+
+/* a new entry in d: a spool directory to poll as well, or maybe an application */
+static void poll_new(st_spool_poll* sp, st_poll_dir* d, const char* name, spool_entry_fn fn) {
+	if (sp->recursive && spool_subdir(name, sp->input_layout)) {
+		char path[SPOOL_PATH_MAX];
+		struct stat sb;
+		if (snprintf(path, sizeof(path), "%s/%s", d->path, name) < (int)sizeof(path)
+				&& lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+			if (spool_walk(path, sp->recursive, sp->input_layout, poll_one, sp) == -1) {
+				log_msg(LL_WARN, "spool_poll: %s is not polled", path);
+			}
+			return;
+		}
+	}
+	fn(d->path, name, sp->input_layout);
+	poll_dirty(sp, d);
+}
+
+/*
+ * poll d, -1 if it is gone. The listing is read into the scratch one,
+ * merged with the listing of d, then the two are swapped.
+ */
+static int poll_dir(st_spool_poll* sp, st_poll_dir* d, spool_entry_fn fn, size_t* arrivals) {
+	struct stat sb;
+	int fd = poll_open(d->path, &sb);
+	if (fd == -1) {
+		return errno == ENOENT || errno == ENOTDIR ? -1 : 0;
+	}
+	if (!d->racy && sb.st_dev == d->dev && sb.st_ino == d->ino
+			&& timespec_eq(&sb.st_mtim, &d->mtime)
+			&& timespec_eq(&sb.st_ctim, &d->ctime)) {
+		close(fd);
+		return 0;
+	}
+
+	uint64_t now = realtime_ns();
+	st_listing* next = &sp->scratch;
+	if (listing_read(next, fd) == -1) {
+		return 0;
+	}
+	poll_seen(d, &sb, now);
+
+	/* both sorted: walk them side by side, only the new names cost anything */
+	size_t i = 0;
+	for (size_t j = 0; j < next->count; j++) {
+		const char* name = listing_name(next, j);
+		int c = 1;
+		while (i < d->names.count && (c = strcmp(listing_name(&d->names, i), name)) < 0) {
+			i++;
+		}
+		if (i < d->names.count && c == 0) {
+			i++;
+			continue;
+		}
+		(*arrivals)++;
+		poll_new(sp, d, name, fn);
+	}
+
+	st_listing old = d->names;
+	d->names = *next;
+	*next = old;
+	return 0;
+}
+
+/**
+ * Poll every directory, fn is called on each new entry. Returns the
+ * number of new entries; sp->interval_ms is the time to the next poll.
+ */
+size_t spool_poll_round(st_spool_poll* sp, spool_entry_fn fn) {
+	size_t arrivals = 0;
+	size_t gone = 0;
+	/* directories found during the round are listed already */
+	size_t n = sp->dirs->size;
+	for (size_t i = 0; i < n; i++) {
+		st_poll_dir* d = (st_poll_dir*)sp->dirs->items[i];
+		if (poll_dir(sp, d, fn, &arrivals) == -1 && !d->root) {
+			vec_push(sp->dead, (char*)d);
+			sp->dirs->items[i] = NULL;
+			gone++;
+		}
+	}
+	if (gone > 0) {
+		size_t k = 0;
+		for (size_t i = 0; i < sp->dirs->size; i++) {
+			if (sp->dirs->items[i] != NULL) {
+				sp->dirs->items[k++] = sp->dirs->items[i];
+			}
+		}
+		sp->dirs->size = k;
+	}
+
+	/* about one new entry per poll, from the rate averaged over POLL_RATE_TAU_MS */
+	uint64_t now = now_ns();
+	double dt = (now - sp->polled_ns) / 1e9;
+	sp->polled_ns = now;
+	if (dt > 0) {
+		double a = dt * 1000 < POLL_RATE_TAU_MS ? dt * 1000 / POLL_RATE_TAU_MS : 1;
+		sp->rate += a * (arrivals / dt - sp->rate);
+	}
+	double ms = sp->rate > 0 ? 1000 / sp->rate : sp->max_ms;
+	sp->interval_ms = ms < sp->min_ms ? sp->min_ms : ms > sp->max_ms ? sp->max_ms : (int)ms;
+	return arrivals;
+}
+
+void spool_poll_end_round(st_spool_poll* sp) {
+	sp->dirty->size = 0;
+	char* d;
+	while ((d = vec_pop(sp->dead)) != NULL) {
+		poll_dir_free((st_poll_dir*)d);
+	}
+	sp->round++;
+}
+
+/* 0, or -1 with errno EAGAIN if the pipe is full */
+int spool_notify(int fd, const char* dir) {
+	size_t len = strlen(dir) + 1;
+	if (len > PIPE_BUF) {
+		/* cannot be sent whole: have everything scanned instead */
+		dir = "";
+		len = 1;
+	}
+	ssize_t n;
+	do {
+		n = write(fd, dir, len);
+	} while (n == -1 && errno == EINTR);
+	return n == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * Read what the monitor sent without blocking: paths are added to dirs
+ * (the caller frees them), *all set if everything must be scanned.
+ * Returns the number of messages, -1 on error.
+ */
+int spool_notified(int fd, Vec* dirs, int* all) {
+	static char buf[64 * 1024];
+	static size_t kept = 0;	/* a message cut by the end of the last read */
+	int count = 0;
+
+	for (;;) {
+		ssize_t n = read(fd, buf + kept, sizeof(buf) - kept);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			return count;
+		}
+		if (n <= 0) {
+			return n == 0 ? count : -1;
+		}
+
+		size_t end = kept + n;
+		size_t start = 0;
+		for (size_t i = 0; i < end; i++) {
+			if (buf[i] != '\0') {
+				continue;
+			}
+			if (i == start) {
+				*all = 1;
+			} else {
+				char* dir = strdup(buf + start);
+				if (dir == NULL) {
+					die("strdup:");
+				}
+				vec_push(dirs, dir);
+			}
+			count++;
+			start = i + 1;
+		}
+		kept = end - start;
+		memmove(buf, buf + start, kept);
+	}
+}
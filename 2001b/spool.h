@@ -0,0 +1,139 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "util.h"
+
+#define INPUT_DIRS_MAX 16
+#define SPOOL_PATH_MAX 2048	/* longer spool directories are skipped */
+
+/* how the email bot lays out its spool directories */
+enum input_layout {
+	INPUT_LAYOUT_FLAT = 0,	/* <jobapl>-<name> files side by side */
+	INPUT_LAYOUT_DIR,	/* one directory <jobapl>/ per application */
+};
+
+/**
+ * The spool is made of input roots and, with input_recursive, of every
+ * subdirectory under them that is not an application (a numeric name with
+ * input_layout = dir) nor hidden, e.g. one directory per day or per shard
+ * of the email bot. Applications are looked for in each spool directory.
+ */
+int spool_subdir(const char* name, int input_layout);
+
+/* call fn on root and, if recursive, on every spool directory below */
+typedef int (*spool_fn)(const char* dir, void* arg);
+int spool_walk(const char* root, int recursive, int input_layout, spool_fn fn, void* arg);
+
+/* a watched spool directory, the value of st_spool_watch.dirs */
+typedef struct {
+	uint64_t round;		/* last round it was reported dirty in */
+	char path[];
+} st_watch_dir;
+
+/**
+ * inotify watches of the monitor, one per spool directory, found by watch
+ * descriptor in a hash map. Directories that changed are collected once per
+ * round in `dirty`; the entries of removed directories are only freed at
+ * the end of the round, so `dirty` never points to freed memory.
+ */
+typedef struct {
+	int fd;			/* inotify */
+	int input_layout;
+	int recursive;
+	st_imap* dirs;		/* wd -> st_watch_dir */
+	uint64_t round;
+	Vec* dirty;		/* const char* paths changed this round */
+	Vec* dead;		/* st_watch_dir* forgotten this round */
+} st_spool_watch;
+
+#define SPOOL_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF)
+
+st_spool_watch* spool_watch_create(int input_layout, int recursive);
+void spool_watch_destroy(st_spool_watch* sw);
+int spool_watch_add(st_spool_watch* sw, const char* root);
+const char* spool_watch_path(const st_spool_watch* sw, int wd);
+void spool_watch_dirty(st_spool_watch* sw, int wd);
+void spool_watch_forget(st_spool_watch* sw, int wd);
+void spool_watch_end_round(st_spool_watch* sw);
+
+/* how the monitor learns about new files */
+enum input_monitor {
+	INPUT_MONITOR_AUTO = 0,	/* poll if a root is on a network filesystem */
+	INPUT_MONITOR_INOTIFY,
+	INPUT_MONITOR_POLL,
+};
+
+#define POLL_MAX_MS_DEFAULT 5000
+#define POLL_RATE_TAU_MS 1000	/* the arrival rate is averaged over about this long */
+#define POLL_RACY_NS 2000000000ULL	/* coarsest mtime granularity expected */
+
+int spool_remote(const char* path);
+
+/* names of a directory, sorted, null separated in buf */
+typedef struct {
+	char* buf;
+	size_t len;
+	size_t capacity;
+	size_t* offs;		/* where each name starts in buf */
+	size_t count;
+	size_t offs_capacity;
+} st_listing;
+
+/* a polled spool directory */
+typedef struct {
+	uint64_t round;		/* last round it was reported dirty in */
+	int root;		/* an input root, kept when it disappears */
+	int racy;		/* changed too recently for its mtime to be trusted */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	st_listing names;
+	char path[];
+} st_poll_dir;
+
+/**
+ * Polling for filesystems where inotify sees nothing, such as NFS. A
+ * directory whose mtime and ctime did not change is not read again; one
+ * that changed is read and its listing merged with the one kept in memory,
+ * so only the entries that are new are looked at. The interval follows the
+ * arrival rate: about one new entry per poll, between min_ms and max_ms.
+ */
+typedef struct {
+	int input_layout;
+	int recursive;
+	Vec* dirs;		/* st_poll_dir* */
+	uint64_t round;
+	Vec* dirty;		/* const char* paths with new entries this round */
+	Vec* dead;		/* st_poll_dir* gone this round */
+	st_listing scratch;	/* the listing being read */
+	int min_ms;
+	int max_ms;
+	int interval_ms;	/* until the next poll */
+	double rate;		/* new entries/s */
+	uint64_t polled_ns;	/* CLOCK_MONOTONIC */
+} st_spool_poll;
+
+/* called on each new entry, trace_detect() in filebot.c */
+typedef void (*spool_entry_fn)(const char* dir, const char* name, int input_layout);
+
+st_spool_poll* spool_poll_create(int input_layout, int recursive, int min_ms, int max_ms);
+void spool_poll_destroy(st_spool_poll* sp);
+int spool_poll_add(st_spool_poll* sp, const char* root);
+size_t spool_poll_round(st_spool_poll* sp, spool_entry_fn fn);
+void spool_poll_end_round(st_spool_poll* sp);
+
+/**
+ * The monitor tells the parent which directories to scan through a pipe:
+ * one path per message, null terminated, "" for all of them. A message is
+ * shorter than PIPE_BUF, so it is never interleaved or cut.
+ */
+int spool_notify(int fd, const char* dir);
+int spool_notified(int fd, Vec* dirs, int* all);
+
+#endif /* !SPOOL_H */
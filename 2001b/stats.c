@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "util.h"
+
+size_t stats_size(int max_workers) {
+	return sizeof(st_stats) + max_workers * sizeof(st_worker_stats);
+}
+
+/**
+ * Create the stats segment before forking, so the monitor, the parent and
+ * all workers inherit the same MAP_SHARED mapping. It has room for
+ * max_workers, the most the pool can grow to without a restart.
+ */
+st_stats* stats_create(const char* name, int num_workers, int max_workers) {
+	size_t size = stats_size(max_workers);
+
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("stats_create: shm_open");
+		return NULL;
+	}
+	if (ftruncate(fd, size) == -1) {
+		perror("stats_create: ftruncate");
+		close(fd);
+		return NULL;
+	}
+
+	st_stats* st = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		perror("stats_create: mmap");
+		return NULL;
+	}
+
+	memset(st, 0, size);
+	st->version = STATS_VERSION;
+	st->num_workers = num_workers;
+	st->max_workers = max_workers;
+	st->pid = getpid();
+	st->start_ns = now_ns();
+	/* written last: readers ignore the segment until magic is set */
+	__atomic_store_n(&st->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return st;
+}
+
+/* read-only mapping of an existing segment, used by filebot-stat */
+st_stats* stats_open(const char* name) {
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(st_stats)) {
+		close(fd);
+		return NULL;
+	}
+
+	st_stats* st = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+			|| st->version != STATS_VERSION
+			|| st->num_workers > st->max_workers
+			|| stats_size(st->max_workers) > (size_t)sb.st_size) {
+		munmap(st, sb.st_size);
+		return NULL;
+	}
+
+	return st;
+}
+
+void stats_close(st_stats* st) {
+	if (st != NULL) {
+		munmap(st, stats_size(st->max_workers));
+	}
+}
+
+void stats_destroy(st_stats* st, const char* name) {
+	stats_close(st);
+	shm_unlink(name);
+}
+
+/* account napps new applications and update the intake rate EWMA */
+void stats_intake(st_stats* st, uint64_t napps) {
+	uint64_t now = now_ns();
+	uint64_t last = st->parent.last_scan_ns;
+	if (last == 0) {
+		last = st->start_ns;
+	}
+
+	STAT_ADD(st->parent.apps_enqueued, napps);
+	STAT_SET(st->parent.last_scan_ns, now);
+	if (now <= last) {
+		return;
+	}
+
+	/* alpha = 1/4, rate in applications/s * 1000 */
+	uint64_t rate = napps * 1000000000000ULL / (now - last);
+	uint64_t ewma = st->parent.intake_rate_milli;
+	STAT_SET(st->parent.intake_rate_milli, ewma - ewma / 4 + rate / 4);
+}
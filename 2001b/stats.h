@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_SHM_DEFAULT "/filebot-stats"
+#define STATS_MAGIC 0x46425354 /* "FBST" */
+#define STATS_VERSION 7
+#define CACHE_LINE 64
+
+/**
+ * Counters owned by one worker. Each worker only writes its own slot, so
+ * the slot is padded to a cache line to keep workers from bouncing the
+ * same line between CPUs. The only exceptions are `retries` and `replaced`,
+ * which the parent bumps when it requeues a job that failed on this worker
+ * or that the watchdog took back from it.
+ */
+typedef struct {
+	uint64_t apps_moved;
+	uint64_t files_moved;
+	uint64_t bytes_moved;
+	uint64_t failures;
+	uint64_t retries;
+	uint64_t skipped;	/* another instance has the application */
+	uint64_t busy_ns;
+	uint64_t throttled_ns;	/* waiting for the rate limiter */
+	uint64_t heartbeat_ns;	/* CLOCK_MONOTONIC, known alive until then */
+	uint64_t replaced;	/* hung or dead, replaced by the watchdog */
+	uint64_t dedup_files;	/* published as links to an earlier copy */
+	uint64_t dedup_bytes;	/* what those files would have taken */
+} __attribute__((aligned(CACHE_LINE))) st_worker_stats;
+
+/* counters owned by the parent process, and inotify_overflows by the monitor */
+typedef struct {
+	uint64_t apps_enqueued;
+	uint64_t queue_depth;
+	uint64_t in_flight;
+	uint64_t intake_rate_milli; /* EWMA of applications/s, times 1000 */
+	uint64_t last_scan_ns;
+	uint64_t inotify_overflows;	/* each followed by a full rescan */
+} __attribute__((aligned(CACHE_LINE))) st_parent_stats;
+
+/* layout of the shared memory segment */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int num_workers;	/* workers running now, changes on reload */
+	int max_workers;	/* slots in the segment */
+	pid_t pid;
+	uint64_t start_ns;
+	st_parent_stats parent;
+	st_worker_stats workers[]; /* workers[max_workers] */
+} st_stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+size_t stats_size(int max_workers);
+st_stats* stats_create(const char* name, int num_workers, int max_workers);
+st_stats* stats_open(const char* name);
+void stats_close(st_stats* st);
+void stats_destroy(st_stats* st, const char* name);
+void stats_intake(st_stats* st, uint64_t napps);
+
+#endif /* !STATS_H */
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "index.h"
+
+static int failed = 0;
+
+void check(const char* what, int ok) {
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+/* an application with nfiles files of size bytes each */
+void add_app(st_index_builder* b, const char* jobref, int jobapl, int nfiles,
+		uint64_t size) {
+	st_manifest m = {0};
+	char name[64];
+	for (int i = 1; i <= nfiles; i++) {
+		snprintf(name, sizeof(name), "%d-file-%d.txt", jobapl, i);
+		manifest_add(&m, name, size);
+	}
+	index_builder_add(b, jobref, jobapl, &m);
+	manifest_free(&m);
+}
+
+/* nfiles files of size bytes, the first one named name */
+int has_app(const st_index* ix, const char* jobref, int jobapl, uint32_t nfiles,
+		uint64_t size, const char* name) {
+	const st_index_jobref* jr = index_find(ix, jobref);
+	const st_index_app* app = jr != NULL ? index_find_app(ix, jr, jobapl) : NULL;
+	return app != NULL && app->nfiles == nfiles && app->bytes == nfiles * size
+			&& (nfiles == 0 || (ix->files[app->first_file].size == size
+			&& strcmp(index_str(ix, ix->files[app->first_file].name), name) == 0));
+}
+
+/* copy len bytes of src to dst, with byte at off changed to value if off < len */
+int copy_damaged(const char* src, const char* dst, size_t len, size_t off, int value) {
+	FILE* in = fopen(src, "r");
+	FILE* out = fopen(dst, "w");
+	if (in == NULL || out == NULL) {
+		perror("copy_damaged: fopen");
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		int c = fgetc(in);
+		if (c == EOF) {
+			break;
+		}
+		fputc(i == off ? value : c, out);
+	}
+	fclose(in);
+	fclose(out);
+	return 0;
+}
+
+int main(void) {
+	char dir[] = "/tmp/index-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[256], copy[256];
+	snprintf(path, sizeof(path), "%s/report.idx", dir);
+	snprintf(copy, sizeof(copy), "%s/damaged.idx", dir);
+
+	/* out of order, with an application reported twice */
+	st_index_builder* b = index_builder_create();
+	add_app(b, "IBM-000123", 2, 3, 100);
+	add_app(b, "ACME-000007", 1, 1, 10);
+	add_app(b, "IBM-000123", 1, 2, 50);
+	add_app(b, "IBM-000123", 2, 4, 200);
+	add_app(b, "ACME-000007", 3, 0, 0);
+	check("write", index_builder_write(b, path) == 0);
+
+	st_index* ix = index_open(path);
+	check("open", ix != NULL);
+	if (ix != NULL) {
+		check("two job references", ix->hdr->njobrefs == 2);
+		check("four applications, the one reported twice once", ix->hdr->napps == 4);
+		check("sorted by name", strcmp(index_str(ix, ix->jobrefs[0].name), "ACME-000007") == 0);
+		check("IBM-000123 Application_1", has_app(ix, "IBM-000123", 1, 2, 50, "1-file-1.txt"));
+		check("IBM-000123 Application_2, the last one reported",
+				has_app(ix, "IBM-000123", 2, 4, 200, "2-file-1.txt"));
+		check("ACME-000007 Application_3, no files", has_app(ix, "ACME-000007", 3, 0, 0, ""));
+		check("missing job reference", index_find(ix, "IBM-000999") == NULL);
+		index_close(ix);
+	}
+
+	/* a later run loads the index and reports one of its applications again */
+	index_builder_destroy(b);
+	b = index_builder_create();
+	check("load", index_builder_load(b, path) == 0);
+	add_app(b, "ACME-000007", 1, 2, 20);
+	check("write again", index_builder_write(b, path) == 0);
+	ix = index_open(path);
+	check("open again", ix != NULL);
+	if (ix != NULL) {
+		check("still four applications", ix->hdr->napps == 4);
+		check("ACME-000007 Application_1 replaced", has_app(ix, "ACME-000007", 1, 2, 20, "1-file-1.txt"));
+		check("IBM-000123 Application_2 kept", has_app(ix, "IBM-000123", 2, 4, 200, "2-file-1.txt"));
+		index_close(ix);
+	}
+	index_builder_destroy(b);
+
+	/* damaged copies are refused */
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size_t size = ftell(fp);
+	fclose(fp);
+
+	copy_damaged(path, copy, sizeof(st_index_header) - 1, size, 0);
+	ix = index_open(copy);
+	check("truncated header refused", ix == NULL);
+	index_close(ix);
+
+	copy_damaged(path, copy, size - 1, size, 0);
+	ix = index_open(copy);
+	check("truncated string table refused", ix == NULL);
+	index_close(ix);
+
+	copy_damaged(path, copy, size, 0, 0);
+	ix = index_open(copy);
+	check("bad magic refused", ix == NULL);
+	index_close(ix);
+
+	/* the first application's first_file past the files table */
+	copy_damaged(path, copy, size, sizeof(st_index_header)
+			+ 2 * sizeof(st_index_jobref) + 4, 0x7f);
+	ix = index_open(copy);
+	check("application out of bounds refused", ix == NULL);
+	index_close(ix);
+
+	/* the last string no longer null terminated */
+	copy_damaged(path, copy, size, size - 1, 'x');
+	ix = index_open(copy);
+	check("unterminated string refused", ix == NULL);
+	index_close(ix);
+
+	unlink(copy);
+	unlink(path);
+	rmdir(dir);
+	return failed ? 1 : 0;
+}
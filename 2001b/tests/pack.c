@@ -0,0 +1,179 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+static int failed = 0;
+
+void check(const char* what, int ok) {
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+/* append an application of nfiles files, file i holding i + 1 copies of fill */
+int append_app(const char* path, const char* tmp, int jobapl, int nfiles, char fill) {
+	st_pack_writer w = { .fd = -1 };
+	if (pack_begin(&w, path) == -1) {
+		return -1;
+	}
+	char name[64], data[64];
+	for (int i = 0; i < nfiles; i++) {
+		int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		memset(data, fill, i + 1);
+		if (fd == -1 || write(fd, data, i + 1) != i + 1 || lseek(fd, 0, SEEK_SET) == -1) {
+			perror("append_app: write");
+			pack_writer_free(&w);
+			return -1;
+		}
+		snprintf(name, sizeof(name), "%d-file-%d.txt", jobapl, i + 1);
+		int ret = pack_add(&w, name, fd, i + 1);
+		close(fd);
+		if (ret == -1) {
+			pack_writer_free(&w);
+			return -1;
+		}
+	}
+	int ret = pack_commit(&w, jobapl, PACK_SYNC_NONE);
+	pack_writer_free(&w);
+	return ret;
+}
+
+/* nfiles files of fill, as append_app() wrote them */
+int has_app(const st_pack* p, int jobapl, uint32_t nfiles, char fill) {
+	const st_pack_footer* app = pack_find(p, jobapl);
+	if (app == NULL || app->nfiles != nfiles) {
+		return 0;
+	}
+	const st_pack_entry* e = pack_entries(p, app);
+	char name[64];
+	for (uint32_t i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "%d-file-%u.txt", jobapl, i + 1);
+		const char* data = pack_data(p, &e[i]);
+		if (e[i].size != i + 1 || strcmp(pack_name(p, app, &e[i]), name) != 0
+				|| data[0] != fill || data[i] != fill) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* copy len bytes of src to dst, with n bytes at off replaced by bytes */
+int copy_damaged(const char* src, const char* dst, size_t len, size_t off,
+		const void* bytes, size_t n) {
+	FILE* in = fopen(src, "r");
+	FILE* out = fopen(dst, "w");
+	if (in == NULL || out == NULL) {
+		perror("copy_damaged: fopen");
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		int c = fgetc(in);
+		if (c == EOF) {
+			break;
+		}
+		fputc(i >= off && i < off + n ? ((const unsigned char*)bytes)[i - off] : c, out);
+	}
+	fclose(in);
+	fclose(out);
+	return 0;
+}
+
+/* 1 if pack_open() refuses the damaged copy */
+int refused(const char* src, const char* dst, size_t len, size_t off,
+		const void* bytes, size_t n) {
+	copy_damaged(src, dst, len, off, bytes, n);
+	st_pack* p = pack_open(dst);
+	pack_close(p);
+	return p == NULL;
+}
+
+int main(void) {
+	char dir[] = "/tmp/pack-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[256], copy[256], tmp[256];
+	snprintf(path, sizeof(path), "%s/IBM-000123.pack", dir);
+	snprintf(copy, sizeof(copy), "%s/damaged.pack", dir);
+	snprintf(tmp, sizeof(tmp), "%s/file", dir);
+
+	/* Application_2 is delivered again, the last copy counts */
+	check("append", append_app(path, tmp, 1, 2, 'a') == 0
+			&& append_app(path, tmp, 2, 3, 'b') == 0
+			&& append_app(path, tmp, 2, 4, 'c') == 0);
+
+	st_pack* p = pack_open(path);
+	check("open", p != NULL);
+	if (p == NULL) {
+		return 1;
+	}
+	check("three applications", p->napps == 3);
+	check("Application_1", has_app(p, 1, 2, 'a'));
+	check("Application_2, the last copy", has_app(p, 2, 4, 'c'));
+	check("missing application", pack_find(p, 3) == NULL);
+	pack_close(p);
+
+	/* an append that did not finish is not read, and cut off by the next one */
+	int fd = open(path, O_WRONLY | O_APPEND);
+	check("unfinished append", fd != -1 && write(fd, "garbage", 7) == 7);
+	close(fd);
+	p = pack_open(path);
+	check("open with an unfinished append", p != NULL && p->napps == 3);
+	pack_close(p);
+	check("append after it", append_app(path, tmp, 3, 1, 'd') == 0);
+	p = pack_open(path);
+	check("open after it", p != NULL && p->napps == 4 && has_app(p, 3, 1, 'd')
+			&& has_app(p, 2, 4, 'c'));
+	if (p == NULL) {
+		return 1;
+	}
+	/* the null that ends the names of the last application */
+	const st_pack_footer* app = p->apps[p->napps - 1];
+	uint64_t name_end = app->entries + app->nfiles * sizeof(st_pack_entry)
+			+ app->names_len - 1;
+	st_pack_header hdr = p->hdr;
+	pack_close(p);
+	check("intact copy opens", !refused(path, copy, hdr.end, 0, NULL, 0));
+
+	/* damaged copies are refused */
+	uint64_t napps = 1ULL << 61;
+	uint32_t zero = 0;
+	check("truncated header refused",
+			refused(path, copy, sizeof(st_pack_header) - 1, 0, NULL, 0));
+	check("truncated data refused", refused(path, copy, hdr.end - 1, 0, NULL, 0));
+	check("bad magic refused", refused(path, copy, hdr.end, 0, &zero, sizeof(zero)));
+	check("huge napps refused", refused(path, copy, hdr.end,
+			offsetof(st_pack_header, napps), &napps, sizeof(napps)));
+	napps = hdr.napps + 1;
+	check("napps past the chain refused", refused(path, copy, hdr.end,
+			offsetof(st_pack_header, napps), &napps, sizeof(napps)));
+	check("bad footer magic refused", refused(path, copy, hdr.end,
+			hdr.last + offsetof(st_pack_footer, magic), &zero, sizeof(zero)));
+	uint64_t last = hdr.last + PACK_ALIGN;
+	check("last past the footer refused", refused(path, copy, hdr.end,
+			offsetof(st_pack_header, last), &last, sizeof(last)));
+	check("unterminated name refused", refused(path, copy, hdr.end,
+			name_end, "x", 1));
+
+	/* nor appended to: a header synced before its data, then a power loss */
+	copy_damaged(path, copy, hdr.end - 1, 0, NULL, 0);
+	struct stat sb;
+	check("truncated pack not appended to", append_app(copy, tmp, 4, 1, 'e') == -1
+			&& stat(copy, &sb) == 0 && (uint64_t)sb.st_size == hdr.end - 1);
+	copy_damaged(path, copy, hdr.end, hdr.last, &zero, sizeof(zero));
+	check("pack without its last footer not appended to",
+			append_app(copy, tmp, 4, 1, 'e') == -1);
+
+	unlink(copy);
+	unlink(tmp);
+	unlink(path);
+	rmdir(dir);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+
+/* XXH64 reference vectors, seed 0 */
+static const struct {
+	const char* input;
+	uint64_t hash;
+} vectors[] = {
+	{ "", 0xEF46DB3751D8E999ULL },
+	{ "a", 0xD24EC4F1A98C6E5BULL },
+	{ "abc", 0x44BC2CF5AD770999ULL },
+	{ "message digest", 0x066ED728FCEEB3BEULL },
+	{ "abcdefghijklmnopqrstuvwxyz", 0xCFE1F278FA89835CULL },
+	{ "Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ULL },
+	{ "1234567890123456789012345678901234567890"
+	  "1234567890123456789012345678901234567890", 0xE04A477F19EE145DULL },
+};
+
+/* hash len bytes of buf through a temporary file, as dedup_file() does */
+int hash_bytes(const void* buf, size_t len, uint64_t* hash) {
+	char path[] = "/tmp/xxh64-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+
+	int ret = -1;
+	if (write(fd, buf, len) != (ssize_t)len || lseek(fd, 0, SEEK_SET) == -1) {
+		perror("write");
+	} else {
+		ret = dedup_hash_fd(fd, hash);
+	}
+	close(fd);
+	return ret;
+}
+
+int check(const char* what, const void* buf, size_t len, uint64_t expected) {
+	uint64_t hash = 0;
+	if (hash_bytes(buf, len, &hash) == -1 || hash != expected) {
+		printf("FAIL %s: %016lx, expected %016lx\n", what, hash, expected);
+		return 1;
+	}
+	printf("ok   %s\n", what);
+	return 0;
+}
+
+int main(void) {
+	int failed = 0;
+
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		failed += check(vectors[i].input[0] ? vectors[i].input : "(empty)",
+				vectors[i].input, strlen(vectors[i].input), vectors[i].hash);
+	}
+
+	/* more than one read chunk, and a tail that is not a whole stripe */
+	size_t len = 3 * 65536 + 45;
+	unsigned char* buf = malloc(len);
+	if (buf == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (unsigned char)(i * 31 + 7);
+	}
+	failed += check("196653 bytes", buf, len, 0xF4F45BB2B821FBB4ULL);
+	free(buf);
+
+	return failed ? 1 : 0;
+}
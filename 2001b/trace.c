@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+const char* const trace_stage_names[TR_NSTAGES] = {
+	"land", "detect", "scan_begin", "scan_end", "enqueue",
+	"dispatch", "move_start", "move_end", "ack", "publish"
+};
+
+/* ring buffer of this process, NULL when tracing is disabled */
+static st_trace* trace = NULL;
+static size_t trace_size = 0;
+
+/* map dir/trace.<role>.<pid>.bin, an empty dir disables tracing */
+int trace_open(const char* dir, const char* role, uint32_t capacity) {
+	if (dir == NULL || dir[0] == '\0') {
+		return 0;
+	}
+	if (mkdir_if_need(dir) == -1) {
+		return -1;
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/trace.%s.%d.bin", dir, role, getpid());
+
+	size_t size = sizeof(st_trace) + capacity * sizeof(st_trace_event);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("trace_open: open");
+		return -1;
+	}
+	if (ftruncate(fd, size) == -1) {
+		perror("trace_open: ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	st_trace* tr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tr == MAP_FAILED) {
+		perror("trace_open: mmap");
+		return -1;
+	}
+
+	tr->magic = TRACE_MAGIC;
+	tr->version = TRACE_VERSION;
+	tr->pid = getpid();
+	snprintf(tr->role, sizeof(tr->role), "%s", role);
+	tr->capacity = capacity;
+	tr->head = 0;
+
+	trace = tr;
+	trace_size = size;
+	return 0;
+}
+
+void trace_close(void) {
+	if (trace != NULL) {
+		munmap(trace, trace_size);
+		trace = NULL;
+	}
+}
+
+int trace_enabled(void) {
+	return trace != NULL;
+}
+
+/* record one event: no syscall, no lock, only this process writes here */
+void trace_event(int stage, const char* jobref, int jobapl, int flags) {
+	if (trace == NULL) {
+		return;
+	}
+	trace_event_at(stage, now_ns(), jobref, jobapl, flags);
+}
+
+/* same as trace_event() with a timestamp taken by the caller */
+void trace_event_at(int stage, uint64_t ts_ns, const char* jobref,
+		int jobapl, int flags) {
+	if (trace == NULL) {
+		return;
+	}
+
+	uint64_t n = trace->head;
+	st_trace_event* ev = &trace->events[n % trace->capacity];
+	ev->ts_ns = ts_ns;
+	ev->jobapl = jobapl;
+	ev->stage = stage;
+	ev->flags = flags;
+	if (jobref != NULL) {
+		strncpy(ev->jobref, jobref, sizeof(ev->jobref));
+	} else {
+		memset(ev->jobref, 0, sizeof(ev->jobref));
+	}
+	/* publish the slot before moving head, for readers of a live file */
+	__atomic_store_n(&trace->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/* same as trace_event() for a "jobref/jobapl" job string */
+void trace_job(int stage, const char* job, int flags) {
+	if (trace == NULL) {
+		return;
+	}
+
+	char jobref[128];
+	int jobapl = 0;
+	if (sscanf(job, "%127[^/]/%d", jobref, &jobapl) != 2) {
+		return;
+	}
+	trace_event(stage, jobref, jobapl, flags);
+}
+
+/* read-only mapping of a trace file, for the offline converter */
+st_trace* trace_map(const char* path, size_t* size) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(st_trace)) {
+		close(fd);
+		return NULL;
+	}
+
+	st_trace* tr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tr == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (tr->magic != TRACE_MAGIC || tr->version != TRACE_VERSION
+			|| sizeof(st_trace) + tr->capacity * sizeof(st_trace_event)
+				> (size_t)sb.st_size) {
+		munmap(tr, sb.st_size);
+		return NULL;
+	}
+
+	*size = sb.st_size;
+	return tr;
+}
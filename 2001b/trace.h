@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC 0x46425452 /* "FBTR" */
+#define TRACE_VERSION 1
+#define TRACE_EVENTS_DEFAULT 65536
+#define TRACE_JOBREF_MAX 16
+
+/* trace points, in pipeline order */
+enum trace_stage {
+	TR_LAND = 0,	/* candidate-data file ctime, seen by the monitor */
+	TR_DETECT,	/* monitor read the inotify event */
+	TR_SCAN_BEGIN,	/* parent starts scan_dir() */
+	TR_SCAN_END,
+	TR_ENQUEUE,	/* application pushed to the fifo */
+	TR_DISPATCH,	/* job written to a worker pipe */
+	TR_MOVE_START,	/* worker starts copy_all_files() */
+	TR_MOVE_END,
+	TR_ACK,		/* parent read the worker answer */
+	TR_PUBLISH,	/* parent reported it, after the sync with durability = batch */
+	TR_NSTAGES
+};
+
+/* one event, 32 bytes */
+typedef struct {
+	uint64_t ts_ns;	/* CLOCK_MONOTONIC */
+	int32_t jobapl;	/* 0 if the event is not about an application */
+	uint16_t stage;
+	uint16_t flags;	/* TR_ACK: 1 if the job failed */
+	char jobref[TRACE_JOBREF_MAX]; /* not null terminated if full */
+} st_trace_event;
+
+/**
+ * Per-process ring buffer, a file mapped with MAP_SHARED so that the events
+ * survive a crash of the process. `head` counts every event ever written,
+ * the slot of event n is n % capacity.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	pid_t pid;
+	char role[12];	/* "monitor", "parent", "worker" */
+	uint32_t capacity;
+	uint64_t head;
+	st_trace_event events[];
+} st_trace;
+
+extern const char* const trace_stage_names[TR_NSTAGES];
+
+int trace_open(const char* dir, const char* role, uint32_t capacity);
+void trace_close(void);
+int trace_enabled(void);
+void trace_event(int stage, const char* jobref, int jobapl, int flags);
+void trace_event_at(int stage, uint64_t ts_ns, const char* jobref,
+		int jobapl, int flags);
+void trace_job(int stage, const char* job, int flags);
+
+st_trace* trace_map(const char* path, size_t* size);
+
+#endif /* !TRACE_H */
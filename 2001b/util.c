@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -6,9 +7,11 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "pack.h"
 #include "util.h"
 
 /**
@@ -66,24 +69,16 @@ void vec_insert(Vec* vec, size_t item_idx, char* item) {
 }
 
 char* vec_remove(Vec* vec, size_t item_idx) {
-	if (item_idx >= vec->capacity) {
+	if (item_idx >= vec->size) {
 		return NULL;
 	}
 
 	char* removed = vec->items[item_idx];
-	vec->items[item_idx] = NULL;
 
-	// Move items left after removing
-	size_t i;
-	size_t capacity = vec->capacity;
-	size_t limit = capacity - 1;
-	for (i = item_idx; i < limit; i+=2) {
-		vec->items[i] = vec->items[i+1];
-		vec->items[i+1] = vec->items[i+2];
-	}
-	for (; i < capacity; i++) {
-		vec->items[i] = vec->items[i+1];
-	}
+	// Move items left after removing, only the used part of the vector
+	memmove(&vec->items[item_idx], &vec->items[item_idx+1],
+			(vec->size - item_idx - 1) * sizeof(char*));
+	vec->items[vec->size-1] = NULL;
 
 	vec->size--;
 
@@ -111,7 +106,104 @@ char* vec_pop(Vec* vec) {
 	return popped;
 }
 
-st_workers* st_workers_create(int num_workers) {
+st_imap* imap_create(void) {
+	st_imap* m = (st_imap*)malloc(sizeof(st_imap));
+	if (m == NULL) {
+		die("malloc:");
+	}
+	m->size = 0;
+	m->capacity = 64;
+	m->keys = (int*)malloc(m->capacity * sizeof(int));
+	m->values = (void**)calloc(m->capacity, sizeof(void*));
+	if (m->keys == NULL || m->values == NULL) {
+		die("malloc:");
+	}
+	memset(m->keys, -1, m->capacity * sizeof(int));
+	return m;
+}
+
+/* the values are not freed, like Vec */
+void imap_destroy(st_imap* m) {
+	if (m != NULL) {
+		free(m->keys);
+		free(m->values);
+		free(m);
+	}
+}
+
+static size_t imap_slot(const st_imap* m, int key) {
+	/* Fibonacci hashing: consecutive keys land far apart */
+	size_t i = ((uint32_t)key * 2654435769u) & (m->capacity - 1);
+	while (m->keys[i] != -1 && m->keys[i] != key) {
+		i = (i + 1) & (m->capacity - 1);
+	}
+	return i;
+}
+
+void* imap_get(const st_imap* m, int key) {
+	size_t i = imap_slot(m, key);
+	return m->keys[i] == key ? m->values[i] : NULL;
+}
+
+/* double the table, the entries move to their new slots */
+static void imap_grow(st_imap* m) {
+	st_imap old = *m;
+	m->capacity *= 2;
+	m->keys = (int*)malloc(m->capacity * sizeof(int));
+	m->values = (void**)calloc(m->capacity, sizeof(void*));
+	if (m->keys == NULL || m->values == NULL) {
+		die("malloc:");
+	}
+	memset(m->keys, -1, m->capacity * sizeof(int));
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (old.keys[i] != -1) {
+			size_t j = imap_slot(m, old.keys[i]);
+			m->keys[j] = old.keys[i];
+			m->values[j] = old.values[i];
+		}
+	}
+	free(old.keys);
+	free(old.values);
+}
+
+void imap_put(st_imap* m, int key, void* value) {
+	if ((m->size + 1) * 2 > m->capacity) {
+		imap_grow(m);
+	}
+
+	size_t i = imap_slot(m, key);
+	if (m->keys[i] == -1) {
+		m->keys[i] = key;
+		m->size++;
+	}
+	m->values[i] = value;
+}
+
+/* remove key, returns its value or NULL */
+void* imap_del(st_imap* m, int key) {
+	size_t i = imap_slot(m, key);
+	if (m->keys[i] != key) {
+		return NULL;
+	}
+	void* value = m->values[i];
+	m->keys[i] = -1;
+	m->size--;
+
+	/* move back the entries of the run after i that probed past it */
+	size_t mask = m->capacity - 1;
+	for (size_t j = (i + 1) & mask; m->keys[j] != -1; j = (j + 1) & mask) {
+		size_t home = ((uint32_t)m->keys[j] * 2654435769u) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m->keys[i] = m->keys[j];
+			m->values[i] = m->values[j];
+			m->keys[j] = -1;
+			i = j;
+		}
+	}
+	return value;
+}
+
+st_workers* st_workers_create(int max_workers) {
 	st_workers* ws = (st_workers*)malloc(sizeof(st_workers));
 	if (ws == NULL) {
 		die("malloc:");
@@ -122,22 +214,17 @@ st_workers* st_workers_create(int num_workers) {
 	 * int worker_pipes[2N][2];
 	 */
 	/* array of pointers */
-	int** worker_pipes = (int**)malloc(2 * num_workers * sizeof(int*));
+	int** worker_pipes = (int**)malloc(2 * max_workers * sizeof(int*));
 	if (worker_pipes == NULL) {
 		die("malloc:");
 	}
-	/* each pointer points to int fd[2] */
-	for(int i = 0; i < 2 * num_workers; i++) {
+	/* each pointer points to int fd[2], opened by worker_pipes_open() */
+	for(int i = 0; i < 2 * max_workers; i++) {
 		worker_pipes[i] = (int*)malloc(2 * sizeof(int));
 		if (worker_pipes[i] == NULL) {
 			die("malloc:");
 		}
-	}
-	/* create 2N pipes */
-	for(int i = 0; i < 2 * num_workers; i++) {
-		if(pipe(worker_pipes[i]) == -1) {
-			die("pipe:");
-		}
+		worker_pipes[i][0] = worker_pipes[i][1] = -1;
 	}
 
 	ws->worker_pipes = worker_pipes;
@@ -146,35 +233,154 @@ st_workers* st_workers_create(int num_workers) {
 	}
 
 	/* does not fill pids, done later after the creation of workers */
-	ws->pids = (pid_t*)malloc(num_workers * sizeof(pid_t));
+	ws->pids = (pid_t*)malloc(max_workers * sizeof(pid_t));
 	if (ws->pids == NULL) {
 		die("malloc:");
 	}
 
-	long size = num_workers * sizeof(int);
+	long size = max_workers * sizeof(int);
 	ws->ready = (int*)malloc(size);
 	if (ws->ready == NULL) {
 		die("malloc:");
 	}
 	/* set all workers to ready state */
 	//memset(ws->ready, 1, size);
-	for (int i = 0; i < num_workers; i++) {
+	for (int i = 0; i < max_workers; i++) {
 		ws->ready[i] = 1;
 	}
 
 	memset(ws->pids, 0, size);
 
+	ws->jobs = (struct st_job**)calloc(max_workers, sizeof(struct st_job*));
+	if (ws->jobs == NULL) {
+		die("calloc:");
+	}
+	ws->dispatched_ns = (uint64_t*)calloc(max_workers, sizeof(uint64_t));
+	if (ws->dispatched_ns == NULL) {
+		die("calloc:");
+	}
+
 	return ws;
 }
 
-void st_workers_destroy(st_workers* ws, int num_workers) {
-	for (int i = 0; i < num_workers; i++) {
+/* the two pipes of worker i, before it is forked */
+int worker_pipes_open(st_workers* ws, int i) {
+	if (pipe(ws->worker_pipes[i*2]) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	if (pipe(ws->worker_pipes[i*2+1]) == -1) {
+		perror("pipe");
+		close(ws->worker_pipes[i*2][0]);
+		close(ws->worker_pipes[i*2][1]);
+		ws->worker_pipes[i*2][0] = ws->worker_pipes[i*2][1] = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void st_workers_destroy(st_workers* ws, int max_workers) {
+	for (int i = 0; i < max_workers; i++) {
 		free(ws->worker_pipes[i*2]); /* parent fd[1] --> worker fd[0] */
 		free(ws->worker_pipes[i*2+1]); /* parent fd[0] <-- worker fd[1] */
 	}
 	free(ws->worker_pipes);
 	free(ws->pids);
 	free(ws->ready);
+	for (int i = 0; i < max_workers; i++) {
+		free(ws->jobs[i]);
+	}
+	free(ws->jobs);
+	free(ws->dispatched_ns);
+}
+
+void manifest_reset(st_manifest* m) {
+	m->len = 0;
+	m->nfiles = 0;
+	m->bytes = 0;
+}
+
+/* make room for len bytes of names */
+void manifest_reserve(st_manifest* m, size_t len) {
+	if (len <= m->capacity) {
+		return;
+	}
+	size_t new_capacity = m->capacity ? m->capacity * 2 : 256;
+	while (new_capacity < len) {
+		new_capacity *= 2;
+	}
+	char* new_names = realloc(m->names, new_capacity);
+	if (new_names == NULL) {
+		die("realloc:");
+	}
+	m->names = new_names;
+	m->capacity = new_capacity;
+}
+
+/* make room for nfiles sizes */
+void manifest_reserve_files(st_manifest* m, size_t nfiles) {
+	if (nfiles <= m->sizes_capacity) {
+		return;
+	}
+	size_t new_capacity = m->sizes_capacity ? m->sizes_capacity * 2 : 16;
+	while (new_capacity < nfiles) {
+		new_capacity *= 2;
+	}
+	uint64_t* new_sizes = realloc(m->sizes, new_capacity * sizeof(uint64_t));
+	if (new_sizes == NULL) {
+		die("realloc:");
+	}
+	m->sizes = new_sizes;
+	m->sizes_capacity = new_capacity;
+}
+
+void manifest_add(st_manifest* m, const char* name, uint64_t size) {
+	size_t n = strlen(name) + 1;
+	manifest_reserve(m, m->len + n);
+	manifest_reserve_files(m, m->nfiles + 1);
+	memcpy(m->names + m->len, name, n);
+	m->len += n;
+	m->sizes[m->nfiles] = size;
+	m->nfiles++;
+	m->bytes += size;
+}
+
+void manifest_free(st_manifest* m) {
+	free(m->names);
+	free(m->sizes);
+	memset(m, 0, sizeof(*m));
+}
+
+/* read exactly count bytes: returns count, 0 on EOF, -1 on error */
+ssize_t read_full(int fd, void* buf, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = read(fd, (char*)buf + done, count - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return n;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* write exactly count bytes: returns count, -1 on error */
+ssize_t write_full(int fd, const void* buf, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = write(fd, (const char*)buf + done, count - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return -1;
+		}
+		done += n;
+	}
+	return done;
 }
 
 /* Check if a directory exists; returns 1 if it does, 0 if not */
@@ -185,7 +391,8 @@ int dir_exists(const char* dir) {
 
 int mkdir_if_need(const char* dir) {
 	if (!dir_exists(dir)) {
-		if (mkdir(dir, 0755) == -1) {
+		/* another worker may create it in between */
+		if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
 			perror("mkdir");
 			return -1;
 		}
@@ -193,6 +400,17 @@ int mkdir_if_need(const char* dir) {
 	return 0;
 }
 
+/* fsync (fdatasync if data_only) a file or directory by name */
+int fsync_path(const char* path, int data_only) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	int ret = data_only ? fdatasync(fd) : fsync(fd);
+	close(fd);
+	return ret;
+}
+
 /* match a regular expression: ret -1 if error, 0 if no match found, 1 if found */
 int matches_regex(const char* str, const char* regex_pattern) {
 	regex_t reg;
@@ -215,30 +433,130 @@ int matches_regex(const char* str, const char* regex_pattern) {
 	return err == 0 ? 1 : 0;
 }
 
-int generate_report_file(const char* output_dir) {
-	int fd = open("report.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd == -1) {
-		perror("generate_report_file: open");
+int get_jobapl_from_filename(const char* filename) {
+	int num_apl = 0;
+	int base = 1;
+	/* number before '-' */
+	for (int i = 0; filename[i] != '-' && filename[i] != '\0'; i++) {
+		if (filename[i] < '0' || filename[i] > '9') {
+			return -1;
+		}
+		num_apl = num_apl * base + (filename[i] - '0');
+		base = 10;
+	}
+	return num_apl;
+}
+
+/* get jobref from x-candidate-data.txt by extracting the first line */
+int get_jobref_from_ca_data(char* jobref, size_t nbytes, char* ca_data) {
+	FILE* fp = fopen(ca_data, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fgets(jobref, nbytes, fp) == NULL) {
+		fclose(fp);
 		return -1;
 	}
 
-	dup2(fd, STDOUT_FILENO);
-	close(fd);
-	execv("/usr/bin/tree", (char*[]){"tree", (char*)output_dir, NULL});
-	perror("generate_report_file: execv");
-	return -1;
+	/* ensure jobref has null terminator instead of newline */
+	jobref[strcspn(jobref, "\n")] = '\0';
+
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * path of an application below output_dir: jobref/Application_N, or with
+ * fanout levels jobref/00/17/Application_1700. Each level takes two digits
+ * of N / 100, so a directory holds at most 100 applications or 100
+ * subdirectories; only the first level grows past 100 entries, once N
+ * passes 100^(fanout+1). With fanout OUTPUT_FANOUT_PACK the application
+ * is in a pack (see pack.h): jobref.pack:Application_N. Returns the
+ * length, -1 if buf is too small.
+ */
+int app_relpath(char* buf, size_t size, const char* jobref, int jobapl, int fanout) {
+	if (fanout == OUTPUT_FANOUT_PACK) {
+		size_t len = snprintf(buf, size, "%s%s:Application_%d", jobref, PACK_SUFFIX, jobapl);
+		return len < size ? (int)len : -1;
+	}
+	char digits[32];
+	int ndigits = snprintf(digits, sizeof(digits), "%0*d", 2 * fanout, jobapl / 100);
+
+	size_t len = snprintf(buf, size, "%s", jobref);
+	/* the first level takes the digits beyond 2 per level */
+	int d = 0;
+	for (int level = 0; level < fanout && len < size; level++) {
+		int n = level == 0 ? ndigits - 2 * (fanout - 1) : 2;
+		len += snprintf(buf + len, size - len, "/%.*s", n, digits + d);
+		d += n;
+	}
+	if (len < size) {
+		len += snprintf(buf + len, size - len, "/Application_%d", jobapl);
+	}
+	return len < size ? (int)len : -1;
 }
 
+/* monotonic clock in nanoseconds, for rates and latencies */
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* wait up to grace_ms for pid to exit, SIGKILL it afterwards */
+static void reap(pid_t pid, int grace_ms) {
+	for (int waited = 0; waited < grace_ms; waited += 10) {
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			return;
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * Stop idle worker i when the pool shrinks: it sees its pipe closed or
+ * SIGTERM, whichever comes first, and exits its loop.
+ */
+void worker_stop(st_workers* ws, int i) {
+	close(ws->worker_pipes[i*2][1]);
+	close(ws->worker_pipes[i*2+1][0]);
+	ws->worker_pipes[i*2][1] = ws->worker_pipes[i*2+1][0] = -1;
+	if (ws->pids[i] > 0) {
+		kill(ws->pids[i], SIGTERM);
+		reap(ws->pids[i], CLEANUP_GRACE_MS);
+	}
+	ws->pids[i] = 0;
+	ws->ready[i] = 1;
+	free(ws->jobs[i]);
+	ws->jobs[i] = NULL;
+}
+
+/**
+ * Ask the children to exit with SIGTERM, so that they leave their loops
+ * and run their exit handlers, and only SIGKILL the ones that do not.
+ */
 void cleanup(st_workers* ws, int num_workers, pid_t pid_monitor) {
 	for (int i = 0; i < num_workers; i++) {
 		close(ws->worker_pipes[i*2][1]);
 		close(ws->worker_pipes[i*2+1][0]);
-		kill(ws->pids[i], SIGKILL);
-		waitpid(ws->pids[i], NULL, 0);
+		if (ws->pids[i] > 0) {
+			kill(ws->pids[i], SIGTERM);
+		}
+	}
+	if (pid_monitor > 0) {
+		kill(pid_monitor, SIGTERM);
 	}
 
-	kill(pid_monitor, SIGKILL);
-	waitpid(pid_monitor, NULL, 0);
+	for (int i = 0; i < num_workers; i++) {
+		if (ws->pids[i] > 0) {
+			reap(ws->pids[i], CLEANUP_GRACE_MS);
+		}
+	}
+	if (pid_monitor > 0) {
+		reap(pid_monitor, CLEANUP_GRACE_MS);
+	}
 }
 
 void die(const char *fmt, ...) {
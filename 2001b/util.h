@@ -3,6 +3,11 @@
 
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* time given to the children to exit after SIGTERM */
+#define CLEANUP_GRACE_MS 1000
 
 /* structure for FIFO */
 typedef struct {
@@ -11,15 +16,63 @@ typedef struct {
 	size_t capacity;
 } Vec;
 
+/**
+ * Hash map from int keys >= 0, such as inotify watch descriptors, to
+ * pointers the caller owns. Open addressing with linear probing, kept at
+ * most half full, so lookups stay O(1) with thousands of keys.
+ */
+typedef struct {
+	int* keys;		/* -1: free slot */
+	void** values;
+	size_t size;
+	size_t capacity;	/* power of two */
+} st_imap;
+
+
+struct st_job;
 
-/* structure for managing worker info */
+/* workers the pool can grow to after a reload, unless max_workers is set */
+#define WORKERS_MAX_DEFAULT 64
+
+/* watchdog: a busy worker silent this long, or on one job this long, is hung */
+#define WORKER_STALL_MS_DEFAULT 30000
+#define JOB_TIMEOUT_MS_DEFAULT 600000
+
+/* structure for managing worker info, sized for max_workers */
 typedef struct {
-	int** worker_pipes;	/* int fd[2N][2] */
+	int** worker_pipes;	/* int fd[2N][2], -1 once the worker is stopped */
 	pid_t* pids;		/* pid_t pid[N] */
 	int* ready; 		/* int ready[N] */
+	struct st_job** jobs;	/* st_job* jobs[N], job in flight, parent only */
+	uint64_t* dispatched_ns;	/* uint64_t dispatched_ns[N], when jobs[i] was sent */
 } st_workers;
 
 
+/* files moved for one application, sent back to the parent with the ack */
+typedef struct {
+	char* names;		/* null separated file names */
+	size_t len;
+	size_t capacity;
+	uint64_t* sizes;	/* sizes[nfiles] */
+	size_t sizes_capacity;
+	uint32_t nfiles;
+	uint64_t bytes;
+} st_manifest;
+
+/**
+ * worker answer, followed by names_len bytes of st_manifest names and
+ * nfiles uint64_t sizes.
+ * Sent on the worker's own pipe, so it needs no PIPE_BUF atomicity.
+ */
+typedef struct {
+	int status;		/* 0: done, -1: failed, job must be retried,
+				   1: skipped, the application left the spool,
+				   2: busy, another instance holds its lease */
+	uint32_t nfiles;
+	uint64_t bytes;
+	uint32_t names_len;
+} st_ack;
+
 Vec* vec_create(size_t capacity);
 void vec_destroy(Vec* vec);
 void vec_grow(Vec* vec);
@@ -28,15 +81,40 @@ char* vec_remove(Vec* vec, size_t item_idx);
 void vec_push(Vec* vec, char* item);
 char* vec_pop(Vec* vec);
 
-st_workers* st_workers_create(int num_workers);
-void st_workers_destroy(st_workers* ws, int num_workers);
+st_imap* imap_create(void);
+void imap_destroy(st_imap* m);
+void* imap_get(const st_imap* m, int key);
+void imap_put(st_imap* m, int key, void* value);
+void* imap_del(st_imap* m, int key);
+
+st_workers* st_workers_create(int max_workers);
+void st_workers_destroy(st_workers* ws, int max_workers);
+int worker_pipes_open(st_workers* ws, int i);
+
+void manifest_reset(st_manifest* m);
+void manifest_reserve(st_manifest* m, size_t len);
+void manifest_reserve_files(st_manifest* m, size_t nfiles);
+void manifest_add(st_manifest* m, const char* name, uint64_t size);
+void manifest_free(st_manifest* m);
+
+ssize_t read_full(int fd, void* buf, size_t count);
+ssize_t write_full(int fd, const void* buf, size_t count);
 
 int dir_exists(const char* dir);
 int mkdir_if_need(const char* dir);
+int fsync_path(const char* path, int data_only);
 int matches_regex(const char* str, const char* regex_pattern);
-int generate_report_file(const char* output_dir);
+int get_jobapl_from_filename(const char* filename);
+int get_jobref_from_ca_data(char* jobref, size_t nbytes, char* ca_data);
+
+uint64_t now_ns(void);
+
+#define OUTPUT_FANOUT_MAX 4
+#define OUTPUT_FANOUT_PACK -1	/* output_format = pack, see app_relpath() */
+int app_relpath(char* buf, size_t size, const char* jobref, int jobapl, int fanout);
 
+void worker_stop(st_workers* ws, int i);
 void cleanup(st_workers* ws, int num_workers, pid_t pid_monitor);
-void die(const char *fmt, ...);
+void die(const char *fmt, ...) __attribute__((noreturn));
 
 #endif /* !UTIL_H */